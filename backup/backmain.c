@@ -303,10 +303,16 @@ backup_main (int argc, char **argv)
 	else
 	{
 		unsigned starttime;
-		char buf[BUFSIZE];
+		char *buf = tivo_partition_buffer_alloc (BUFSIZE);
 		uint64_t cursec = 0, curcount;
 		int fd;
 
+		if (!buf)
+		{
+			fprintf (stderr, "Out of memory!\n");
+			return 1;
+		}
+
 		if (filename[0] == '-' && filename[1] == '\0')
 			fd = 1;
 		else
@@ -319,6 +325,7 @@ backup_main (int argc, char **argv)
 		if (fd < 0)
 		{
 			perror (filename);
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -334,6 +341,7 @@ backup_main (int argc, char **argv)
 				backup_perror (info, "Backup");
 			else
 				fprintf (stderr, "Backup failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -351,6 +359,7 @@ backup_main (int argc, char **argv)
 			if (write (fd, buf, curcount) != curcount)
 			{
 				fprintf (stderr, "Backup failed: %s: %s\n", filename, strerror(errno));
+				tivo_partition_buffer_free (buf);
 				return 1;
 			}
 			cursec += curcount / 512;
@@ -381,8 +390,11 @@ backup_main (int argc, char **argv)
 				backup_perror (info, "Backup");
 			else
 				fprintf (stderr, "Backup failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
+
+		tivo_partition_buffer_free (buf);
 	}
 
 	if (backup_finish (info) < 0)
@@ -399,5 +411,14 @@ backup_main (int argc, char **argv)
 	else if (quiet < 2)
 		fprintf (stderr, "Backup done!\n");
 
+	if (quiet < 1)
+	{
+		uint64_t hinted, hits, misses;
+
+		mfs_readahead_stats (info->mfs, &hinted, &hits, &misses);
+		if (hits + misses > 0)
+			fprintf (stderr, "Readahead: %llu mb hinted, %llu%% of planned reads hinted in time\n", (unsigned long long) hinted / 2048, (unsigned long long) (hits * 100 / (hits + misses)));
+	}
+
 	return 0;
 }
@@ -557,6 +557,7 @@ backup_state_partitions (struct backup_info *info, void *data, unsigned size, un
 {
 	tpFILE *file;
 	int tocopy = info->parts[info->state_val1].sectors - info->state_val2;
+	int retval;
 
 	if (size == 0)
 	{
@@ -589,7 +590,14 @@ backup_state_partitions (struct backup_info *info, void *data, unsigned size, un
 		}
 	}
 
-	if (tivo_partition_read (file, data, info->state_val2, tocopy) < 0)
+/* Byte-swapped partitions are read as they are on disk, and swapped while */
+/* computing the CRC. */
+	if (_tivo_partition_swab (file))
+		retval = tivo_partition_read_raw (file, data, info->state_val2, tocopy);
+	else
+		retval = tivo_partition_read (file, data, info->state_val2, tocopy);
+
+	if (retval < 0)
 	{
 		info->err_msg = "%s backing up partitions";
 		if (errno)
@@ -599,6 +607,12 @@ backup_state_partitions (struct backup_info *info, void *data, unsigned size, un
 		return bsError;
 	}
 
+	if (_tivo_partition_swab (file))
+	{
+		info->crc = compute_crc_combine (info->crc, swab_compute_crc (data, tocopy * 512, 0), tocopy * 512);
+		info->crc_done = 1;
+	}
+
 	*consumed = tocopy;
 	info->state_val2 += tocopy;
 
@@ -630,6 +644,7 @@ backup_next_sectors (struct backup_info *info, char *buf, int sectors)
 	while (sectors > 0 && info->state < bsMax && info->state >= bsBegin)
 	{
 		consumed = 0;
+		info->crc_done = 0;
 
 		ret = ((*info->state_machine)[info->state]) (info, buf, sectors, &consumed);
 
@@ -668,10 +683,12 @@ backup_next_sectors (struct backup_info *info, char *buf, int sectors)
 			return -1;
 		}
 
-/* Deal with consumed buffer */
+/* Deal with consumed buffer.  Each piece is CRCed on its own and merged */
+/* into the running CRC, so the CRC of one piece never waits on the last. */
 		if (consumed > 0)
 		{
-			info->crc = compute_crc (buf, consumed * 512, info->crc);
+			if (!info->crc_done)
+				info->crc = compute_crc_combine (info->crc, compute_crc (buf, consumed * 512, 0), consumed * 512);
 			info->cursector += consumed;
 			backup_blocks += consumed;
 			sectors -= consumed;
@@ -707,7 +724,7 @@ backup_read (struct backup_info *info, char *buf, unsigned int size)
 				return -1;
 			}
 
-			info->comp_buf = calloc (2048, 512);
+			info->comp_buf = tivo_partition_buffer_alloc (2048 * 512);
 			if (!info->comp_buf)
 			{
 				info->err_msg = "Memory exhausted";
@@ -717,7 +734,7 @@ backup_read (struct backup_info *info, char *buf, unsigned int size)
 			info->comp = calloc (sizeof (*info->comp), 1);
 			if (!info->comp)
 			{
-				free (info->comp_buf);
+				tivo_partition_buffer_free (info->comp_buf);
 				info->err_msg = "Memory exhausted";
 				return -1;
 			}
@@ -730,7 +747,7 @@ backup_read (struct backup_info *info, char *buf, unsigned int size)
 			info->comp->avail_out = 0;
 			if (deflateInit (info->comp, BF_COMPLVL (info->back_flags)) != Z_OK)
 			{
-				free (info->comp_buf);
+				tivo_partition_buffer_free (info->comp_buf);
 				free (info->comp);
 				info->err_msg = "Compression init error";
 				return -1;
@@ -767,7 +784,7 @@ backup_read (struct backup_info *info, char *buf, unsigned int size)
 				}
 				if (nread == 0)
 				{
-					free (info->comp_buf);
+					tivo_partition_buffer_free (info->comp_buf);
 					info->comp_buf = 0;
 					continue;
 				}
@@ -361,7 +361,7 @@ backup_scan_inode_blocks (struct backup_info *info)
 /* Add inodes. */
 	for (loop = 0; loop < ninodes; loop++)
 	{
-		mfs_inode *inode = mfs_read_inode (info->mfs, loop);
+		mfs_inode *inode = mfs_borrow_inode (info->mfs, loop);
 
 		if (inode)
 		{
@@ -410,7 +410,7 @@ backup_scan_inode_blocks (struct backup_info *info)
 						{
 							free_block_list_array (blocks);
 							free_block_list (&pool);
-							free (inode);
+							mfs_release_inode (info->mfs, inode);
 							info->err_msg = "Memory exhausted";
 							return 0;
 						}
@@ -449,7 +449,7 @@ backup_scan_inode_blocks (struct backup_info *info)
 					}
 				}
 			}
-			free (inode);
+			mfs_release_inode (info->mfs, inode);
 		}
 	}
 
@@ -737,49 +737,112 @@ backup_state_partitions (struct backup_info *info, void *data, unsigned size, un
 /* Backup zone maps */
 /* state_val1 = current block */
 /* state_val2 = current sector within block */
-/* state_ptr1 = --unused-- */
+/* state_ptr1 = set once the readahead plan is made */
 /* shared_val1 = --unused-- */
 enum backup_state_ret
 backup_state_blocks_v1 (struct backup_info *info, void *data, unsigned size, unsigned *consumed)
 {
+/* On a byte-swapped drive, read the data as is and swap it while computing */
+/* the CRC. */
+	int swab = mfs_is_swabbed (info->mfs);
+
 	if (size == 0)
 	{
 		info->err_msg = "Internal error: Backup buffer full";
 		return bsError;
 	}
 
+	info->crc_done = swab;
+
+/* Let the volume layer read ahead through the blocks.  It's only a hint, */
+/* so if there isn't memory for it, just go without. */
+	if (!info->state_ptr1)
+	{
+		struct volume_readahead_extent *extents = malloc (sizeof (*extents) * info->nblocks);
+		int loop;
+
+		if (extents)
+		{
+			for (loop = 0; loop < info->nblocks; loop++)
+			{
+				extents[loop].sector = info->blocks[loop].firstsector;
+				extents[loop].count = info->blocks[loop].sectors;
+			}
+
+			mfs_readahead_plan (info->mfs, extents, info->nblocks);
+			free (extents);
+		}
+
+		info->state_ptr1 = info->blocks;
+	}
+
 	while (info->state_val1 < info->nblocks)
 	{
-		while (info->state_val2 < info->blocks[info->state_val1].sectors)
+		struct volume_readahead_extent extents[MFSVOL_AIO_DEPTH];
+		unsigned int block = info->state_val1;
+		uint64_t offset = info->state_val2;
+		unsigned int room = size - *consumed;
+		int nextents = 0;
+		int nread;
+
+		/* If the buffer is full, request more data */
+		if (room == 0)
+		{
+			return bsMoreData;
+		}
+
+		/* Gather as many of the next blocks as fit in the buffer, so they */
+		/* are all read at once. */
+		while (room > 0 && block < info->nblocks && nextents < MFSVOL_AIO_DEPTH)
 		{
-			int tocopy = info->blocks[info->state_val1].sectors - info->state_val2;
-			int nread;
+			uint64_t tocopy = info->blocks[block].sectors - offset;
 
-			if (tocopy > size - *consumed)
-				tocopy = size - *consumed;
+			if (tocopy > room)
+				tocopy = room;
 
-			/* If count is 0 it's because size is 0, so request more data */
-			/* It is impossible for count to be initialized to 0 due to the */
-			/* loop condition. */
-			if (tocopy == 0)
+			if (tocopy > 0)
 			{
-				return bsMoreData;
+				extents[nextents].sector = info->blocks[block].firstsector + offset;
+				extents[nextents].count = tocopy;
+				nextents++;
+				room -= tocopy;
 			}
 
-			nread = mfs_read_data (info->mfs, (char *)data + *consumed * 512, info->blocks[info->state_val1].firstsector + info->state_val2, tocopy);
-			if (nread < 512)
+			block++;
+			offset = 0;
+		}
+
+		if (nextents == 0)
+		{
+			break;
+		}
+
+		nread = mfs_read_extents (info->mfs, (char *)data + *consumed * 512, extents, nextents, swab);
+		if (nread < 512)
+		{
+			return bsError;
+		}
+
+		nread &= ~511;
+		if (swab)
+			info->crc = compute_crc_combine (info->crc, swab_compute_crc ((unsigned char *)data + *consumed * 512, nread, 0), nread);
+
+		*consumed += nread / 512;
+
+		/* Move on through the blocks that were read, to the start of the */
+		/* next one if a block is done */
+		for (nread /= 512; info->state_val1 < info->nblocks; info->state_val1++, info->state_val2 = 0)
+		{
+			uint64_t left = info->blocks[info->state_val1].sectors - info->state_val2;
+
+			if (nread < left)
 			{
-				return bsError;
+				info->state_val2 += nread;
+				break;
 			}
 
-			*consumed += nread / 512;
-			info->state_val2 += nread / 512;
+			nread -= left;
 		}
-
-		/* Breaking out of the loop without a return means the block is */
-		/* done, so move on to the start of the next block */
-		info->state_val1++;
-		info->state_val2 = 0;
 	}
 
 	/* Breaking out of the loop without a return means all the blocks are */
@@ -80,138 +80,166 @@ backup_inode_list_add (unsigned **listinode, unsigned **listfsid, unsigned *allo
 	return 0;
 }
 
-/*****************************************************************/
-/* Scan the inode table and generate a list of inodes to backup. */
-unsigned
-backup_scan_inodes (struct backup_info *info)
+/* Running totals for backup_scan_inodes while the inodes go by. */
+struct backup_scan_state
 {
-	unsigned int loop, loop2, loop3;
-	int ninodes = mfs_inode_count (info->mfs);
-	uint64_t highest = 0;
+	struct backup_info *info;
+	unsigned *fsids;
+	unsigned allocated;
+	uint64_t highest;
+	uint64_t appsectors;
+	uint64_t mediasectors;
+	unsigned int mediainodes;
+	unsigned int appinodes;
 	unsigned char inodebuf[512];
-	unsigned *fsids = NULL;
-
-	uint64_t appsectors = 0, mediasectors = 0;
-	unsigned int mediainodes = 0, appinodes = 0;
-
-	unsigned allocated = 0;
+};
 
-	info->inodes = NULL;
+/*********************************************************************/
+/* Add one inode to the backup list, called through mfs_scan_inodes. */
+static int
+backup_scan_inode (struct mfs_handle *mfs, unsigned int loop, mfs_inode *inode, void *arg)
+{
+	struct backup_scan_state *scan = arg;
+	struct backup_info *info = scan->info;
+	unsigned int loop2;
 
-/* Get the log type to use for inode updates */
-	if (!info->mfs->inode_log_type)
-	{
-		info->err_msg = "Unable to determine transaction type for inode updates";
+	if (mfs_has_error (info->mfs))
 		return -1;
-	}
-	info->ilogtype = info->mfs->inode_log_type;
-
-/* Add inodes. */
-	for (loop = 0; loop < ninodes; loop++)
-	{
-		mfs_inode *inode = (mfs_inode *)inodebuf;
-
-		int ret = mfs_read_inode_to_buf (info->mfs, loop, inode);
-
-		if (mfs_has_error (info->mfs))
-		{
-			if (info->inodes)
-				free (info->inodes);
-			info->inodes = 0;
-			return ~0;
-		}
 
 /* Don't think this should ever happen. */
-		if (ret <= 0)
-			continue;
+	if (!inode)
+		return 0;
 
 /* Skip any inodes that are unallocated */
-		if (!inode->fsid || !inode->refcount)
-		{
-			continue;
-		}
+	if (!inode->fsid || !inode->refcount)
+	{
+		return 0;
+	}
 
 /* Add the inode to the list, even if the data won't be backed up. */
-		if (backup_inode_list_add (&info->inodes, &fsids, &allocated, &info->ninodes, loop, intswap32 (inode->fsid)) < 0)
-		{
-			info->err_msg = "Memory exhausted (Inode scan %d)";
-			info->err_arg1 = (void *)loop;
-			if (info->inodes)
-				free (info->inodes);
-			if (fsids)
-				free (fsids);
-			info->inodes = NULL;
-			return ~0;
-		}
+	if (backup_inode_list_add (&info->inodes, &scan->fsids, &scan->allocated, &info->ninodes, loop, intswap32 (inode->fsid)) < 0)
+	{
+		info->err_msg = "Memory exhausted (Inode scan %d)";
+		info->err_arg1 = (void *)loop;
+		return -1;
+	}
 
 /* If it a stream, treat it specially. */
-		if (inode->type == tyStream)
-		{
-			unsigned int streamsize;
+	if (inode->type == tyStream)
+	{
+		unsigned int streamsize;
 
-			if (info->back_flags & (BF_THRESHTOT | BF_STREAMTOT))
-				streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->size);
-			else
-				streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->blockused);
+		if (info->back_flags & (BF_THRESHTOT | BF_STREAMTOT))
+			streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->size);
+		else
+			streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->blockused);
 
 /* Ignore streams with no allocated data, or bigger than the threshhold. */
-			if (streamsize == 0 || 
-				(info->back_flags & BF_THRESHSIZE) && streamsize > info->thresh ||
-				!(info->back_flags & BF_THRESHSIZE) && intswap32 (inode->fsid) > info->thresh)
+		if (streamsize == 0 || 
+			(info->back_flags & BF_THRESHSIZE) && streamsize > info->thresh ||
+			!(info->back_flags & BF_THRESHSIZE) && intswap32 (inode->fsid) > info->thresh)
+		{
+			/* Clear out the data in the inode and write it back to */
+			/* memory for backup to read later */
+			if (inode != (mfs_inode *)scan->inodebuf)
 			{
-				/* Clear out the data in the inode and write it back to */
-				/* memory for backup to read later */
-				inode->size = 0;
-				inode->blockused = 0;
-				inode->numblocks = 0;
-				mfs_write_inode (info->mfs, inode);
-				continue;
+				memcpy (scan->inodebuf, inode, 512);
+				inode = (mfs_inode *)scan->inodebuf;
 			}
+			inode->size = 0;
+			inode->blockused = 0;
+			inode->numblocks = 0;
+			mfs_write_inode (info->mfs, inode);
+			return 0;
+		}
 
 /* If the total size is only for comparison, get the used size now. */
-			if ((info->back_flags & (BF_THRESHTOT | BF_STREAMTOT)) == BF_THRESHTOT)
-				streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->blockused);
+		if ((info->back_flags & (BF_THRESHTOT | BF_STREAMTOT)) == BF_THRESHTOT)
+			streamsize = intswap32 (inode->blocksize) / 512 * intswap32 (inode->blockused);
 
 /* Count the inode's sectors in the total. */
-			mediasectors += streamsize;
-			mediainodes++;
+		scan->mediasectors += streamsize;
+		scan->mediainodes++;
 
 #if DEBUG
-			fprintf (stderr, "Inode %d (%d) added\n", intswap32 (inode->inode), intswap32 (inode->fsid));
+		fprintf (stderr, "Inode %d (%d) added\n", intswap32 (inode->inode), intswap32 (inode->fsid));
 #endif
-		}
-		else if (inode->type != tyStream && !(inode->inode_flags & intswap32 (INODE_DATA)) && inode->size)
-		{
+	}
+	else if (inode->type != tyStream && !(inode->inode_flags & intswap32 (INODE_DATA)) && inode->size)
+	{
 /* Count the space used by non-stream inodes */
-			appsectors += (intswap32 (inode->size) + 511) / 512;
-			appinodes++;
+		scan->appsectors += (intswap32 (inode->size) + 511) / 512;
+		scan->appinodes++;
 
-		}
+	}
 
 /* Either an application data inode or a stream inode being backed up. */
-		for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
-		{
-			uint64_t thiscount;
-			uint64_t thissector;
+	for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
+	{
+		uint64_t thiscount;
+		uint64_t thissector;
 
-			if (mfs_is_64bit (info->mfs))
-			{
-				thiscount = intswap32 (inode->datablocks.d64[loop2].count);
-				thissector = intswap64 (inode->datablocks.d64[loop2].sector);
-			}
-			else
-			{
-				thiscount = intswap32 (inode->datablocks.d32[loop2].count);
-				thissector = intswap32 (inode->datablocks.d32[loop2].sector);
-			}
+		if (mfs_is_64bit (info->mfs))
+		{
+			thiscount = intswap32 (inode->datablocks.d64[loop2].count);
+			thissector = intswap64 (inode->datablocks.d64[loop2].sector);
+		}
+		else
+		{
+			thiscount = intswap32 (inode->datablocks.d32[loop2].count);
+			thissector = intswap32 (inode->datablocks.d32[loop2].sector);
+		}
 
-			if (highest < thiscount + thissector)
-			{
-				highest = thiscount + thissector;
-			}
+		if (scan->highest < thiscount + thissector)
+		{
+			scan->highest = thiscount + thissector;
 		}
 	}
 
+	return 0;
+}
+
+/*****************************************************************/
+/* Scan the inode table and generate a list of inodes to backup. */
+unsigned
+backup_scan_inodes (struct backup_info *info)
+{
+	struct backup_scan_state scan;
+	uint64_t highest;
+	uint64_t appsectors, mediasectors;
+	unsigned int mediainodes, appinodes;
+	unsigned *fsids;
+
+	info->inodes = NULL;
+
+/* Get the log type to use for inode updates */
+	if (!info->mfs->inode_log_type)
+	{
+		info->err_msg = "Unable to determine transaction type for inode updates";
+		return -1;
+	}
+	info->ilogtype = info->mfs->inode_log_type;
+
+/* Add inodes, reading the inode table in one pass. */
+	memset (&scan, 0, sizeof (scan));
+	scan.info = info;
+	if (mfs_scan_inodes (info->mfs, backup_scan_inode, &scan) != 0)
+	{
+		if (info->inodes)
+			free (info->inodes);
+		if (scan.fsids)
+			free (scan.fsids);
+		info->inodes = NULL;
+		return ~0;
+	}
+
+	highest = scan.highest;
+	appsectors = scan.appsectors;
+	mediasectors = scan.mediasectors;
+	mediainodes = scan.mediainodes;
+	appinodes = scan.appinodes;
+	fsids = scan.fsids;
+
 // Make sure all needed data is present.
 	if (info->back_flags & BF_TRUNCATED)
 	{
@@ -624,12 +652,17 @@ backup_state_volume_header_v3 (struct backup_info *info, void *data, unsigned si
 /* Write inode sector, followed by date for non tyStream inodes. */
 /* state_val1 = current inode index */
 /* state_val2 = offset of data in current inode */
-/* state_ptr1 = current inode structure */
+/* state_ptr1 = reader for the current inode */
 /* shared_val1 = --unused-- */
 enum backup_state_ret
 backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, unsigned *consumed)
 {
 	mfs_inode *inode;
+	struct mfs_inode_reader *reader;
+/* On a byte-swapped drive, the data is read as is and swapped while */
+/* computing the CRC, so the CRC is kept up to date here as it goes. */
+	int swab = mfs_is_swabbed (info->mfs);
+	int ret;
 
 	if (size == 0)
 	{
@@ -637,6 +670,8 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 		return bsError;
 	}
 
+	info->crc_done = swab;
+
 	while (info->state_val1 < info->ninodes && size > 0)
 	{
 		uint64_t datasize;
@@ -646,9 +681,10 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			mfs_inode *tmpinode;
 /* Load the next inode to backup */
 			uint64_t inode_size;
+			uint64_t readahead = 0;
 
 /* Fetch the next inode */
-			inode = mfs_read_inode (info->mfs, info->inodes[info->state_val1]);
+			inode = mfs_borrow_inode (info->mfs, info->inodes[info->state_val1]);
 
 			if (!inode)
 			{
@@ -681,18 +717,45 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			tmpinode->inode_flags &= intswap32 (INODE_DATA);
 			tmpinode->numblocks = 0;
 
+			if (swab)
+				info->crc = compute_crc (data, 512, info->crc);
+
 			data = (char *)data + 512;
 			--size;
 			++*consumed;
 
+/* Let the volume layer read ahead through the extents of a stream. */
+			if (inode->type == tyStream)
+			{
+				uint64_t streamsize;
+
+				if (info->back_flags & BF_STREAMTOT)
+					streamsize = intswap32 (inode->size);
+				else
+					streamsize = intswap32 (inode->blockused);
+				streamsize *= intswap32 (inode->blocksize);
+
+				readahead = (streamsize + 511) / 512;
+			}
+
+/* The reader keeps its own copy of the inode. */
+			reader = mfs_inode_reader_open (info->mfs, inode, readahead);
+			mfs_release_inode (info->mfs, inode);
+			if (!reader)
+			{
+				return bsError;
+			}
+
 			info->state_val2 = 0;
-			info->state_ptr1 = inode;
+			info->state_ptr1 = reader;
 		}
 		else
 		{
-			inode = info->state_ptr1;
+			reader = info->state_ptr1;
 		}
 
+		inode = mfs_inode_reader_inode (reader);
+
 		if (inode->type == tyStream)
 		{
 			if (info->back_flags & BF_STREAMTOT)
@@ -722,18 +785,35 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			if (!tocopy)
 				return bsMoreData;
 
-			if (mfs_read_inode_data_part (info->mfs, inode, data, info->state_val2, (tocopy + 511) / 512) < 0)
+			if (swab)
+				ret = mfs_inode_reader_read_raw (reader, data, (tocopy + 511) / 512);
+			else
+				ret = mfs_inode_reader_read (reader, data, (tocopy + 511) / 512);
+
+			if (ret < 0)
 			{
 				info->err_msg = "Error reading inode %d";
 				info->err_arg1 = (void *)(uint32_t)info->state_val1;
-				free (inode);
+				mfs_inode_reader_close (reader);
+				info->state_ptr1 = NULL;
 				return bsError;
 			}
 
+/* Swap the whole sectors while computing the CRC.  A partial sector at the */
+/* end has to be swapped before it is cleared below. */
+			if (swab)
+			{
+				info->crc = compute_crc_combine (info->crc, swab_compute_crc (data, tocopy & ~511, 0), tocopy & ~511);
+				if ((tocopy & 511) > 0)
+					data_swab ((char *)data + (tocopy & ~511), 512);
+			}
+
 /* Once again, zeros compress well, so zero out any garbage data. */
 			if ((tocopy & 511) > 0)
 			{
 				memset ((char *)data + tocopy, 0, 512 - (tocopy & 511));
+				if (swab)
+					info->crc = compute_crc ((unsigned char *)data + (tocopy & ~511), 512, info->crc);
 			}
 
 /* Update the sizes */
@@ -742,12 +822,15 @@ backup_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, uns
 			size -= tocopy;
 			info->state_val2 += tocopy;
 			*consumed += tocopy;
+/* Keep the reader in step if the read came up short. */
+			if (mfs_inode_reader_tell (reader) != info->state_val2)
+				mfs_inode_reader_seek (reader, info->state_val2);
 			if (inode->type != tyStream)
 				info->shared_val1 += tocopy;
 		}
 
 /* If it exits this loop, it means this inode is done, move onto the next */
-		free (inode);
+		mfs_inode_reader_close (reader);
 		info->state_ptr1 = NULL;
 		info->state_val1++;
 		info->state_val2 = 0;
@@ -187,6 +187,9 @@ struct backup_info
 /* Other backup stuff stuff */
 	int back_flags;
 	int crc;
+/* Set by a state handler that already added the data it consumed to crc, */
+/* because it byte-swapped the data in the same pass. */
+	int crc_done;
 
 /* Compression */
 	struct z_stream_s *comp;
@@ -288,6 +291,7 @@ struct backup_head_v3
 #define RF_BALANCE		0x00100000	/* Balance partition layout. */
 #define RF_NOFILL		0x00200000	/* Leave room for more partitions. */
 #define RF_SWAPV1		0x00400000	/* Use version 1 swap signature. */
+#define RF_MEMWRITE		0x00800000	/* Hold MFS writes in an overlay file. */
 #define RF_FLAGS		0xffff0000
 
 struct backup_info *init_backup_v1 (char *device, char *device2, int flags);
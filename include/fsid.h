@@ -71,12 +71,44 @@ uint32_t mfs_inode_count (struct mfs_handle *mfshnd);
 uint64_t mfs_inode_to_sector (struct mfs_handle *mfshnd, uint32_t inode);
 mfs_inode *mfs_read_inode (struct mfs_handle *mfshnd, uint32_t inode);
 int mfs_read_inode_to_buf (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *inode_buf);
+mfs_inode *mfs_map_inode (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *inode_buf);
+
+/* Borrowed inodes come from an arena kept with the handle, and are given */
+/* back with mfs_release_inode instead of being freed. */
+mfs_inode *mfs_inode_alloc (struct mfs_handle *mfshnd);
+void mfs_release_inode (struct mfs_handle *mfshnd, mfs_inode *inode);
+void mfs_inode_arena_free (struct mfs_handle *mfshnd);
+mfs_inode *mfs_borrow_inode (struct mfs_handle *mfshnd, uint32_t inode);
+mfs_inode *mfs_borrow_inode_by_fsid (struct mfs_handle *mfshnd, uint32_t fsid);
+mfs_inode *mfs_borrow_inode_for_fsid (struct mfs_handle *mfshnd, uint32_t fsid);
+
+/* Called by mfs_scan_inodes for every inode in order.  in is NULL if both */
+/* copies of the inode are bad, with the error set the same as */
+/* mfs_map_inode.  Otherwise it may point into a mapping of the volume, so */
+/* it has to be copied before it is changed.  Return non-zero to stop. */
+typedef int (*mfs_inode_scan_fn) (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *in, void *arg);
+int mfs_scan_inodes (struct mfs_handle *mfshnd, mfs_inode_scan_fn fn, void *arg);
+void mfs_fsid_index_free (struct mfs_handle *mfshnd);
 mfs_inode *mfs_read_inode_by_fsid (struct mfs_handle *mfshnd, uint32_t fsid);
 mfs_inode *mfs_find_inode_for_fsid (struct mfs_handle *mfshnd, uint32_t fsid);
 int mfs_write_inode (struct mfs_handle *mfshnd, mfs_inode *inode);
 int mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count);
+int mfs_read_inode_data_part_raw (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count);
+int mfs_inode_readahead (struct mfs_handle *mfshnd, mfs_inode * inode, uint64_t start, uint64_t count);
 unsigned char *mfs_read_inode_data (struct mfs_handle *mfshnd, mfs_inode * inode, int *size);
 int mfs_write_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, unsigned int start, unsigned int count);
+void mfs_extent_map_free (struct mfs_handle *mfshnd);
+
+/* Reads an inode's data in order, without the caller keeping track of */
+/* where it is in the extents. */
+struct mfs_inode_reader;
+struct mfs_inode_reader *mfs_inode_reader_open (struct mfs_handle *mfshnd, mfs_inode *inode, uint64_t readahead);
+mfs_inode *mfs_inode_reader_inode (struct mfs_inode_reader *reader);
+uint64_t mfs_inode_reader_tell (struct mfs_inode_reader *reader);
+int mfs_inode_reader_seek (struct mfs_inode_reader *reader, uint64_t start);
+int mfs_inode_reader_read (struct mfs_inode_reader *reader, unsigned char *data, unsigned int count);
+int mfs_inode_reader_read_raw (struct mfs_inode_reader *reader, unsigned char *data, unsigned int count);
+void mfs_inode_reader_close (struct mfs_inode_reader *reader);
 
 /* Simplified "greedy" allocation scheme */
 /* Works well on a fresh MFS, not so well on a well used volume */
@@ -22,12 +22,69 @@ struct mac_partition
 	uint32_t status;
 };
 
+struct tivo_partition_file;
+struct iovec;
+
+/* Storage backend under a tpFILE or partition table.  Sectors passed to the */
+/* backend are from the start of the whole file or device.  Open and size */
+/* return -1 with errno set on error, and size returns 0 for a file or 1 for */
+/* a device.  The transfers return bytes transferred like pread and pwrite. */
+/* Close only releases what open set up in the tpFILE. */
+struct tivo_partition_ops
+{
+	int (*open) (struct tivo_partition_file *file, const char *device, int flags);
+	int (*size) (struct tivo_partition_file *file, uint64_t *sectors);
+	int (*read) (struct tivo_partition_file *file, void *buf, uint64_t sector, int count);
+	int (*write) (struct tivo_partition_file *file, void *buf, uint64_t sector, int count);
+	int (*readv) (struct tivo_partition_file *file, struct iovec *iov, int niov, uint64_t sector);
+	int (*writev) (struct tivo_partition_file *file, struct iovec *iov, int niov, uint64_t sector);
+	void (*close) (struct tivo_partition_file *file);
+};
+
+/* Devices named with this prefix are held in memory, see ramdisk.c */
+#define TIVO_PARTITION_RAM_PREFIX "ram:"
+
+/* Header at the start of a compressed image file, see cimage.c.  Like */
+/* overlay files, it is in the byte order of the machine that wrote it. */
+#define TIVO_CIMAGE_MAGIC 0x4353464d
+struct tivo_partition_cimage_header
+{
+	uint32_t magic;
+	uint32_t cluster;		/* Sectors per cluster */
+	uint64_t sectors;		/* Size of the drive in the image */
+	uint64_t index;			/* Offset of the compressed index in bytes */
+	uint64_t index_len;		/* Length of the compressed index in bytes */
+};
+
+/* Sectors per cluster for new compressed images.  Each cluster is */
+/* compressed on its own, so this is also how much a random read has to */
+/* decompress.  It can be at most TIVO_CIMAGE_CLUSTER_MAX. */
+#define TIVO_CIMAGE_CLUSTER 128
+#define TIVO_CIMAGE_CLUSTER_MAX 16384
+
 typedef struct tivo_partition_file
 {
 	enum
 	{ pUNKNOWN = 0, pFILE, pDEVICE, pDIRECTFILE, pDIRECT }
 	tptype;
+	const struct tivo_partition_ops *ops;
+/* Backend state.  The descriptor for files and devices, or -1. */
 	int fd;
+	void *priv;
+/* Second descriptor opened with O_DIRECT for bulk transfers, or -1.  Only */
+/* transfers aligned to dio_align bytes use it. */
+	int dio_fd;
+	int dio_align;
+/* Read-only mapping of the partition, see tivo_partition_map.  map_state */
+/* is 0 until a mapping is tried, 1 if map is valid and -1 if the file */
+/* can't be mapped. */
+	int map_state;
+	unsigned char *map;
+	size_t map_len;
+	unsigned int map_skip;
+/* sparse_state is 0 until checked, 1 if the partition is in a regular file */
+/* where zero runs are written as holes and -1 if not. */
+	int sparse_state;
 /* Only for pDIRECT and friend. */
 	union
 	{
@@ -47,6 +104,46 @@ typedef struct tivo_partition_file
 }
 tpFILE;
 
+/* One range of sectors for tivo_partition_readv and tivo_partition_writev */
+struct tivo_partition_iovec
+{
+	uint64_t sector;
+	int count;
+	void *buf;
+};
+
+/* Asynchronous request for tivo_partition_aio_submit.  Result is the */
+/* number of bytes transferred, or -errno on error.  Data is for the caller. */
+/* Raw requests are in the byte order of tivo_partition_read_raw on a */
+/* byte-swapped partition. */
+struct tivo_partition_aio_req
+{
+	struct tivo_partition_file *file;
+	void *buf;
+	uint64_t sector;
+	int count;
+	int write;
+	int raw;
+	int result;
+	void *data;
+	struct tivo_partition_aio_req *next;
+};
+
+/* Asynchronous I/O engine, private to readwrite.c */
+struct tivo_partition_aio;
+
+/* Alignment of buffers from tivo_partition_buffer_alloc, and the most any */
+/* O_DIRECT transfer will need. */
+#define TIVO_PARTITION_DIO_ALIGN 4096
+/* Number of freed buffers kept around for reuse. */
+#define TIVO_PARTITION_BUFFER_POOL 4
+/* Runs of zero sectors at least this long are punched out as holes instead */
+/* of written, when the partition is in a regular file. */
+#define TIVO_PARTITION_SPARSE_MIN 8
+/* Largest alignment, in sectors, new partitions are placed on.  The */
+/* physical sector size of the drive is used, or MFS_PARTITION_ALIGN. */
+#define TIVO_PARTITION_ALIGN_MAX 2048
+
 #define VOL_FILE	0x00000001
 #define VOL_SWAB	0x00000004
 #define VOL_DIRTY	0x00000008
@@ -68,12 +165,15 @@ struct tivo_partition
 struct tivo_partition_table
 {
 	unsigned char *device;
+	const struct tivo_partition_ops *ops;
+	void *priv;
 	int ro_fd;
 	int rw_fd;
 	int vol_flags;
 	int count;
 	int refs;
 	uint64_t devsize;
+	unsigned int align;		/* Sectors new partitions start on */
 	int allocated;
 	struct tivo_partition *partitions;
 	struct tivo_partition_table *next;
@@ -81,6 +181,7 @@ struct tivo_partition_table
 };
 
 /* From macpart.c */
+int lfopen (const char *device, int flags);
 tpFILE *tivo_partition_open (char *device, int flags);
 tpFILE *tivo_partition_open_direct (char *device, int partnum, int flags);
 int tivo_partition_count (const char *device);
@@ -91,7 +192,9 @@ char *tivo_partition_name (const char *device, int partnum);
 char *tivo_partition_type (const char *device, int partnum);
 uint64_t tivo_partition_offset (tpFILE * file);
 const char *tivo_partition_device_name (tpFILE * file);
+void *tivo_partition_map (tpFILE * file);
 int tivo_partition_rrpart (const char *device);
+const struct tivo_partition_ops *tivo_partition_backend (const char *device);
 void tivo_partition_direct ();
 void tivo_partition_file ();
 void tivo_partition_auto ();
@@ -107,11 +210,46 @@ int tivo_partition_write_bootsector (const char *device, void *buf);
 
 int tivo_partition_table_init (const char *device, int swab);
 int tivo_partition_add (const char *device, uint64_t size, int before, const char *name, const char *type);
+unsigned int tivo_partition_alignment (const char *device);
+uint64_t tivo_partition_align_size (const char *device, uint64_t size);
+int tivo_partition_misaligned (const char *device, int *total);
+void tivo_partition_print_alignment (const char *device);
 int tivo_partition_table_write (const char *device);
 
 /* From readwrite.c */
 int tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count);
 int tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_read_raw (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_write_raw (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_readv (tpFILE * file, struct tivo_partition_iovec *vec, int nvec);
+int tivo_partition_writev (tpFILE * file, struct tivo_partition_iovec *vec, int nvec);
+int tivo_partition_pread (int fd, void *buf, uint64_t sector, int count);
+int tivo_partition_pwrite (int fd, void *buf, uint64_t sector, int count);
+int tivo_partition_advise (tpFILE * file, uint64_t sector, uint64_t count);
+struct tivo_partition_aio *tivo_partition_aio_init (unsigned int depth);
+int tivo_partition_aio_submit (struct tivo_partition_aio *aio, struct tivo_partition_aio_req *req);
+struct tivo_partition_aio_req *tivo_partition_aio_complete (struct tivo_partition_aio *aio, int wait);
+int tivo_partition_aio_pending (struct tivo_partition_aio *aio);
+int tivo_partition_aio_is_async (struct tivo_partition_aio *aio);
+void tivo_partition_aio_cleanup (struct tivo_partition_aio *aio);
+void *tivo_partition_buffer_alloc (size_t size);
+void tivo_partition_buffer_free (void *buf);
+int tivo_partition_fd_read (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_fd_write (tpFILE * file, void *buf, uint64_t sector, int count);
+int tivo_partition_fd_readv (tpFILE * file, struct iovec *iov, int niov, uint64_t sector);
+int tivo_partition_fd_writev (tpFILE * file, struct iovec *iov, int niov, uint64_t sector);
+
+/* From ramdisk.c */
+extern const struct tivo_partition_ops tivo_partition_ram_ops;
+int tivo_partition_ram_create (const char *device, uint64_t sectors);
+int tivo_partition_ram_destroy (const char *device);
+
+/* From cimage.c */
+extern const struct tivo_partition_ops tivo_partition_cimage_ops;
+int tivo_partition_cimage_probe (const char *path, struct tivo_partition_cimage_header *hdr);
+int tivo_partition_cimage_create (const char *path, uint64_t sectors, unsigned int cluster);
+int tivo_partition_cimage_usage (const char *path, uint64_t *clusters, uint64_t *bytes);
+int tivo_partition_cimage_sync (void);
 
 /* Some quick routines, mainly intended for internal macpart use. */
 EXTERNINLINE int
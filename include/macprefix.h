@@ -87,6 +87,9 @@
 /* Define if you have the <zlib.h> header file.  */
 #define HAVE_ZLIB_H 1
 
+/* Define if zlib is available for compressed image files. */
+#define HAVE_LIBZ 1
+
 /* Name of package */
 #define PACKAGE "MFSTools"
 
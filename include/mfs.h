@@ -113,6 +113,15 @@ struct zone_map
 	struct zone_map *next_loaded;
 };
 
+/* Sector range covered by a loaded zone map, kept in a sorted array for */
+/* binary search */
+struct zone_map_extent
+{
+	uint64_t first;
+	uint64_t last;
+	struct zone_map *zone;
+};
+
 /* Head of zone maps linked list, contains totals as well */
 struct zone_map_head
 {
@@ -127,7 +136,16 @@ struct mfs_handle
 	volume_header vol_hdr;
 	struct zone_map_head zones[ztMax];
 	struct zone_map *loaded_zones;
+	struct zone_map_extent *zone_extents;
+	int zone_extent_count;
+	int zone_extent_hit;		/* Last extent found, checked first */
 	struct log_hdr_s *current_log;
+	struct mfs_fsid_index *fsid_index;	/* In memory fsid to inode map, once built */
+	unsigned int fsid_walks;	/* Hash chain walks done without the index */
+	int inodes_written;			/* Set once an inode has been written */
+	struct mfs_inode_slab *inode_slabs;	/* Inode arena */
+	union mfs_inode_slot *inode_free;	/* Free inodes in the arena */
+	struct mfs_extent_map *extent_map;	/* Extents of the last inode read or written */
 
 	int inode_log_type;
 	int is_64;
@@ -154,6 +172,7 @@ int mfs_add_volume_pair (struct mfs_handle *mfshnd, char *app, char *media, uint
 unsigned int mfs_volume_pair_app_size (struct mfs_handle *mfshnd, uint64_t blocks, unsigned int minalloc);
 int mfs_load_volume_header (struct mfs_handle *mfshnd, int flags);
 struct mfs_handle *mfs_init (char *hda, char *hdb, int flags);
+struct mfs_handle *mfs_init_volumes (struct volume_handle *vols, int flags);
 int mfs_reinit (struct mfs_handle *mfshnd, int flags);
 void mfs_cleanup (struct mfs_handle *mfshnd);
 char *mfs_partition_list (struct mfs_handle *mfshnd);
@@ -164,11 +183,20 @@ int mfs_has_error (struct mfs_handle *mfshnd);
 void mfs_clearerror (struct mfs_handle *mfshnd);
 
 #define mfs_read_data(mfshnd,buf,sector,count) mfsvol_read_data ((mfshnd)->vols, buf, sector, count)
+#define mfs_read_data_raw(mfshnd,buf,sector,count) mfsvol_read_data_raw ((mfshnd)->vols, buf, sector, count)
+#define mfs_read_extents(mfshnd,buf,extents,count,raw) mfsvol_read_extents ((mfshnd)->vols, buf, extents, count, raw)
+#define mfs_map_data(mfshnd,buf,sector,count) mfsvol_map_sectors ((mfshnd)->vols, buf, sector, count)
 #define mfs_write_data(mfshnd,buf,sector,count) mfsvol_write_data ((mfshnd)->vols, buf, sector, count)
 #define mfs_volume_size(mfshnd,sector) mfsvol_volume_size ((mfshnd)->vols, sector)
 #define mfs_volume_set_size(mfshnd) mfsvol_volume_set_size ((mfshnd)->vols)
+#define mfs_is_swabbed(mfshnd) mfsvol_is_swabbed ((mfshnd)->vols)
+#define mfs_set_writeback(mfshnd,sectors) mfsvol_set_writeback ((mfshnd)->vols, sectors)
+#define mfs_flush(mfshnd) mfsvol_flush ((mfshnd)->vols)
 #define mfs_enable_memwrite(mfshnd) mfsvol_enable_memwrite ((mfshnd)->vols)
 #define mfs_discard_memwrite(mfshnd) mfsvol_discard_memwrite ((mfshnd)->vols)
+#define mfs_overlay_commit(mfshnd,path) mfsvol_overlay_commit ((mfshnd)->vols, path)
+#define mfs_readahead_plan(mfshnd,extents,count) mfsvol_readahead_plan ((mfshnd)->vols, extents, count)
+#define mfs_readahead_stats(mfshnd,hinted,hits,misses) mfsvol_readahead_stats ((mfshnd)->vols, hinted, hits, misses)
 #define mfs_is_64bit(mfshnd) ((mfshnd)->is_64)
 #define mfs_volume_header(mfshnd) (&(mfshnd)->vol_hdr)
 
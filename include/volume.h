@@ -2,10 +2,45 @@
 #define VOLUME_H
 
 #include "zonemap.h"
+#include "macpart.h"
 
 /* Size that TiVo rounds the partitions down to whole increments of. */
 #define MFS_PARTITION_ROUND 1024
 
+/* Default number of sectors held in the sector cache.  Can be overridden */
+/* with the MFS_CACHE_SIZE environment variable, 0 disables the cache. */
+#define MFSVOL_CACHE_DEFAULT 2048
+/* Reads larger than this bypass the cache, since they are usually bulk */
+/* data that will not be read again. */
+#define MFSVOL_CACHE_MAXREAD 8
+
+/* Overlay file that memory writes are spilled to.  Sector 0 holds the */
+/* header, and each sector of the volume set is kept one sector further in */
+/* so the file stays sparse.  The index of extents written follows the last */
+/* sector of the volume set.  Everything is in host byte order. */
+#define MFSVOL_OVERLAY_MAGIC 0x4d465350
+/* Room for the partition list in the overlay header. */
+#define MFSVOL_OVERLAY_VOLUMES 256
+/* Sectors copied at a time when committing an overlay file. */
+#define MFSVOL_OVERLAY_CHUNK 256
+
+/* Sectors of writes held in the write-back buffer before it is flushed, */
+/* for those that turn it on.  MFS_WRITEBACK overrides the size for anyone, */
+/* 0 writing straight through. */
+#define MFSVOL_WRITEBACK_DEFAULT 4096
+
+/* Buckets in each I/O statistics histogram.  Bucket n counts values from */
+/* 2^(n-1) up to 2^n, with bucket 0 for 0 and the last catching the rest. */
+#define MFSVOL_STATS_BUCKETS 24
+
+/* Default number of extents to hint ahead of reads in a readahead plan. */
+/* Can be overridden with the MFS_READAHEAD environment variable, 0 */
+/* disables it. */
+#define MFSVOL_READAHEAD_DEFAULT 2
+
+/* Default number of asynchronous requests allowed in flight at once. */
+#define MFSVOL_AIO_DEPTH 32
+
 /* Flags for vol_flags below */
 /* #define VOL_FILE        1        This volume is really a file */
 #define VOL_RDONLY      2		/* This volume is read-only */
@@ -18,34 +53,189 @@ enum volume_write_mode_e
 	vwLocal = 2			// Writes are cached in memory and returned on subsequent reads, but not written to the volume
 };
 
-/* Block written to memory */
+/* Maximum height of the skip list holding the blocks written to memory. */
+#define MFSVOL_MEM_LEVELS 16
+
+/* Block written to memory.  Blocks are kept in a skip list sorted by start */
+/* sector, next[0] links every block in order.  Blocks never overlap or butt */
+/* up against each other, since writes coalesce them. */
 struct volume_mem_data
 {
 	uint64_t start;
 	uint64_t sectors;
-	struct volume_mem_data *next;
-	unsigned char data[0];
+	uint64_t room;			/* Sectors allocated for data */
+	unsigned char *data;
+	int levels;
+	struct volume_mem_data *next[0];
+};
+
+/* Skip list of blocks.  For ranges spilled to the overlay file the blocks */
+/* have no data. */
+struct volume_mem_list
+{
+	struct volume_mem_data *blocks[MFSVOL_MEM_LEVELS];
+	int levels;
+	uint64_t room;			/* Sectors of data held by all the blocks */
+};
+
+struct volume_overlay_header
+{
+	uint32_t magic;
+	uint32_t extents;		/* Number of extents in the index */
+	uint64_t sectors;		/* Size of the volume set the overlay is for */
+	uint64_t index;			/* Offset of the index in bytes */
+	uint32_t logstamp;		/* From the volume header on disk when it was made */
+	uint32_t checksum;
+	char volumes[MFSVOL_OVERLAY_VOLUMES];	/* Partition list of the volume set */
+};
+
+struct volume_overlay_extent
+{
+	uint64_t sector;
+	uint64_t count;
+};
+
+/* I/O statistics for one direction on a volume */
+struct volume_stats_io
+{
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t usecs;
+	uint64_t seeks;				/* Requests not starting where the last ended */
+	uint64_t seek_sectors;
+	uint64_t sizes[MFSVOL_STATS_BUCKETS];		/* In sectors */
+	uint64_t latency[MFSVOL_STATS_BUCKETS];	/* In microseconds */
+	uint64_t distance[MFSVOL_STATS_BUCKETS];	/* Seek distance in sectors */
+};
+
+/* I/O statistics for a volume, kept when MFS_STATS is set */
+struct volume_stats
+{
+	char *path;
+	uint64_t next_sector;		/* Where the last request ended */
+	struct volume_stats_io io[2];	/* Reads, then writes */
 };
 
 /* Information about the list of volumes needed for reads */
 struct volume_info
 {
 	struct tivo_partition_file *file;
+	char *name;					/* As named in the partition list */
 	int vol_flags;
 	uint64_t start;
 	uint64_t sectors;
 	uint64_t offset;
-	struct volume_mem_data *mem_blocks;
+	struct volume_mem_list mem;
+	struct volume_mem_list spilled;
+	struct volume_mem_list dirty;	/* Write-back buffer, not yet on disk */
+	struct volume_stats *stats;		/* NULL unless statistics are kept */
 	struct volume_info *next;
 };
 
+/* Sector range of a volume, kept in a sorted array for binary search */
+struct volume_extent
+{
+	uint64_t start;
+	uint64_t end;
+	struct volume_info *vol;
+};
+
+/* Sector held in the sector cache */
+struct volume_cache_entry
+{
+	uint64_t sector;
+	int next;			/* Next entry in hash chain, -1 for end */
+	int referenced;		/* Used by the clock to pick a victim */
+	unsigned char data[512];
+};
+
+/* Sector cache for volume reads, with clock replacement. */
+/* The cache only holds what is on disk, so it is layered under the mem */
+/* write blocks. */
+struct volume_cache
+{
+	struct volume_cache_entry *entries;
+	int *hash;
+	unsigned int size;
+	unsigned int used;
+	unsigned int hashmask;
+	unsigned int hand;
+
+	uint64_t hits;
+	uint64_t misses;
+};
+
+/* Extent of the volume set expected to be read soon. */
+struct volume_readahead_extent
+{
+	uint64_t sector;
+	uint64_t count;
+};
+
+/* Readahead plan.  The extents are in the order they will be read.  As */
+/* reads reach each extent, the ones following it are hinted to the kernel. */
+struct volume_readahead
+{
+	struct volume_readahead_extent *extents;
+	int count;
+	int alloc;
+	int current;			/* Extent last read from */
+	int hinted;				/* Extents before this have been hinted */
+
+	uint64_t hinted_sectors;
+	uint64_t hits;			/* Sectors read after they were hinted */
+	uint64_t misses;		/* Sectors read from the plan without a hint */
+};
+
+/* Asynchronous volume request.  Result is the number of bytes */
+/* transferred, or -errno.  Data is for the caller.  Raw requests are */
+/* byte-swapped, as with mfsvol_read_data_raw. */
+struct volume_aio_request
+{
+	void *buf;
+	uint64_t sector;
+	int count;
+	int write;
+	int raw;
+	int result;
+	void *data;
+
+	struct tivo_partition_aio_req req;
+	struct volume_aio_request *next;
+};
+
 struct volume_handle
 {
 	struct volume_info *volumes;
+	struct volume_extent *extents;
+	int extent_count;
+	int extent_hit;			/* Last extent found, checked first */
 	enum volume_write_mode_e write_mode;
 	char *hda;
 	char *hdb;
 
+	unsigned int cache_size;
+	struct volume_cache *cache;
+
+	uint64_t mem_limit;		/* Sectors to hold in memory before spilling */
+	uint64_t mem_used;
+	char *overlay_path;		/* NULL for an anonymous overlay file */
+	int overlay_fd;
+
+	uint64_t writeback_limit;	/* Sectors to buffer before flushing, 0 for none */
+	uint64_t writeback_used;
+
+	unsigned int readahead_depth;
+	struct volume_readahead readahead;
+
+	int stats;
+	struct volume_handle *stats_next;	/* Handles to report at exit */
+
+	struct tivo_partition_aio *aio;
+	struct volume_aio_request *aio_done;
+	struct volume_aio_request *aio_done_tail;
+	int aio_pending;
+
 	char *err_msg;
 	void *err_arg1;
 	void *err_arg2;
@@ -60,8 +250,28 @@ uint64_t mfsvol_volume_size (struct volume_handle *hnd, uint64_t sector);
 uint64_t mfsvol_volume_set_size (struct volume_handle *hnd);
 int mfsvol_read_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count);
 int mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count);
+void *mfsvol_map_sectors (struct volume_handle *hnd, void *buf, uint64_t sector, int count);
+int mfsvol_is_swabbed (struct volume_handle *hnd);
+int mfsvol_read_data_raw (struct volume_handle *hnd, void *buf, uint64_t sector, int count);
+int mfsvol_write_data_raw (struct volume_handle *hnd, void *buf, uint64_t sector, int count);
+int mfsvol_aio_init (struct volume_handle *hnd, unsigned int depth);
+int mfsvol_aio_submit (struct volume_handle *hnd, struct volume_aio_request *req);
+struct volume_aio_request *mfsvol_aio_complete (struct volume_handle *hnd, int wait);
+int mfsvol_aio_pending (struct volume_handle *hnd);
+int mfsvol_read_extents (struct volume_handle *hnd, void *buf, struct volume_readahead_extent *extents, int count, int raw);
+void mfsvol_cache_set_size (struct volume_handle *hnd, unsigned int sectors);
+void mfsvol_cache_flush (struct volume_handle *hnd);
+void mfsvol_cache_stats (struct volume_handle *hnd, uint64_t *hits, uint64_t *misses);
+int mfsvol_readahead_plan (struct volume_handle *hnd, struct volume_readahead_extent *extents, int count);
+void mfsvol_readahead_stats (struct volume_handle *hnd, uint64_t *hinted, uint64_t *hits, uint64_t *misses);
+void mfsvol_stats_print (struct volume_handle *hnd);
+int mfsvol_set_writeback (struct volume_handle *hnd, uint64_t sectors);
+int mfsvol_flush (struct volume_handle *hnd);
 void mfsvol_enable_memwrite (struct volume_handle *hnd);
 void mfsvol_discard_memwrite (struct volume_handle *hnd);
+int mfsvol_overlay_spill (struct volume_handle *hnd);
+int mfsvol_overlay_info (const char *path, struct volume_overlay_header *hdr);
+int mfsvol_overlay_commit (struct volume_handle *hnd, const char *path);
 void mfsvol_cleanup (struct volume_handle *hnd);
 struct volume_handle *mfsvol_init (const char *hda, const char *hdb);
 
@@ -0,0 +1,954 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+#include <zlib.h>
+
+#include "macpart.h"
+
+/* Compressed images hold a drive as fixed size clusters, each compressed */
+/* on its own with zlib.  Clusters of zeros are not stored at all.  Each */
+/* cluster has an entry in the index, which packs the sector in the image */
+/* file the cluster starts at into the top 40 bits, and its compressed */
+/* length in bytes into the bottom 24.  An entry of 0 is a cluster of */
+/* zeros, and a length of a full cluster means it is stored uncompressed. */
+/* */
+/* Clusters are only ever appended to the image, and the index is written */
+/* after them, compressed, when the image is synced.  The header is written */
+/* last, so if the program dies before then, the image is left as it was */
+/* at the last sync.  A cluster stored since the last sync is rewritten in */
+/* place if it still fits, but otherwise space from clusters that were */
+/* rewritten is not reclaimed.  Packing the image again will drop it. */
+#define CIMAGE_ENTRY(sector, len) (((uint64_t) (sector) << 24) | (len))
+#define CIMAGE_SECTOR(entry) ((entry) >> 24)
+#define CIMAGE_LENGTH(entry) ((unsigned int) ((entry) & 0xffffff))
+
+/* The index is kept in memory in pages, so images that are mostly empty */
+/* don't need the whole index.  A NULL page is all zero clusters. */
+#define CIMAGE_PAGE 4096
+/* Decompressed clusters kept around for reads and to gather up writes. */
+#define CIMAGE_SLOTS 16
+/* Bytes of compressed index written or read at a time. */
+#define CIMAGE_INDEX_CHUNK 65536
+
+struct tivo_partition_cimage_slot
+{
+	uint64_t cluster;
+	unsigned char *data;
+	int valid;
+	int dirty;
+	unsigned long used;
+};
+
+struct tivo_partition_cimage
+{
+	char *path;
+	dev_t dev;				/* Identity of the image file, so other */
+	ino_t ino;				/* names for it find the same entry */
+	int fd;
+	int writable;
+	int changed;
+	int refs;				/* Opens through the backend not closed yet */
+	struct tivo_partition_cimage_header hdr;
+	uint64_t clusters;
+	uint64_t **index;
+	uint64_t end;
+	uint64_t synced;
+	unsigned long tick;
+	unsigned char *zbuf;
+	unsigned int zbuf_len;
+	struct tivo_partition_cimage_slot slots[CIMAGE_SLOTS];
+	struct tivo_partition_cimage *next;
+};
+
+/* Images stay open until the program exits, since the table and every */
+/* partition on it share the same clusters and index.  They are written */
+/* out when the last user closes them, when a volume set is cleaned up, */
+/* and at exit. */
+static struct tivo_partition_cimage *cimages = NULL;
+static int cimage_atexit = 0;
+
+/**************************************************************/
+/* Round a byte count up to the number of sectors to hold it. */
+static unsigned int
+tivo_partition_cimage_sectors (uint64_t bytes)
+{
+	return (bytes + 511) / 512;
+}
+
+/*************************************************************************/
+/* Return true if a cluster is all zeros, so it doesn't need to be kept. */
+static int
+tivo_partition_cimage_is_zero (const unsigned char *data, unsigned int len)
+{
+	const uint64_t *words = (const uint64_t *) data;
+	unsigned int loop;
+
+	for (loop = 0; loop < len / sizeof (*words); loop++)
+	{
+		if (words[loop])
+			return 0;
+	}
+
+	return 1;
+}
+
+/******************************************/
+/* Look up the index entry for a cluster. */
+static uint64_t
+tivo_partition_cimage_entry (struct tivo_partition_cimage *img, uint64_t cluster)
+{
+	uint64_t *page = img->index[cluster / CIMAGE_PAGE];
+
+	return page? page[cluster % CIMAGE_PAGE]: 0;
+}
+
+/*************************************************************************/
+/* Change the index entry for a cluster, adding its page if it has none. */
+static int
+tivo_partition_cimage_set_entry (struct tivo_partition_cimage *img, uint64_t cluster, uint64_t entry)
+{
+	uint64_t **page = &img->index[cluster / CIMAGE_PAGE];
+
+	if (!*page)
+	{
+		if (!entry)
+			return 0;
+
+		*page = calloc (CIMAGE_PAGE, sizeof (uint64_t));
+		if (!*page)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	(*page)[cluster % CIMAGE_PAGE] = entry;
+	img->changed = 1;
+
+	return 0;
+}
+
+/*****************************************************************************/
+/* Read the compressed index into memory.  Pages that come out all zeros are */
+/* left out. */
+static int
+tivo_partition_cimage_load_index (struct tivo_partition_cimage *img)
+{
+	unsigned char *in;
+	uint64_t *page;
+	uint64_t pos = 0;
+	uint64_t loop;
+	z_stream strm;
+	int err = Z_OK;
+
+	if (img->hdr.index_len == 0)
+		return 0;
+
+	in = malloc (CIMAGE_INDEX_CHUNK);
+	page = malloc (CIMAGE_PAGE * sizeof (uint64_t));
+	if (!in || !page)
+	{
+		free (in);
+		free (page);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset (&strm, 0, sizeof (strm));
+	if (inflateInit (&strm) != Z_OK)
+	{
+		free (in);
+		free (page);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	for (loop = 0; loop * CIMAGE_PAGE < img->clusters && err == Z_OK; loop++)
+	{
+		uint64_t count = img->clusters - loop * CIMAGE_PAGE;
+
+		if (count > CIMAGE_PAGE)
+			count = CIMAGE_PAGE;
+
+		strm.next_out = (Bytef *) page;
+		strm.avail_out = count * sizeof (uint64_t);
+
+		while (strm.avail_out > 0 && err == Z_OK)
+		{
+			if (strm.avail_in == 0)
+			{
+				uint64_t left = img->hdr.index_len - pos;
+				int toread = left > CIMAGE_INDEX_CHUNK? CIMAGE_INDEX_CHUNK: left;
+
+				if (toread == 0 || tivo_partition_pread (img->fd, in, (img->hdr.index + pos) / 512, tivo_partition_cimage_sectors (toread)) < toread)
+				{
+					err = Z_DATA_ERROR;
+					break;
+				}
+
+				strm.next_in = in;
+				strm.avail_in = toread;
+				pos += toread;
+			}
+
+			err = inflate (&strm, Z_NO_FLUSH);
+			if (err == Z_STREAM_END && strm.avail_out == 0)
+				err = Z_OK;
+		}
+
+		if (err != Z_OK)
+			break;
+
+		if (!tivo_partition_cimage_is_zero ((unsigned char *) page, count * sizeof (uint64_t)))
+		{
+			img->index[loop] = calloc (CIMAGE_PAGE, sizeof (uint64_t));
+			if (!img->index[loop])
+			{
+				err = Z_MEM_ERROR;
+				break;
+			}
+			memcpy (img->index[loop], page, count * sizeof (uint64_t));
+		}
+	}
+
+	inflateEnd (&strm);
+	free (in);
+	free (page);
+
+	if (err != Z_OK)
+	{
+		errno = err == Z_MEM_ERROR? ENOMEM: EIO;
+		return -1;
+	}
+
+	return 0;
+}
+
+/**************************************************************************/
+/* Write the index out compressed at the end of the image.  Missing pages */
+/* are fed to zlib as zeros, which it squeezes down to almost nothing. */
+static int
+tivo_partition_cimage_write_index (struct tivo_partition_cimage *img, uint64_t *len)
+{
+	static const uint64_t zeros[CIMAGE_PAGE];
+	unsigned char *out;
+	uint64_t pos = 0;
+	uint64_t loop;
+	z_stream strm;
+	int err = Z_OK;
+	int done = 0;
+
+	out = malloc (CIMAGE_INDEX_CHUNK);
+	if (!out)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	memset (&strm, 0, sizeof (strm));
+	if (deflateInit (&strm, Z_BEST_SPEED) != Z_OK)
+	{
+		free (out);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	strm.next_out = out;
+	strm.avail_out = CIMAGE_INDEX_CHUNK;
+
+	for (loop = 0; loop * CIMAGE_PAGE < img->clusters && err == Z_OK; loop++)
+	{
+		uint64_t count = img->clusters - loop * CIMAGE_PAGE;
+		int last = count <= CIMAGE_PAGE;
+
+		if (count > CIMAGE_PAGE)
+			count = CIMAGE_PAGE;
+
+		strm.next_in = (Bytef *) (img->index[loop]? img->index[loop]: zeros);
+		strm.avail_in = count * sizeof (uint64_t);
+
+		do
+		{
+			unsigned int have;
+
+			err = deflate (&strm, last? Z_FINISH: Z_NO_FLUSH);
+			if (err == Z_STREAM_END)
+				done = 1;
+			if (err == Z_STREAM_END || err == Z_BUF_ERROR)
+				err = Z_OK;
+
+/* Output is only written a whole chunk at a time, apart from the last, */
+/* so each chunk starts on a sector. */
+			have = CIMAGE_INDEX_CHUNK - strm.avail_out;
+			if (err == Z_OK && have > 0 && (strm.avail_out == 0 || done))
+			{
+				memset (out + have, 0, tivo_partition_cimage_sectors (have) * 512 - have);
+				if (tivo_partition_pwrite (img->fd, out, (img->end + pos) / 512, tivo_partition_cimage_sectors (have)) != tivo_partition_cimage_sectors (have) * 512)
+					err = Z_ERRNO;
+				pos += have;
+				strm.next_out = out;
+				strm.avail_out = CIMAGE_INDEX_CHUNK;
+			}
+		}
+		while (err == Z_OK && (strm.avail_in > 0 || (last && !done)));
+	}
+
+	deflateEnd (&strm);
+	free (out);
+
+	if (err != Z_OK)
+	{
+		if (err != Z_ERRNO || !errno)
+			errno = EIO;
+		return -1;
+	}
+
+	*len = pos;
+	return 0;
+}
+
+/**************************************************************************/
+/* Compress a cluster and append it to the image, or drop it if it is all */
+/* zeros. */
+static int
+tivo_partition_cimage_store (struct tivo_partition_cimage *img, struct tivo_partition_cimage_slot *slot)
+{
+	unsigned int cbytes = img->hdr.cluster * 512;
+	uLongf len = img->zbuf_len;
+	unsigned char *data = img->zbuf;
+	unsigned int sectors;
+	uint64_t entry;
+	uint64_t where;
+
+	if (tivo_partition_cimage_is_zero (slot->data, cbytes))
+	{
+		if (tivo_partition_cimage_set_entry (img, slot->cluster, 0) < 0)
+			return -1;
+		slot->dirty = 0;
+		return 0;
+	}
+
+	if (compress2 (img->zbuf, &len, slot->data, cbytes, Z_BEST_SPEED) != Z_OK || len >= cbytes)
+	{
+		len = cbytes;
+		data = slot->data;
+	}
+	else
+	{
+		memset (img->zbuf + len, 0, tivo_partition_cimage_sectors (len) * 512 - len);
+	}
+
+	sectors = tivo_partition_cimage_sectors (len);
+
+/* Nothing on disk that the last sync points to can be touched, but a */
+/* cluster written since then can be overwritten if the new one fits. */
+	entry = tivo_partition_cimage_entry (img, slot->cluster);
+	where = img->end / 512;
+	if (entry && CIMAGE_SECTOR (entry) >= img->synced / 512 && sectors <= tivo_partition_cimage_sectors (CIMAGE_LENGTH (entry)))
+		where = CIMAGE_SECTOR (entry);
+
+	errno = 0;
+	if (tivo_partition_pwrite (img->fd, data, where, sectors) != sectors * 512)
+	{
+		if (!errno)
+			errno = ENOSPC;
+		return -1;
+	}
+
+	if (tivo_partition_cimage_set_entry (img, slot->cluster, CIMAGE_ENTRY (where, len)) < 0)
+		return -1;
+
+	if (where == img->end / 512)
+		img->end += sectors * 512;
+	slot->dirty = 0;
+
+	return 0;
+}
+
+/***************************************************************************/
+/* Get a cluster into a slot, writing out whatever was there if needed. */
+/* If fill is not set, the caller is about to overwrite the whole cluster, */
+/* so it isn't read. */
+static struct tivo_partition_cimage_slot *
+tivo_partition_cimage_slot (struct tivo_partition_cimage *img, uint64_t cluster, int fill)
+{
+	struct tivo_partition_cimage_slot *slot = NULL;
+	unsigned int cbytes = img->hdr.cluster * 512;
+	uint64_t entry;
+	int loop;
+
+	for (loop = 0; loop < CIMAGE_SLOTS; loop++)
+	{
+		if (img->slots[loop].valid && img->slots[loop].cluster == cluster)
+		{
+			img->slots[loop].used = ++img->tick;
+			return &img->slots[loop];
+		}
+
+		if (!slot || !img->slots[loop].valid || (slot->valid && img->slots[loop].used < slot->used))
+			slot = &img->slots[loop];
+	}
+
+	if (slot->valid && slot->dirty && tivo_partition_cimage_store (img, slot) < 0)
+		return NULL;
+
+	slot->valid = 0;
+
+	if (!slot->data)
+	{
+		slot->data = malloc (cbytes);
+		if (!slot->data)
+		{
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	entry = fill? tivo_partition_cimage_entry (img, cluster): 0;
+
+	if (!entry)
+	{
+		memset (slot->data, 0, cbytes);
+	}
+	else if (CIMAGE_LENGTH (entry) == cbytes)
+	{
+		if (tivo_partition_pread (img->fd, slot->data, CIMAGE_SECTOR (entry), img->hdr.cluster) != (int) cbytes)
+		{
+			errno = EIO;
+			return NULL;
+		}
+	}
+	else
+	{
+		uLongf len = cbytes;
+
+		if (CIMAGE_LENGTH (entry) > img->zbuf_len || tivo_partition_pread (img->fd, img->zbuf, CIMAGE_SECTOR (entry), tivo_partition_cimage_sectors (CIMAGE_LENGTH (entry))) < (int) CIMAGE_LENGTH (entry))
+		{
+			errno = EIO;
+			return NULL;
+		}
+
+		if (uncompress (slot->data, &len, img->zbuf, CIMAGE_LENGTH (entry)) != Z_OK || len != cbytes)
+		{
+			errno = EIO;
+			return NULL;
+		}
+	}
+
+	slot->cluster = cluster;
+	slot->valid = 1;
+	slot->dirty = 0;
+	slot->used = ++img->tick;
+
+	return slot;
+}
+
+/****************************************************************************/
+/* Write out everything changed in an image.  The clusters and index go out */
+/* and reach the disk before the header points at the new index. */
+static int
+tivo_partition_cimage_flush (struct tivo_partition_cimage *img)
+{
+	unsigned char buf[512];
+	uint64_t len;
+	int loop;
+
+	for (loop = 0; loop < CIMAGE_SLOTS; loop++)
+	{
+		if (img->slots[loop].valid && img->slots[loop].dirty && tivo_partition_cimage_store (img, &img->slots[loop]) < 0)
+			return -1;
+	}
+
+	if (!img->changed)
+		return 0;
+
+	errno = 0;
+	if (tivo_partition_cimage_write_index (img, &len) < 0)
+		return -1;
+
+	if (fsync (img->fd) < 0)
+		return -1;
+
+	img->hdr.index = img->end;
+	img->hdr.index_len = len;
+	img->end += tivo_partition_cimage_sectors (len) * 512;
+
+	memset (buf, 0, sizeof (buf));
+	memcpy (buf, &img->hdr, sizeof (img->hdr));
+	errno = 0;
+	if (tivo_partition_pwrite (img->fd, buf, 0, 1) != 512 || fsync (img->fd) < 0)
+	{
+		if (!errno)
+			errno = EIO;
+		return -1;
+	}
+
+	img->changed = 0;
+	img->synced = img->end;
+
+	return 0;
+}
+
+/************************************************************************/
+/* Write out every open image.  Returns -1 if any of them could not be. */
+int
+tivo_partition_cimage_sync (void)
+{
+	struct tivo_partition_cimage *img;
+	int retval = 0;
+
+	for (img = cimages; img; img = img->next)
+	{
+		if (img->writable && tivo_partition_cimage_flush (img) < 0)
+		{
+			fprintf (stderr, "Error writing compressed image %s: %s\n", img->path, strerror (errno));
+			retval = -1;
+		}
+	}
+
+	return retval;
+}
+
+/***********************************************************************/
+/* Partition tables are never closed, so images opened through one are */
+/* only written out by a sync or when the program exits. */
+static void
+tivo_partition_cimage_exit (void)
+{
+	tivo_partition_cimage_sync ();
+}
+
+/************************************************************************/
+/* Check if a file is a compressed image, and if so return its header. */
+/* Only regular files are looked at, so probing a drive never reads it. */
+int
+tivo_partition_cimage_probe (const char *path, struct tivo_partition_cimage_header *hdr)
+{
+	unsigned char buf[512];
+	struct stat st;
+	int fd;
+	int retval = -1;
+
+	fd = lfopen (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	if (fstat (fd, &st) == 0 && S_ISREG (st.st_mode) && tivo_partition_pread (fd, buf, 0, 1) == 512)
+	{
+		memcpy (hdr, buf, sizeof (*hdr));
+		if (hdr->magic == TIVO_CIMAGE_MAGIC && hdr->cluster > 0 && hdr->cluster <= TIVO_CIMAGE_CLUSTER_MAX)
+			retval = 0;
+	}
+
+	close (fd);
+
+	if (retval < 0)
+		errno = EINVAL;
+
+	return retval;
+}
+
+/**********************************************************************/
+/* Create an empty compressed image for a drive of the given size.  A */
+/* cluster of 0 uses the default.  The image reads back as all zeros. */
+int
+tivo_partition_cimage_create (const char *path, uint64_t sectors, unsigned int cluster)
+{
+	struct tivo_partition_cimage_header hdr;
+	unsigned char buf[512];
+	int fd;
+
+	if (cluster == 0)
+		cluster = TIVO_CIMAGE_CLUSTER;
+
+	if (cluster > TIVO_CIMAGE_CLUSTER_MAX || sectors == 0 || (sectors + cluster - 1) / cluster / CIMAGE_PAGE + 1 > (size_t) -1 / sizeof (uint64_t *))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	memset (&hdr, 0, sizeof (hdr));
+	hdr.magic = TIVO_CIMAGE_MAGIC;
+	hdr.cluster = cluster;
+	hdr.sectors = sectors;
+
+#ifdef O_LARGEFILE
+	fd = open (path, O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+#else
+	fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+#endif
+	if (fd < 0)
+		return -1;
+
+	memset (buf, 0, sizeof (buf));
+	memcpy (buf, &hdr, sizeof (hdr));
+	errno = 0;
+	if (tivo_partition_pwrite (fd, buf, 0, 1) != 512)
+	{
+		if (!errno)
+			errno = ENOSPC;
+		close (fd);
+		return -1;
+	}
+
+	return close (fd);
+}
+
+/*************************************************/
+/* Free an image that could not be fully opened. */
+static void
+tivo_partition_cimage_free (struct tivo_partition_cimage *img)
+{
+	uint64_t loop;
+
+	if (img->index)
+	{
+		for (loop = 0; loop * CIMAGE_PAGE < img->clusters; loop++)
+			free (img->index[loop]);
+		free (img->index);
+	}
+	if (img->fd >= 0)
+		close (img->fd);
+	free (img->zbuf);
+	free (img->path);
+	free (img);
+}
+
+/********************************************************************/
+/* Open an image, or find it if it already is.  One that was opened */
+/* read-only is reopened for writing if that is asked for now. */
+static struct tivo_partition_cimage *
+tivo_partition_cimage_get (const char *path, int flags)
+{
+	struct tivo_partition_cimage *img;
+	int writable = (flags & O_ACCMODE) != O_RDONLY;
+	struct stat st;
+
+	if (stat (path, &st) < 0)
+		return NULL;
+
+	for (img = cimages; img; img = img->next)
+	{
+		if (img->dev == st.st_dev && img->ino == st.st_ino)
+			break;
+	}
+
+	if (img)
+	{
+		if (writable && !img->writable)
+		{
+			int fd = lfopen (path, O_RDWR);
+
+			if (fd < 0)
+				return NULL;
+
+			close (img->fd);
+			img->fd = fd;
+			img->writable = 1;
+		}
+
+		return img;
+	}
+
+	img = calloc (sizeof (*img), 1);
+	if (!img)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	img->fd = -1;
+	img->path = strdup (path);
+	if (!img->path || tivo_partition_cimage_probe (path, &img->hdr) < 0)
+	{
+		tivo_partition_cimage_free (img);
+		return NULL;
+	}
+
+	img->writable = writable;
+	img->fd = lfopen (path, writable? O_RDWR: O_RDONLY);
+	if (img->fd < 0 || fstat (img->fd, &st) < 0)
+	{
+		tivo_partition_cimage_free (img);
+		return NULL;
+	}
+
+	img->dev = st.st_dev;
+	img->ino = st.st_ino;
+
+/* New clusters go after everything already in the file, so the image on */
+/* disk stays good until the header is rewritten. */
+	img->end = tivo_partition_cimage_sectors (st.st_size) * 512;
+	img->synced = img->end;
+	img->clusters = (img->hdr.sectors + img->hdr.cluster - 1) / img->hdr.cluster;
+	img->zbuf_len = compressBound (img->hdr.cluster * 512);
+	img->zbuf = malloc (tivo_partition_cimage_sectors (img->zbuf_len) * 512);
+	img->index = calloc ((img->clusters + CIMAGE_PAGE - 1) / CIMAGE_PAGE, sizeof (uint64_t *));
+	if (!img->zbuf || !img->index)
+	{
+		errno = ENOMEM;
+		tivo_partition_cimage_free (img);
+		return NULL;
+	}
+
+	if (tivo_partition_cimage_load_index (img) < 0)
+	{
+		tivo_partition_cimage_free (img);
+		return NULL;
+	}
+
+	if (!cimage_atexit)
+	{
+		atexit (tivo_partition_cimage_exit);
+		cimage_atexit = 1;
+	}
+
+	img->next = cimages;
+	cimages = img;
+
+	return img;
+}
+
+/*************************************************************************/
+/* Count the clusters stored in an image, and the bytes they take in it. */
+int
+tivo_partition_cimage_usage (const char *path, uint64_t *clusters, uint64_t *bytes)
+{
+	struct tivo_partition_cimage *img = tivo_partition_cimage_get (path, O_RDONLY);
+	uint64_t loop;
+
+	if (!img)
+		return -1;
+
+	*clusters = 0;
+	*bytes = 0;
+
+	for (loop = 0; loop < img->clusters; loop++)
+	{
+		uint64_t entry = tivo_partition_cimage_entry (img, loop);
+
+		if (entry)
+		{
+			*clusters += 1;
+			*bytes += CIMAGE_LENGTH (entry);
+		}
+	}
+
+	return 0;
+}
+
+/**************************************************************************/
+/* Backend for compressed images.  There is no descriptor to hand out, so */
+/* nothing tries to map, hint or punch holes in the image file itself. */
+static int
+tivo_partition_cimage_open (tpFILE * file, const char *device, int flags)
+{
+	struct tivo_partition_cimage *img = tivo_partition_cimage_get (device, flags);
+
+	if (!img)
+		return -1;
+
+	file->fd = -1;
+	file->priv = img;
+	img->refs++;
+
+	return 0;
+}
+
+static int
+tivo_partition_cimage_size (tpFILE * file, uint64_t *sectors)
+{
+	struct tivo_partition_cimage *img = file->priv;
+
+	*sectors = img->hdr.sectors;
+
+	return 0;
+}
+
+/*****************************************************************************/
+/* Read from an image.  Only the clusters the read touches are decompressed, */
+/* and clusters of zeros that aren't cached are filled in without a slot. */
+static int
+tivo_partition_cimage_read (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_partition_cimage *img = file->priv;
+	unsigned char *out = buf;
+	int done = 0;
+
+	if (sector >= img->hdr.sectors)
+		return 0;
+	if (sector + count > img->hdr.sectors)
+		count = img->hdr.sectors - sector;
+
+	while (done < count)
+	{
+		uint64_t cluster = (sector + done) / img->hdr.cluster;
+		unsigned int offset = (sector + done) % img->hdr.cluster;
+		int toread = img->hdr.cluster - offset;
+		struct tivo_partition_cimage_slot *slot;
+		int loop;
+
+		if (toread > count - done)
+			toread = count - done;
+
+		for (loop = 0; loop < CIMAGE_SLOTS; loop++)
+		{
+			if (img->slots[loop].valid && img->slots[loop].cluster == cluster)
+				break;
+		}
+
+		if (loop == CIMAGE_SLOTS && !tivo_partition_cimage_entry (img, cluster))
+		{
+			memset (out + done * 512, 0, toread * 512);
+		}
+		else
+		{
+			slot = tivo_partition_cimage_slot (img, cluster, 1);
+			if (!slot)
+				return done > 0? done * 512: -1;
+
+			memcpy (out + done * 512, slot->data + offset * 512, toread * 512);
+		}
+
+		done += toread;
+	}
+
+	return done * 512;
+}
+
+/**************************************************************************/
+/* Write to an image.  Changes are gathered up in the slots, and clusters */
+/* are only compressed and appended when they are pushed out of them. */
+static int
+tivo_partition_cimage_write (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_partition_cimage *img = file->priv;
+	unsigned char *in = buf;
+	int done = 0;
+
+	if (!img->writable)
+	{
+		errno = EBADF;
+		return -1;
+	}
+
+	if (sector + count > img->hdr.sectors)
+	{
+		if (sector >= img->hdr.sectors)
+		{
+			errno = ENOSPC;
+			return -1;
+		}
+		count = img->hdr.sectors - sector;
+	}
+
+	while (done < count)
+	{
+		uint64_t cluster = (sector + done) / img->hdr.cluster;
+		unsigned int offset = (sector + done) % img->hdr.cluster;
+		int towrite = img->hdr.cluster - offset;
+		struct tivo_partition_cimage_slot *slot;
+
+		if (towrite > count - done)
+			towrite = count - done;
+
+/* The last cluster can be short, past the end is never written. */
+		slot = tivo_partition_cimage_slot (img, cluster, towrite < img->hdr.cluster);
+		if (!slot)
+			return done > 0? done * 512: -1;
+
+		memcpy (slot->data + offset * 512, in + done * 512, towrite * 512);
+		slot->dirty = 1;
+
+		done += towrite;
+	}
+
+	return done * 512;
+}
+
+/*****************************************************/
+/* Vectored transfers are done one buffer at a time. */
+static int
+tivo_partition_cimage_readv (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int count = iov[loop].iov_len / 512;
+		int retval = tivo_partition_cimage_read (file, iov[loop].iov_base, sector, count);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < count * 512)
+			break;
+
+		sector += count;
+	}
+
+	return total;
+}
+
+static int
+tivo_partition_cimage_writev (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int count = iov[loop].iov_len / 512;
+		int retval = tivo_partition_cimage_write (file, iov[loop].iov_base, sector, count);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < count * 512)
+			break;
+
+		sector += count;
+	}
+
+	return total;
+}
+
+/*************************************************************************/
+/* The image stays open for the other users of it.  The last one to close */
+/* it writes it out. */
+static void
+tivo_partition_cimage_close (tpFILE * file)
+{
+	struct tivo_partition_cimage *img = file->priv;
+
+	file->priv = NULL;
+
+	if (img && --img->refs == 0 && img->writable && tivo_partition_cimage_flush (img) < 0)
+		fprintf (stderr, "Error writing compressed image %s: %s\n", img->path, strerror (errno));
+}
+
+const struct tivo_partition_ops tivo_partition_cimage_ops =
+{
+	tivo_partition_cimage_open,
+	tivo_partition_cimage_size,
+	tivo_partition_cimage_read,
+	tivo_partition_cimage_write,
+	tivo_partition_cimage_readv,
+	tivo_partition_cimage_writev,
+	tivo_partition_cimage_close
+};
@@ -20,6 +20,12 @@
 #ifdef HAVE_LINUX_UNISTD_H
 #include <linux/unistd.h>
 #endif
+/* The carry-less multiply CRC needs a compiler that can build it with the */
+/* target attribute and check the CPU for it when run. */
+#if !TARGET_OS_MAC && (defined (__i386__) || defined (__x86_64__)) && defined (HAVE_IMMINTRIN_H) && __GNUC__ >= 6
+# include <immintrin.h>
+# define USE_CLMUL_CRC
+#endif
 
 #include "mfs.h"
 
@@ -62,11 +68,237 @@ static long crc32tab[] = {		/* CRC polynomial 0xedb88320 */
 
 #define UPDC32(octet, crc) (crc32tab[((int)(crc) ^ octet) & 0xff] ^ (((crc) >> 8) & 0x00FFFFFF))
 
+/* Tables for running the CRC 8 bytes at a time.  crc32slice[n][b] is the */
+/* CRC of byte b followed by n zero bytes, so the eight lookups for a */
+/* block can all be done at once instead of one after the other. */
+static unsigned int crc32slice[8][256];
+static int crc32_ready = 0;
+
+#ifdef USE_CLMUL_CRC
+/* Set if the CPU can do carry-less multiplies. */
+static int crc32_clmul_ok = 0;
+/* Byte-swapped data is swapped and added to the CRC this much at a time, */
+/* so it is still in the cache for the second pass. */
+#define CRC32_SWAB_CHUNK 4096
+
+static int crc32_clmul_check (void);
+#endif
+
+/**************************************************************************/
+/* Build the slicing tables from the byte at a time table, and see if the */
+/* CPU can do better than them. */
+static void
+crc32_init (void)
+{
+	int loop;
+	int slice;
+
+	for (loop = 0; loop < 256; loop++)
+	{
+		crc32slice[0][loop] = crc32tab[loop];
+	}
+
+	for (slice = 1; slice < 8; slice++)
+	{
+		for (loop = 0; loop < 256; loop++)
+		{
+			unsigned int prev = crc32slice[slice - 1][loop];
+
+			crc32slice[slice][loop] = crc32tab[prev & 0xff] ^ (prev >> 8);
+		}
+	}
+
+#ifdef USE_CLMUL_CRC
+	__builtin_cpu_init ();
+
+	crc32_clmul_ok = __builtin_cpu_supports ("pclmul") && __builtin_cpu_supports ("sse4.1") && crc32_clmul_check ();
+#endif
+
+	crc32_ready = 1;
+}
+
+/***************************************************************************/
+/* Add 8 bytes to the running CRC.  The bytes are put together by hand, so */
+/* this works the same on either byte order. */
+static inline unsigned int
+crc32slice8 (const unsigned char *data, unsigned int CRC)
+{
+	unsigned int one = CRC ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((unsigned int) data[3] << 24));
+	unsigned int two = data[4] | (data[5] << 8) | (data[6] << 16) | ((unsigned int) data[7] << 24);
+
+	return crc32slice[7][one & 0xff] ^ crc32slice[6][(one >> 8) & 0xff] ^ crc32slice[5][(one >> 16) & 0xff] ^ crc32slice[4][one >> 24] ^ crc32slice[3][two & 0xff] ^ crc32slice[2][(two >> 8) & 0xff] ^ crc32slice[1][(two >> 16) & 0xff] ^ crc32slice[0][two >> 24];
+}
+
+/*******************************************************************/
+/* Swap each pair of bytes in an 8 byte block, as data_swab would. */
+static inline void
+crc32swab8 (unsigned char *data)
+{
+	unsigned char tmp;
+
+	tmp = data[0]; data[0] = data[1]; data[1] = tmp;
+	tmp = data[2]; data[2] = data[3]; data[3] = tmp;
+	tmp = data[4]; data[4] = data[5]; data[5] = tmp;
+	tmp = data[6]; data[6] = data[7]; data[7] = tmp;
+}
+
+#ifdef USE_CLMUL_CRC
+/***************************************************************************/
+/* CRC a block with carry-less multiplies, folding 64 bytes at a time into */
+/* four running remainders, then those down to one, and finally to 32 bits */
+/* with a Barrett reduction.  This is the method from Intel's "Fast CRC */
+/* Computation for Generic Polynomials Using PCLMULQDQ Instruction", with */
+/* the constants for the bit-reflected polynomial 0xedb88320.  The size */
+/* must be at least 64 and a multiple of 16. */
+__attribute__ ((target ("pclmul,sse4.1"))) static unsigned int
+crc32_clmul (const unsigned char *data, unsigned int size, unsigned int CRC)
+{
+	const __m128i k1k2 = _mm_set_epi64x (0x01c6e41596LL, 0x0154442bd4LL);
+	const __m128i k3k4 = _mm_set_epi64x (0x00ccaa009eLL, 0x01751997d0LL);
+	const __m128i k5k0 = _mm_set_epi64x (0, 0x0163cd6124LL);
+	const __m128i poly = _mm_set_epi64x (0x01f7011641LL, 0x01db710641LL);
+	const __m128i mask = _mm_setr_epi32 (~0, 0, ~0, 0);
+	__m128i x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128 ((const __m128i *) (data + 0x00));
+	x2 = _mm_loadu_si128 ((const __m128i *) (data + 0x10));
+	x3 = _mm_loadu_si128 ((const __m128i *) (data + 0x20));
+	x4 = _mm_loadu_si128 ((const __m128i *) (data + 0x30));
+	x1 = _mm_xor_si128 (x1, _mm_cvtsi32_si128 (CRC));
+
+	data += 64;
+	size -= 64;
+
+	while (size >= 64)
+	{
+		x5 = _mm_clmulepi64_si128 (x1, k1k2, 0x00);
+		x6 = _mm_clmulepi64_si128 (x2, k1k2, 0x00);
+		x7 = _mm_clmulepi64_si128 (x3, k1k2, 0x00);
+		x8 = _mm_clmulepi64_si128 (x4, k1k2, 0x00);
+
+		x1 = _mm_clmulepi64_si128 (x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128 (x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128 (x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128 (x4, k1k2, 0x11);
+
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x5), _mm_loadu_si128 ((const __m128i *) (data + 0x00)));
+		x2 = _mm_xor_si128 (_mm_xor_si128 (x2, x6), _mm_loadu_si128 ((const __m128i *) (data + 0x10)));
+		x3 = _mm_xor_si128 (_mm_xor_si128 (x3, x7), _mm_loadu_si128 ((const __m128i *) (data + 0x20)));
+		x4 = _mm_xor_si128 (_mm_xor_si128 (x4, x8), _mm_loadu_si128 ((const __m128i *) (data + 0x30)));
+
+		data += 64;
+		size -= 64;
+	}
+
+/* Fold the four remainders into one. */
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x2), x5);
+
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x3), x5);
+
+	x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+	x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+	x1 = _mm_xor_si128 (_mm_xor_si128 (x1, x4), x5);
+
+	while (size >= 16)
+	{
+		x5 = _mm_clmulepi64_si128 (x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128 (x1, k3k4, 0x11);
+		x1 = _mm_xor_si128 (_mm_xor_si128 (x1, _mm_loadu_si128 ((const __m128i *) data)), x5);
+
+		data += 16;
+		size -= 16;
+	}
+
+/* Fold 128 bits down to 64. */
+	x2 = _mm_clmulepi64_si128 (x1, k3k4, 0x10);
+	x1 = _mm_xor_si128 (_mm_srli_si128 (x1, 8), x2);
+
+	x2 = _mm_srli_si128 (x1, 4);
+	x1 = _mm_and_si128 (x1, mask);
+	x1 = _mm_clmulepi64_si128 (x1, k5k0, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+
+/* Barrett reduce to 32 bits. */
+	x2 = _mm_and_si128 (x1, mask);
+	x2 = _mm_clmulepi64_si128 (x2, poly, 0x10);
+	x2 = _mm_and_si128 (x2, mask);
+	x2 = _mm_clmulepi64_si128 (x2, poly, 0x00);
+	x1 = _mm_xor_si128 (x1, x2);
+
+	return _mm_extract_epi32 (x1, 1);
+}
+
+/***************************************************************************/
+/* Run the carry-less multiply CRC over a few known blocks before trusting */
+/* it.  The lengths cover the 64 byte fold alone, with the 16 byte tail, */
+/* and with several passes of the main loop.  If any of them is wrong, the */
+/* tables are used instead, and the reason is reported once. */
+static int
+crc32_clmul_check (void)
+{
+	static const struct
+	{
+		unsigned int size;
+		unsigned int crc;
+	} vectors[] = {
+		{64, 0x6583adba},
+		{80, 0x4405db07},
+		{256, 0x2493092b}
+	};
+	unsigned char data[256];
+	int loop;
+
+	for (loop = 0; loop < sizeof (data); loop++)
+	{
+		data[loop] = loop;
+	}
+
+	for (loop = 0; loop < sizeof (vectors) / sizeof (*vectors); loop++)
+	{
+		unsigned int crc = crc32_clmul (data, vectors[loop].size, 0);
+
+		if (crc != vectors[loop].crc)
+		{
+			fprintf (stderr, "CRC self-test failed for %u bytes (%08x, expected %08x), using tables\n", vectors[loop].size, crc, vectors[loop].crc);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+#endif
+
 /*************************************************/
 /* Compute the running CRC for a block of memory */
 unsigned int
 compute_crc (unsigned char *data, unsigned int size, unsigned int CRC)
 {
+	if (!crc32_ready)
+		crc32_init ();
+
+#ifdef USE_CLMUL_CRC
+	if (crc32_clmul_ok && size >= 64)
+	{
+		unsigned int len = size & ~15;
+
+		CRC = crc32_clmul (data, len, CRC);
+		data += len;
+		size -= len;
+	}
+#endif
+
+	while (size >= 8)
+	{
+		CRC = crc32slice8 (data, CRC);
+
+		data += 8;
+		size -= 8;
+	}
+
 	while (size)
 	{
 		CRC = UPDC32 (*data, CRC);
@@ -78,30 +310,207 @@ compute_crc (unsigned char *data, unsigned int size, unsigned int CRC)
 	return CRC;
 }
 
-/**********************************************************************/
-/* Compute the checksum, replacing the integer at off with 0xdeadf00d */
+/***************************************************************************/
+/* Byte-swap a block of memory and add the swapped data to the running CRC */
+/* in the same pass.  This is the same as data_swab followed by */
+/* compute_crc, for data read from a byte-swapped volume, but only touches */
+/* the memory once. */
 unsigned int
-mfs_compute_crc (unsigned char *data, unsigned int size, unsigned int off)
+swab_compute_crc (unsigned char *data, unsigned int size, unsigned int CRC)
 {
-	unsigned int CRC = 0;
-	static const unsigned char deadfood[] = { 0xde, 0xad, 0xf0, 0x0d };
-	off = off * 4 + 3;
+#if TARGET_OS_MAC
+	data_swab (data, size);
+	return compute_crc (data, size, CRC);
+#else
+	if (!crc32_ready)
+		crc32_init ();
 
-	while (size)
+#ifdef USE_CLMUL_CRC
+/* With carry-less multiplies, a separate swap is faster than doing it */
+/* 8 bytes at a time along with the CRC. */
+	if (crc32_clmul_ok)
 	{
-		if (off < 4)
+		while (size > 1)
 		{
-/* This replaces the checksum offset without actually modifying the data. */
-			CRC = UPDC32 (deadfood[3 - off], CRC);
+			unsigned int len = size > CRC32_SWAB_CHUNK? CRC32_SWAB_CHUNK: size & ~1;
+
+			data_swab (data, len);
+			CRC = compute_crc (data, len, CRC);
+			data += len;
+			size -= len;
 		}
-		else
+	}
+#endif
+
+	while (size >= 8)
+	{
+		crc32swab8 (data);
+		CRC = crc32slice8 (data, CRC);
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 1)
+	{
+		unsigned char hi = data[0];
+		unsigned char lo = data[1];
+
+		data[0] = lo;
+		data[1] = hi;
+		CRC = UPDC32 (lo, CRC);
+		CRC = UPDC32 (hi, CRC);
+
+		data += 2;
+		size -= 2;
+	}
+
+/* data_swab leaves an odd byte alone, but it still counts. */
+	if (size)
+	{
+		CRC = UPDC32 (*data, CRC);
+	}
+
+	return CRC;
+#endif
+}
+
+/***************************************************************************/
+/* Add a block of memory to the running CRC, then byte-swap it in the same */
+/* pass.  This is for data about to be written to a byte-swapped volume, */
+/* where the CRC is of the data before it is swapped. */
+unsigned int
+compute_crc_swab (unsigned char *data, unsigned int size, unsigned int CRC)
+{
+#if TARGET_OS_MAC
+	CRC = compute_crc (data, size, CRC);
+	data_swab (data, size);
+	return CRC;
+#else
+	if (!crc32_ready)
+		crc32_init ();
+
+#ifdef USE_CLMUL_CRC
+	if (crc32_clmul_ok)
+	{
+		while (size > 1)
 		{
-			CRC = UPDC32 (*data, CRC);
+			unsigned int len = size > CRC32_SWAB_CHUNK? CRC32_SWAB_CHUNK: size & ~1;
+
+			CRC = compute_crc (data, len, CRC);
+			data_swab (data, len);
+			data += len;
+			size -= len;
 		}
-		data++;
-		size--;
-		off--;
 	}
+#endif
+
+	while (size >= 8)
+	{
+		CRC = crc32slice8 (data, CRC);
+		crc32swab8 (data);
+
+		data += 8;
+		size -= 8;
+	}
+
+	while (size > 1)
+	{
+		unsigned char hi = data[0];
+		unsigned char lo = data[1];
+
+		CRC = UPDC32 (hi, CRC);
+		CRC = UPDC32 (lo, CRC);
+		data[0] = lo;
+		data[1] = hi;
+
+		data += 2;
+		size -= 2;
+	}
+
+	if (size)
+	{
+		CRC = UPDC32 (*data, CRC);
+	}
+
+	return CRC;
+#endif
+}
+
+/**************************************************************************/
+/* Multiply two polynomials modulo the CRC polynomial, both bit-reflected */
+/* the same way as the CRC itself. */
+static unsigned int
+crc32_multmodp (unsigned int a, unsigned int b)
+{
+	unsigned int bit = 0x80000000;
+	unsigned int prod = 0;
+
+	while (bit)
+	{
+		if (a & bit)
+		{
+			prod ^= b;
+			if (!(a & (bit - 1)))
+				break;
+		}
+		bit >>= 1;
+		b = (b & 1)? (b >> 1) ^ 0xedb88320: b >> 1;
+	}
+
+	return prod;
+}
+
+/************************************************************************/
+/* Return x to the power of 8 * len modulo the CRC polynomial, which is */
+/* what a CRC is multiplied by to run it over len zero bytes.  Repeated */
+/* squaring keeps this to one multiply per bit of len. */
+static unsigned int
+crc32_zeros (uint64_t len)
+{
+	unsigned int power = 0x00800000;	/* x^8 */
+	unsigned int prod = 0x80000000;		/* 1 */
+
+	while (len)
+	{
+		if (len & 1)
+			prod = crc32_multmodp (power, prod);
+		power = crc32_multmodp (power, power);
+		len >>= 1;
+	}
+
+	return prod;
+}
+
+/*****************************************************************************/
+/* Combine the CRCs of two blocks into the CRC of both, one after the other. */
+/* crc1 is the running CRC up to the end of the first block, and crc2 is */
+/* the CRC of the second block, len2 bytes long, started from 0.  This lets */
+/* blocks be added to the CRC in any order, or by whatever has them first. */
+unsigned int
+compute_crc_combine (unsigned int crc1, unsigned int crc2, uint64_t len2)
+{
+	return crc32_multmodp (crc32_zeros (len2), crc1) ^ crc2;
+}
+
+/**********************************************************************/
+/* Compute the checksum, replacing the integer at off with 0xdeadf00d */
+unsigned int
+mfs_compute_crc (unsigned char *data, unsigned int size, unsigned int off)
+{
+	unsigned int CRC = 0;
+	static const unsigned char deadfood[] = { 0xde, 0xad, 0xf0, 0x0d };
+	unsigned int start = off * 4;
+	unsigned int len;
+
+	if (start >= size)
+		return intswap32 (compute_crc (data, size, CRC));
+
+/* This replaces the checksum offset without actually modifying the data. */
+	len = size - start < 4? size - start: 4;
+	CRC = compute_crc (data, start, CRC);
+	CRC = compute_crc ((unsigned char *) deadfood, len, CRC);
+	CRC = compute_crc (data + start + len, size - start - len, CRC);
 
 	return intswap32 (CRC);
 }
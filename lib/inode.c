@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
 #include <fcntl.h>
 #include <ctype.h>
 #include <sys/types.h>
@@ -23,51 +24,704 @@
 
 #include "mfs.h"
 
-/*********************************************/
-/* Read an inode into a pre-allocated buffer */
-int
-mfs_read_inode_to_buf (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *inode_buf)
+/* Sectors of the inode zones read at a time by mfs_scan_inodes. */
+#define MFS_INODE_SCAN_CHUNK 2048
+
+/* Inodes carved out of each slab of the inode arena. */
+#define MFS_INODE_SLAB 64
+
+/* An inode in the arena, linked through the free list when not borrowed. */
+union mfs_inode_slot
 {
-	int sector;
+	union mfs_inode_slot *next;
+	mfs_inode inode;
+	uint64_t data[512 / sizeof (uint64_t)];
+};
+
+struct mfs_inode_slab
+{
+	struct mfs_inode_slab *next;
+	union mfs_inode_slot inodes[MFS_INODE_SLAB];
+};
+
+/* Most extents that fit in an inode. */
+#define MFS_INODE_MAX_EXTENTS_32 ((512 - offsetof (mfs_inode, datablocks)) / sizeof (((mfs_inode *) 0)->datablocks.d32[0]))
+#define MFS_INODE_MAX_EXTENTS_64 ((512 - offsetof (mfs_inode, datablocks)) / sizeof (((mfs_inode *) 0)->datablocks.d64[0]))
+
+/* An inode's extent list, decoded.  start is the sum of the counts of all */
+/* the extents before it, so offsets into the data can be binary searched. */
+struct mfs_extent
+{
+	uint64_t start;
+	uint64_t sector;
+	uint64_t count;
+};
+
+struct mfs_extent_map
+{
+	unsigned int inode;			/* Inode, fsid and extents as they were */
+	unsigned int fsid;			/* in the inode, to tell if it changed. */
+	unsigned char raw[512];
+	unsigned int count;
+	unsigned int hint;			/* Extent last used */
+	struct mfs_extent extents[MFS_INODE_MAX_EXTENTS_32];
+};
+
+/****************************************************************************/
+/* Get a read-only pointer to an inode.  If the volume can be mapped this */
+/* points into the mapping, otherwise the inode is read into inode_buf and */
+/* that is returned.  The backup copy in the next sector is used if the CRC */
+/* of the first is bad. */
+mfs_inode *
+mfs_map_inode (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *inode_buf)
+{
+	uint64_t sector;
+	mfs_inode *in;
 
 	if (!inode_buf)
 	{
-		return -1;
+		return NULL;
 	}
 
 /* Find the sector number for this inode. */
 	sector = mfs_inode_to_sector (mfshnd, inode);
 	if (sector == 0)
 	{
-		return -1;
+		return NULL;
 	}
 
-	if (mfsvol_read_data (mfshnd->vols, (void *) inode_buf, sector, 1) != 512)
+	in = mfs_map_data (mfshnd, inode_buf, sector, 1);
+	if (!in)
 	{
-		return -1;
+		return NULL;
 	}
 
 /* If the CRC is good, don't bother reading the next inode. */
-	if (MFS_check_crc (inode_buf, 512, inode_buf->checksum))
+	if (MFS_check_crc (in, 512, in->checksum))
 	{
-		return 1;
+		return in;
 	}
 
 /* CRC is bad, try reading the backup on the next sector. */
-	if (mfsvol_read_data (mfshnd->vols, (void *) inode_buf, sector + 1, 1) != 512)
+	in = mfs_map_data (mfshnd, inode_buf, sector + 1, 1);
+	if (!in)
 	{
-		return -1;
+		return NULL;
 	}
 
-	if (MFS_check_crc (inode_buf, 512, inode_buf->checksum))
+	if (MFS_check_crc (in, 512, in->checksum))
 	{
-		return 1;
+		return in;
 	}
 
 	mfshnd->err_msg = "Inode %d corrupt";
 	mfshnd->err_arg1 = (void *)inode;
 
-	return -1;
+	return NULL;
+}
+
+/****************************************************************************/
+/* Call fn for every inode, reading the inode zones in large sequential */
+/* chunks instead of a sector at a time.  Both copies of each inode are */
+/* checked in memory.  If a chunk can't be read, the inodes in it are read */
+/* one at a time, so the errors land on the inodes they belong to.  Returns */
+/* whatever fn returned to stop the scan, 0 at the end, or -1 on error. */
+int
+mfs_scan_inodes (struct mfs_handle *mfshnd, mfs_inode_scan_fn fn, void *arg)
+{
+	struct zone_map *cur;
+	unsigned char *buf;
+	unsigned int inode = 0;
+	unsigned int ninodes = mfs_inode_count (mfshnd);
+	int ret = 0;
+
+	buf = malloc (MFS_INODE_SCAN_CHUNK * 512);
+	if (!buf)
+	{
+		mfshnd->err_msg = "Out of memory";
+		return -1;
+	}
+
+	for (cur = mfshnd->zones[ztInode].next; cur && !ret && inode < ninodes; cur = cur->next)
+	{
+		uint64_t first;
+		uint64_t size;
+		uint64_t done;
+
+		if (mfshnd->is_64)
+		{
+			first = intswap64 (cur->map->z64.first);
+			size = intswap64 (cur->map->z64.size);
+		}
+		else
+		{
+			first = intswap32 (cur->map->z32.first);
+			size = intswap32 (cur->map->z32.size);
+		}
+
+		for (done = 0; done + 2 <= size && !ret && inode < ninodes; done += MFS_INODE_SCAN_CHUNK)
+		{
+			int count = size - done > MFS_INODE_SCAN_CHUNK? MFS_INODE_SCAN_CHUNK: (size - done) & ~1;
+			unsigned char *map = mfs_map_data (mfshnd, buf, first + done, count);
+			int loop;
+
+			if (!map)
+			{
+				mfsvol_clearerror (mfshnd->vols);
+			}
+
+			for (loop = 0; loop < count && !ret && inode < ninodes; loop += 2, inode++)
+			{
+				mfs_inode *in;
+
+				if (!map)
+				{
+					in = mfs_map_inode (mfshnd, inode, (mfs_inode *) buf);
+				}
+				else
+				{
+					in = (mfs_inode *) (map + loop * 512);
+					if (!MFS_check_crc (in, 512, in->checksum))
+					{
+						in = (mfs_inode *) (map + (loop + 1) * 512);
+						if (!MFS_check_crc (in, 512, in->checksum))
+						{
+							mfshnd->err_msg = "Inode %d corrupt";
+							mfshnd->err_arg1 = (void *)inode;
+							in = NULL;
+						}
+					}
+				}
+
+				ret = fn (mfshnd, inode, in, arg);
+			}
+		}
+	}
+
+	free (buf);
+
+	return ret;
+}
+
+/* Flags the fsid index keeps for each inode. */
+#define MFS_FSID_CHAINED	1	/* INODE_CHAINED is set */
+#define MFS_FSID_BAD	2	/* Neither copy of the inode could be read */
+
+/* Without a saved index, the inodes are only scanned to build one after */
+/* this fraction of the inode count in hash chain walks. */
+#define MFS_FSID_INDEX_RATIO 1024
+
+#define MFS_FSID_INDEX_MAGIC 0x46534958
+
+/* fsid to inode map.  The slots are an open addressed hash table of inode */
+/* numbers plus one, keyed by the fsid in that inode.  When more than one */
+/* inode has the same fsid, the one the hash chain on disk reaches first */
+/* is the one in the table. */
+struct mfs_fsid_index
+{
+	unsigned int ninodes;
+	uint32_t *fsids;
+	unsigned char *flags;
+	uint32_t *slots;
+	unsigned int mask;
+	int dups;
+};
+
+/* Header of the saved copy of the index named by MFS_FSID_INDEX.  It is */
+/* followed by the fsids and flags of each inode. */
+struct mfs_fsid_index_file
+{
+	uint32_t magic;
+	uint32_t logstamp;
+	uint32_t checksum;
+	uint32_t ninodes;
+};
+
+/****************************************************************/
+/* Find the slot for an fsid, either the one it is in or empty. */
+static uint32_t *
+mfs_fsid_index_slot (struct mfs_fsid_index *idx, uint32_t fsid)
+{
+	uint32_t hash = fsid * 0x9e3779b1;
+	unsigned int slot = (hash ^ (hash >> 16)) & idx->mask;
+
+	while (idx->slots[slot] && idx->fsids[idx->slots[slot] - 1] != fsid)
+	{
+		slot = (slot + 1) & idx->mask;
+	}
+
+	return &idx->slots[slot];
+}
+
+/********************************************************/
+/* How far along its hash chain an fsid is in an inode. */
+static unsigned int
+mfs_fsid_index_distance (struct mfs_fsid_index *idx, unsigned int inode)
+{
+	return (inode - idx->fsids[inode] * MFS_FSID_HASH) & (idx->ninodes - 1);
+}
+
+/***********************************************/
+/* Add the fsid in an inode to the hash table. */
+static void
+mfs_fsid_index_add (struct mfs_fsid_index *idx, unsigned int inode)
+{
+	uint32_t *slot = mfs_fsid_index_slot (idx, idx->fsids[inode]);
+
+	if (*slot && *slot != inode + 1)
+	{
+		idx->dups = 1;
+		if (mfs_fsid_index_distance (idx, *slot - 1) <= mfs_fsid_index_distance (idx, inode))
+		{
+			return;
+		}
+	}
+
+	*slot = inode + 1;
+}
+
+/******************************************************************/
+/* Take an inode out of the hash table if its fsid points to it.  */
+/* Entries after it are shifted back so lookups don't stop short. */
+static void
+mfs_fsid_index_remove (struct mfs_fsid_index *idx, unsigned int inode)
+{
+	uint32_t *slot = mfs_fsid_index_slot (idx, idx->fsids[inode]);
+	unsigned int hole = slot - idx->slots;
+	unsigned int next = hole;
+
+	if (*slot != inode + 1)
+	{
+		return;
+	}
+
+	while (idx->slots[next = (next + 1) & idx->mask])
+	{
+		uint32_t hash = idx->fsids[idx->slots[next] - 1] * 0x9e3779b1;
+		unsigned int home = (hash ^ (hash >> 16)) & idx->mask;
+
+/* Move it back if the hole is between its home slot and where it is. */
+		if (((next - home) & idx->mask) >= ((next - hole) & idx->mask))
+		{
+			idx->slots[hole] = idx->slots[next];
+			hole = next;
+		}
+	}
+
+	idx->slots[hole] = 0;
+}
+
+/*******************************************/
+/* Record the fsid and flags for an inode. */
+static void
+mfs_fsid_index_set (struct mfs_fsid_index *idx, unsigned int inode, uint32_t fsid, unsigned char flags)
+{
+	uint32_t old = idx->fsids[inode];
+	unsigned int loop;
+
+	idx->flags[inode] = flags;
+	if (old == fsid)
+	{
+		return;
+	}
+
+	if (old)
+	{
+		mfs_fsid_index_remove (idx, inode);
+	}
+	idx->fsids[inode] = fsid;
+
+/* Another inode with the old fsid takes its place. */
+	if (old && idx->dups)
+	{
+		for (loop = 0; loop < idx->ninodes; loop++)
+		{
+			if (idx->fsids[loop] == old)
+			{
+				mfs_fsid_index_add (idx, loop);
+			}
+		}
+	}
+
+	if (fsid)
+	{
+		mfs_fsid_index_add (idx, inode);
+	}
+}
+
+/****************************************************/
+/* Scan callback to record each inode in the index. */
+static int
+mfs_fsid_index_scan (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *in, void *arg)
+{
+	if (!in)
+	{
+		mfs_fsid_index_set (arg, inode, 0, MFS_FSID_BAD);
+	}
+	else
+	{
+		mfs_fsid_index_set (arg, inode, intswap32 (in->fsid), (intswap32 (in->inode_flags) & INODE_CHAINED)? MFS_FSID_CHAINED: 0);
+	}
+
+	return 0;
+}
+
+/***************************************************************/
+/* Fill in the key for the saved index from the volume header. */
+static void
+mfs_fsid_index_key (struct mfs_handle *mfshnd, struct mfs_fsid_index_file *hdr, unsigned int ninodes)
+{
+	hdr->magic = MFS_FSID_INDEX_MAGIC;
+	if (mfshnd->is_64)
+	{
+		hdr->logstamp = intswap32 (mfshnd->vol_hdr.v64.logstamp);
+		hdr->checksum = intswap32 (mfshnd->vol_hdr.v64.checksum);
+	}
+	else
+	{
+		hdr->logstamp = intswap32 (mfshnd->vol_hdr.v32.logstamp);
+		hdr->checksum = intswap32 (mfshnd->vol_hdr.v32.checksum);
+	}
+	hdr->ninodes = ninodes;
+}
+
+/*****************************************************************/
+/* Load a saved index, if it was saved from this same volume set */
+/* with no transactions since. */
+static int
+mfs_fsid_index_load (struct mfs_handle *mfshnd, struct mfs_fsid_index *idx, char *path)
+{
+	struct mfs_fsid_index_file want, hdr;
+	FILE *file = fopen (path, "rb");
+	unsigned int loop;
+	int ok;
+
+	if (!file)
+	{
+		return 0;
+	}
+
+	mfs_fsid_index_key (mfshnd, &want, idx->ninodes);
+	ok = fread (&hdr, sizeof (hdr), 1, file) == 1 && !memcmp (&hdr, &want, sizeof (hdr)) &&
+		fread (idx->fsids, sizeof (*idx->fsids), idx->ninodes, file) == idx->ninodes &&
+		fread (idx->flags, sizeof (*idx->flags), idx->ninodes, file) == idx->ninodes;
+	fclose (file);
+
+	if (!ok)
+	{
+		memset (idx->fsids, 0, idx->ninodes * sizeof (*idx->fsids));
+		memset (idx->flags, 0, idx->ninodes * sizeof (*idx->flags));
+		return 0;
+	}
+
+	for (loop = 0; loop < idx->ninodes; loop++)
+	{
+		if (idx->fsids[loop])
+		{
+			mfs_fsid_index_add (idx, loop);
+		}
+	}
+
+	return 1;
+}
+
+/*****************************************************/
+/* Save the index so the next run doesn't rescan it. */
+static void
+mfs_fsid_index_save (struct mfs_handle *mfshnd, struct mfs_fsid_index *idx, char *path)
+{
+	struct mfs_fsid_index_file hdr;
+	FILE *file = fopen (path, "wb");
+	int ok;
+
+	if (!file)
+	{
+		return;
+	}
+
+	mfs_fsid_index_key (mfshnd, &hdr, idx->ninodes);
+	ok = fwrite (&hdr, sizeof (hdr), 1, file) == 1 &&
+		fwrite (idx->fsids, sizeof (*idx->fsids), idx->ninodes, file) == idx->ninodes &&
+		fwrite (idx->flags, sizeof (*idx->flags), idx->ninodes, file) == idx->ninodes;
+
+	if (fclose (file) != 0 || !ok)
+	{
+		unlink (path);
+	}
+}
+
+/***************************/
+/* Free up the fsid index. */
+void
+mfs_fsid_index_free (struct mfs_handle *mfshnd)
+{
+	struct mfs_fsid_index *idx = mfshnd->fsid_index;
+
+	if (!idx)
+	{
+		return;
+	}
+
+	if (idx->fsids)
+		free (idx->fsids);
+	if (idx->flags)
+		free (idx->flags);
+	if (idx->slots)
+		free (idx->slots);
+	free (idx);
+
+	mfshnd->fsid_index = NULL;
+}
+
+/****************************************************************************/
+/* Throw out an index that doesn't agree with the disk.  It takes another */
+/* round of chain walks before it is built again, instead of a rescan on */
+/* the very next lookup.  If nothing has been written, a saved copy is just */
+/* as wrong, so that goes too. */
+static void
+mfs_fsid_index_drop (struct mfs_handle *mfshnd)
+{
+	char *path = getenv ("MFS_FSID_INDEX");
+
+	mfs_fsid_index_free (mfshnd);
+	mfshnd->fsid_walks = 1;
+
+	if (path && !mfshnd->inodes_written)
+	{
+		unlink (path);
+	}
+}
+
+/****************************************************************************/
+/* Get the fsid index, loading or building it if it's time to.  Building */
+/* it means reading every inode, so that waits until enough hash chains */
+/* have been walked to make it worth it, unless MFS_FSID_INDEX names a file */
+/* to keep it in for next time.  NULL means walk the chain on disk. */
+static struct mfs_fsid_index *
+mfs_fsid_index_get (struct mfs_handle *mfshnd)
+{
+	char *path = getenv ("MFS_FSID_INDEX");
+	unsigned int ninodes = mfs_inode_count (mfshnd);
+	struct mfs_fsid_index *idx = mfshnd->fsid_index;
+	int had_error;
+
+	if (idx && idx->ninodes == ninodes)
+	{
+		return idx;
+	}
+
+/* The inode zones changed, start over. */
+	mfs_fsid_index_free (mfshnd);
+
+	if ((!path || mfshnd->fsid_walks) && mfshnd->fsid_walks++ < ninodes / MFS_FSID_INDEX_RATIO)
+	{
+		return NULL;
+	}
+
+	idx = calloc (sizeof (*idx), 1);
+	if (!idx)
+	{
+		return NULL;
+	}
+
+	mfshnd->fsid_index = idx;
+	idx->ninodes = ninodes;
+	idx->mask = ninodes * 2 - 1;
+	idx->fsids = calloc (ninodes, sizeof (*idx->fsids));
+	idx->flags = calloc (ninodes, sizeof (*idx->flags));
+	idx->slots = calloc (ninodes * 2, sizeof (*idx->slots));
+	if (!ninodes || !idx->fsids || !idx->flags || !idx->slots)
+	{
+		mfs_fsid_index_free (mfshnd);
+		mfshnd->fsid_walks = 1;
+		return NULL;
+	}
+
+/* Inodes written by this process may not match the volume header on disk */
+/* yet, so the saved index is only trusted or written before then. */
+	if (path && !mfshnd->inodes_written && mfs_fsid_index_load (mfshnd, idx, path))
+	{
+		return idx;
+	}
+
+/* A bad inode is only an error if a lookup runs into it. */
+	had_error = mfs_has_error (mfshnd);
+	if (mfs_scan_inodes (mfshnd, mfs_fsid_index_scan, idx) < 0)
+	{
+		mfs_fsid_index_free (mfshnd);
+		mfshnd->fsid_walks = 1;
+		return NULL;
+	}
+	if (!had_error)
+	{
+		mfs_clearerror (mfshnd);
+	}
+
+	if (path && !mfshnd->inodes_written)
+	{
+		mfs_fsid_index_save (mfshnd, idx, path);
+	}
+
+	return idx;
+}
+
+/**************************************************************************/
+/* Look up where the hash chain for an fsid leads.  Returns the inode, -1 */
+/* if the fsid is not on its chain, or -2 if the chain has to be walked. */
+static int
+mfs_fsid_index_find (struct mfs_handle *mfshnd, uint32_t fsid)
+{
+	struct mfs_fsid_index *idx;
+	unsigned int inode;
+	unsigned int loop;
+	uint32_t slot;
+
+	if (fsid == 0 || !(idx = mfs_fsid_index_get (mfshnd)))
+	{
+		return -2;
+	}
+
+	slot = *mfs_fsid_index_slot (idx, fsid);
+	if (!slot)
+	{
+		return -1;
+	}
+	inode = slot - 1;
+
+/* The walk on disk stops at the first inode that isn't chained. */
+	for (loop = (fsid * MFS_FSID_HASH) & (idx->ninodes - 1); loop != inode; loop = (loop + 1) & (idx->ninodes - 1))
+	{
+		if (idx->flags[loop] != MFS_FSID_CHAINED)
+		{
+			return -1;
+		}
+	}
+
+	return inode;
+}
+
+/****************************************************************************/
+/* Get a buffer for an inode from the inode arena.  Buffers are carved out */
+/* of slabs that are kept until the handle is cleaned up, so reading inodes */
+/* in a loop doesn't go back to malloc for each one. */
+mfs_inode *
+mfs_inode_alloc (struct mfs_handle *mfshnd)
+{
+	union mfs_inode_slot *ret;
+
+	if (!mfshnd->inode_free)
+	{
+		struct mfs_inode_slab *slab = malloc (sizeof (*slab));
+		int loop;
+
+		if (!slab)
+		{
+			mfshnd->err_msg = "Out of memory";
+			return NULL;
+		}
+
+		slab->next = mfshnd->inode_slabs;
+		mfshnd->inode_slabs = slab;
+
+		for (loop = MFS_INODE_SLAB - 1; loop >= 0; loop--)
+		{
+			slab->inodes[loop].next = mfshnd->inode_free;
+			mfshnd->inode_free = &slab->inodes[loop];
+		}
+	}
+
+	ret = mfshnd->inode_free;
+	mfshnd->inode_free = ret->next;
+
+	return &ret->inode;
+}
+
+/**************************************************/
+/* Give a borrowed inode back to the inode arena. */
+void
+mfs_release_inode (struct mfs_handle *mfshnd, mfs_inode *inode)
+{
+	union mfs_inode_slot *slot = (union mfs_inode_slot *) inode;
+
+	if (slot)
+	{
+		slot->next = mfshnd->inode_free;
+		mfshnd->inode_free = slot;
+	}
+}
+
+/**********************************************************/
+/* Free the inode arena.  Any borrowed inodes go with it. */
+void
+mfs_inode_arena_free (struct mfs_handle *mfshnd)
+{
+	while (mfshnd->inode_slabs)
+	{
+		struct mfs_inode_slab *slab = mfshnd->inode_slabs;
+
+		mfshnd->inode_slabs = slab->next;
+		free (slab);
+	}
+
+	mfshnd->inode_free = NULL;
+}
+
+/**************************************************************************/
+/* Move a borrowed inode to its own allocation, for callers that free it. */
+static mfs_inode *
+mfs_inode_unborrow (struct mfs_handle *mfshnd, mfs_inode *inode)
+{
+	mfs_inode *ret;
+
+	if (!inode)
+	{
+		return NULL;
+	}
+
+	ret = malloc (512);
+	if (ret)
+	{
+		memcpy (ret, inode, 512);
+	}
+	mfs_release_inode (mfshnd, inode);
+
+	return ret;
+}
+
+/*********************************************/
+/* Read an inode into a pre-allocated buffer */
+int
+mfs_read_inode_to_buf (struct mfs_handle *mfshnd, unsigned int inode, mfs_inode *inode_buf)
+{
+	mfs_inode *in = mfs_map_inode (mfshnd, inode, inode_buf);
+
+	if (!in)
+	{
+		return -1;
+	}
+
+	if (in != inode_buf)
+	{
+		memcpy (inode_buf, in, 512);
+	}
+
+	return 1;
+}
+
+/*****************************************************/
+/* Read an inode into a buffer from the inode arena. */
+mfs_inode *
+mfs_borrow_inode (struct mfs_handle *mfshnd, unsigned int inode)
+{
+	mfs_inode *in = mfs_inode_alloc (mfshnd);
+
+	if (in && mfs_read_inode_to_buf (mfshnd, inode, in) <= 0)
+	{
+		mfs_release_inode (mfshnd, in);
+		return NULL;
+	}
+
+	return in;
 }
 
 /*************************************/
@@ -93,6 +747,7 @@ mfs_write_inode (struct mfs_handle *mfshnd, mfs_inode *inode)
 {
 	char buf[1024];
 	int sector;
+	char *path;
 
 /* Find the sector number for this inode. */
 	sector = mfs_inode_to_sector (mfshnd, intswap32 (inode->inode));
@@ -101,6 +756,19 @@ mfs_write_inode (struct mfs_handle *mfshnd, mfs_inode *inode)
 		return -1;
 	}
 
+/* A saved fsid index is out of date as soon as anything is written to */
+/* disk.  Writes held in memory, such as a log replay, leave it good for */
+/* the disk, but it can't be used for what is in memory any more. */
+	if (!mfshnd->inodes_written)
+	{
+		mfshnd->inodes_written = 1;
+		path = getenv ("MFS_FSID_INDEX");
+		if (path && mfshnd->vols->write_mode == vwNormal)
+		{
+			unlink (path);
+		}
+	}
+
 	memcpy (buf, inode, 512);
 /* Do it after to avoid writing to source */
 	MFS_update_crc (buf, 512, ((mfs_inode *)buf)->checksum);
@@ -111,138 +779,333 @@ mfs_write_inode (struct mfs_handle *mfshnd, mfs_inode *inode)
 		return -1;
 	}
 
+	if (mfshnd->fsid_index && intswap32 (inode->inode) < mfshnd->fsid_index->ninodes)
+	{
+		mfs_fsid_index_set (mfshnd->fsid_index, intswap32 (inode->inode), intswap32 (inode->fsid), (intswap32 (inode->inode_flags) & INODE_CHAINED)? MFS_FSID_CHAINED: 0);
+	}
+
 	return 0;
 }
 
 /******************************************************************/
 /* Read an inode data based on an fsid, scanning ahead as needed. */
+/* The inode is borrowed from the inode arena. */
 mfs_inode *
-mfs_read_inode_by_fsid (struct mfs_handle *mfshnd, uint32_t fsid)
+mfs_borrow_inode_by_fsid (struct mfs_handle *mfshnd, uint32_t fsid)
 {
-	int inode = (fsid * MFS_FSID_HASH) & (mfs_inode_count (mfshnd) - 1);
+	int inode = mfs_fsid_index_find (mfshnd, fsid);
+	unsigned char buf[512];
 	mfs_inode *cur = NULL;
+	mfs_inode *ret;
+	int inode_base;
+
+	if (inode == -1)
+	{
+		return NULL;
+	}
+
+/* If the index says where it is, only that inode needs to be read.  An */
+/* index that doesn't agree with the disk is thrown out. */
+	if (inode >= 0)
+	{
+		cur = mfs_map_inode (mfshnd, inode, (mfs_inode *) buf);
+		if (!cur || intswap32 (cur->fsid) != fsid)
+		{
+			mfs_fsid_index_drop (mfshnd);
+			cur = NULL;
+		}
+	}
+
+	if (!cur)
+	{
+		inode = (fsid * MFS_FSID_HASH) & (mfs_inode_count (mfshnd) - 1);
+		inode_base = inode;
+
+/* Walk the chain in place, only the inode that matches gets copied out. */
+		do
+		{
+			cur = mfs_map_inode (mfshnd, inode, (mfs_inode *) buf);
+/* Repeat until either the fsid matches, the CHAINED flag is unset, or */
+/* every inode has been checked, which I hope I will not have to do. */
+		}
+		while (cur && intswap32 (cur->fsid) != fsid && (intswap32 (cur->inode_flags) & INODE_CHAINED) && (inode = (inode + 1) % (mfs_inode_count (mfshnd))) != inode_base);
+	}
+
+/* This is not the inode you are looking for.  Move along. */
+	if (!cur || intswap32 (cur->fsid) != fsid || cur->refcount == 0)
+	{
+		return NULL;
+	}
+
+	ret = mfs_inode_alloc (mfshnd);
+	if (ret)
+	{
+		memcpy (ret, cur, 512);
+	}
+
+	return ret;
+}
+
+/******************************************************/
+/* Read an inode data based on an fsid and return it. */
+mfs_inode *
+mfs_read_inode_by_fsid (struct mfs_handle *mfshnd, uint32_t fsid)
+{
+	return mfs_inode_unborrow (mfshnd, mfs_borrow_inode_by_fsid (mfshnd, fsid));
+}
+
+/******************************************************************/
+/* Given a fsid, find an inode for it if one doesn't already exist. */
+/* The inode is borrowed from the inode arena. */
+mfs_inode *
+mfs_borrow_inode_for_fsid (struct mfs_handle *mfshnd, uint32_t fsid)
+{
+	unsigned int ninodes = mfs_inode_count (mfshnd);
+	int inode = (fsid * MFS_FSID_HASH) & (ninodes - 1);
 	int inode_base = inode;
+	int found = mfs_fsid_index_find (mfshnd, fsid);
+	int first = -1;
+	unsigned char buf[512];
+	mfs_inode *cur;
+	mfs_inode *ret = NULL;
+
+/* An fsid the index knows about is returned straight away.  Otherwise the */
+/* chain is walked to find a free inode for it. */
+	if (found >= 0)
+	{
+		ret = mfs_borrow_inode (mfshnd, found);
+		if (ret && intswap32 (ret->fsid) == fsid)
+		{
+			return ret;
+		}
+
+		mfs_release_inode (mfshnd, ret);
+		ret = NULL;
+		mfs_fsid_index_drop (mfshnd);
+	}
+
+/* Walk the chain in place, keeping a copy of the first free inode. */
+	do
+	{
+		cur = mfs_map_inode (mfshnd, inode, (mfs_inode *) buf);
+		if (cur && first < 0 && !cur->fsid && !cur->refcount)
+		{
+			ret = mfs_inode_alloc (mfshnd);
+			if (!ret)
+			{
+				return NULL;
+			}
+			memcpy (ret, cur, 512);
+			first = inode;
+		}
+/* Repeat until either the fsid matches, the CHAINED flag is unset, or */
+/* every inode has been checked, which I hope I will not have to do. */
+	}
+	while (cur && intswap32 (cur->fsid) != fsid && (intswap32 (cur->inode_flags) & INODE_CHAINED) && (inode = (inode + 1) % ninodes) != inode_base);
+
+/* If nothing was read, something is wrong */
+	if (!cur)
+	{
+		mfs_release_inode (mfshnd, ret);
+		return NULL;
+	}
+
+/* If the fsid was found, return the inode */
+	if (intswap32 (cur->fsid) == fsid)
+	{
+		if (!ret)
+		{
+			ret = mfs_inode_alloc (mfshnd);
+			if (!ret)
+			{
+				return NULL;
+			}
+		}
+		memcpy (ret, cur, 512);
+		return ret;
+	}
+
+/* If the fsid wasn't located, but an empty inode was, return that. */
+	if (ret)
+	{
+/* Make sure the inode number is set */
+		ret->inode = intswap32 (first);
+		return ret;
+	}
 
-	do
+/* Every inode was on the chain and none are free. */
+	if (inode == inode_base && (intswap32 (cur->inode_flags) & INODE_CHAINED))
+	{
+		return NULL;
+	}
+
+/* Keep looking, marking each inode passed over chained. */
+	while (cur->fsid || cur->refcount)
 	{
-		if (cur)
+		if (!(cur->inode_flags & intswap32 (INODE_CHAINED)))
+		{
+			mfs_inode *chained = (mfs_inode *) buf;
+
+			if (cur != chained)
+			{
+				memcpy (chained, cur, 512);
+			}
+			chained->inode_flags |= intswap32 (INODE_CHAINED);
+			if (mfs_write_inode (mfshnd, chained) < 0)
+			{
+				return NULL;
+			}
+		}
+
+		inode = (inode + 1) % ninodes;
+		if (inode == inode_base)
 		{
-			free (cur);
+			return NULL;
 		}
 
-		cur = mfs_read_inode (mfshnd, inode);
-/* Repeat until either the fsid matches, the CHAINED flag is unset, or */
-/* every inode has been checked, which I hope I will not have to do. */
+		cur = mfs_map_inode (mfshnd, inode, (mfs_inode *) buf);
+		if (!cur)
+		{
+			return NULL;
+		}
 	}
-	while (cur && intswap32 (cur->fsid) != fsid && (intswap32 (cur->inode_flags) & INODE_CHAINED) && (inode = (inode + 1) % (mfs_inode_count (mfshnd))) != inode_base);
 
-/* If cur is NULL or the fsid is correct and in use, then cur contains the */
-/* right return. */
-	if (!cur || (intswap32 (cur->fsid) == fsid && cur->refcount != 0))
+	ret = mfs_inode_alloc (mfshnd);
+	if (!ret)
 	{
-		return cur;
+		return NULL;
 	}
 
-/* This is not the inode you are looking for.  Move along. */
-	free (cur);
-	return NULL;
+	memcpy (ret, cur, 512);
+	ret->inode = intswap32 (inode);
+	return ret;
 }
 
-/******************************************************************/
-/* Given a fsid, find an inode for it if one doesn't already exist. */
+/*****************************************************/
+/* Given a fsid, find an inode for it and return it. */
 mfs_inode *
 mfs_find_inode_for_fsid (struct mfs_handle *mfshnd, unsigned int fsid)
 {
-	int inode = (fsid * MFS_FSID_HASH) & (mfs_inode_count (mfshnd) - 1);
-	mfs_inode *cur = NULL;
-	int inode_base = inode;
-	mfs_inode *first = NULL;
+	return mfs_inode_unborrow (mfshnd, mfs_borrow_inode_for_fsid (mfshnd, fsid));
+}
 
-	do
+/***************************************************************************/
+/* Get the decoded extent map for an inode.  The last one built is kept */
+/* with the handle and reused as long as the inode it was built from still */
+/* has the same extents, so repeated reads and writes of one inode only */
+/* decode and swap its extent list once. */
+static struct mfs_extent_map *
+mfs_extent_map_get (struct mfs_handle *mfshnd, mfs_inode *inode)
+{
+	struct mfs_extent_map *map = mfshnd->extent_map;
+	unsigned int numblocks = intswap32 (inode->numblocks);
+	unsigned int rawsize;
+	uint64_t start = 0;
+	unsigned int loop;
+
+/* A corrupt count can't run past the end of the inode. */
+	if (numblocks > (mfshnd->is_64? MFS_INODE_MAX_EXTENTS_64: MFS_INODE_MAX_EXTENTS_32))
 	{
-		if (cur && cur != first)
-		{
-			free (cur);
-		}
+		numblocks = mfshnd->is_64? MFS_INODE_MAX_EXTENTS_64: MFS_INODE_MAX_EXTENTS_32;
+	}
+	rawsize = numblocks * (mfshnd->is_64? sizeof (inode->datablocks.d64[0]): sizeof (inode->datablocks.d32[0]));
 
-		cur = mfs_read_inode (mfshnd, inode);
-		if (cur && !first && !cur->fsid && !cur->refcount)
-		{
-			first = cur;
-		}
-/* Repeat until either the fsid matches, the CHAINED flag is unset, or */
-/* every inode has been checked, which I hope I will not have to do. */
+	if (map && map->inode == inode->inode && map->fsid == inode->fsid && map->count == numblocks && !memcmp (map->raw, &inode->datablocks, rawsize))
+	{
+		return map;
 	}
-	while (cur && intswap32 (cur->fsid) != fsid && (intswap32 (cur->inode_flags) & INODE_CHAINED) && (inode = (inode + 1) % (mfs_inode_count (mfshnd))) != inode_base);
 
-/* If nothing was read, something is wrong */
-	if (!cur)
+	if (!map)
 	{
-		if (first)
+		map = malloc (sizeof (*map));
+		if (!map)
 		{
-			free (first);
+			mfshnd->err_msg = "Out of memory";
+			return NULL;
 		}
-		return NULL;
+		mfshnd->extent_map = map;
 	}
 
-/* If the fsid was found, return the inode */
-	if (cur && (intswap32 (cur->fsid) == fsid))
+	map->inode = inode->inode;
+	map->fsid = inode->fsid;
+	map->count = numblocks;
+	map->hint = 0;
+	memcpy (map->raw, &inode->datablocks, rawsize);
+
+	for (loop = 0; loop < numblocks; loop++)
 	{
-		if (first && first != cur)
+		map->extents[loop].start = start;
+		if (mfshnd->is_64)
 		{
-			free (first);
+			map->extents[loop].sector = intswap64 (inode->datablocks.d64[loop].sector);
+			map->extents[loop].count = intswap32 (inode->datablocks.d64[loop].count);
 		}
-		return cur;
+		else
+		{
+			map->extents[loop].sector = intswap32 (inode->datablocks.d32[loop].sector);
+			map->extents[loop].count = intswap32 (inode->datablocks.d32[loop].count);
+		}
+		start += map->extents[loop].count;
 	}
 
-/* If the fsid wasn't located, but an empty inode was, return that. */
-	if (first)
+	return map;
+}
+
+/*************************************************************************/
+/* Find the extent holding a sector offset into the data, or -1 if it is */
+/* past the end.  Sequential access is checked first, in the extent last */
+/* used and the one after it, before falling back to a binary search. */
+static int
+mfs_extent_find (struct mfs_extent *extents, unsigned int count, unsigned int hint, uint64_t start)
+{
+	unsigned int low = 0;
+	unsigned int high = count;
+
+	if (hint < count && start >= extents[hint].start)
 	{
-		if (cur && cur != first)
+		if (start - extents[hint].start < extents[hint].count)
 		{
-			free (cur);
+			return hint;
+		}
+		if (hint + 1 < count && start - extents[hint + 1].start < extents[hint + 1].count)
+		{
+			return hint + 1;
 		}
-/* Make sure the inode number is set */
-		first->inode = intswap32 (inode);
-		return first;
 	}
 
-/* Keep looking */
-	do
+/* Find the last extent starting at or before the offset. */
+	while (high - low > 1)
 	{
-		if (cur)
+		unsigned int mid = (low + high) / 2;
+
+		if (extents[mid].start <= start)
 		{
-/* Mark this inode chained */
-			if (!(cur->inode_flags & intswap32 (INODE_CHAINED)))
-			{
-				cur->inode_flags |= intswap32 (INODE_CHAINED);
-				if (mfs_write_inode (mfshnd, cur) < 0)
-				{
-					free (cur);
-					return NULL;
-				}
-			}
-			free (cur);
+			low = mid;
 		}
+		else
+		{
+			high = mid;
+		}
+	}
 
-		cur = mfs_read_inode (mfshnd, inode);
-		
-/* Repeat until a free inode is found, or */
-/* every inode has been checked, which I hope I will not have to do. */
+	if (low >= count || start - extents[low].start >= extents[low].count)
+	{
+		return -1;
 	}
-	while (cur && (cur->fsid || cur->refcount) && (inode = (inode + 1) % (mfs_inode_count (mfshnd))) != inode_base);
 
-	if (!cur)
-		return NULL;
+	return low;
+}
 
-	if (cur->fsid || cur->refcount)
+/***************************************/
+/* Free the cached extent map, if any. */
+void
+mfs_extent_map_free (struct mfs_handle *mfshnd)
+{
+	if (mfshnd->extent_map)
 	{
-		free (cur);
-		return NULL;
+		free (mfshnd->extent_map);
+		mfshnd->extent_map = NULL;
 	}
-
-	cur->inode = intswap32 (inode);
-	return cur;
 }
 
 /**************************************/
@@ -276,46 +1139,32 @@ mfs_write_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigne
 	else if (inode->numblocks)
 /* If it doesn't fit in the sector find out where it is. */
 	{
+		struct mfs_extent_map *map = mfs_extent_map_get (mfshnd, inode);
 		int loop;
 
-/* Loop through each block in the inode. */
-		for (loop = 0; count && loop < intswap32 (inode->numblocks); loop++)
+		if (!map)
+		{
+			return -1;
+		}
+
+/* Start at the extent holding the start offset. */
+		loop = mfs_extent_find (map->extents, map->count, map->hint, start);
+		if (loop < 0)
+		{
+			return 0;
+		}
+		start -= map->extents[loop].start;
+
+/* Loop through each block from there. */
+		for (; count && loop < map->count; loop++)
 		{
 /* For sanity sake (Mine, not the code's), make these variables. */
-			uint64_t blkstart;
-			uint64_t blkcount;
+			uint64_t blkstart = map->extents[loop].sector + start;
+			uint64_t blkcount = map->extents[loop].count - start;
 			int result;
 
-			if (mfshnd->is_64)
-			{
-				blkstart = intswap64 (inode->datablocks.d64[loop].sector);
-				blkcount = intswap32 (inode->datablocks.d64[loop].count);
-			}
-			else
-			{
-				blkstart = intswap32 (inode->datablocks.d32[loop].sector);
-				blkcount = intswap32 (inode->datablocks.d32[loop].count);
-			}
-
-/* If the start offset has not been reached, skip to it. */
-			if (start)
-			{
-				if (blkcount <= start)
-				{
-/* If the start offset is not within this block, decrement the start and keep */
-/* going. */
-					start -= blkcount;
-					continue;
-				}
-				else
-				{
-/* The start offset is within this block.  Adjust the block parameters a */
-/* little, since this is just local variables. */
-					blkstart += start;
-					blkcount -= start;
-					start = 0;
-				}
-			}
+			start = 0;
+			map->hint = loop;
 
 /* If the entire data is within this block, make this block look like it */
 /* is no bigger than the data. */
@@ -348,10 +1197,11 @@ mfs_write_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigne
 	return totwrit;
 }
 
-/*************************************/
-/* Read a portion of an inodes data. */
-int
-mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count)
+/**********************************************************************/
+/* Read a portion of an inodes data.  If raw is set, the data is left */
+/* byte-swapped, as with mfsvol_read_data_raw. */
+static int
+mfs_read_inode_data_part_int (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count, int raw)
 {
 	int totread = 0;
 
@@ -377,51 +1227,39 @@ mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned
 
 		memset (data + size, 0, 512 - size);
 		memcpy (data, (unsigned char *) inode + 0x3c, size);
+		if (raw)
+			data_swab (data, 512);
 		return 512;
 	}
 /* If it doesn't fit in the sector find out where it is. */
 	else if (inode->numblocks)
 	{
+		struct mfs_extent_map *map = mfs_extent_map_get (mfshnd, inode);
 		int loop;
 
-/* Loop through each block in the inode. */
-		for (loop = 0; count && loop < intswap32 (inode->numblocks); loop++)
+		if (!map)
+		{
+			return -1;
+		}
+
+/* Start at the extent holding the start offset. */
+		loop = mfs_extent_find (map->extents, map->count, map->hint, start);
+		if (loop < 0)
+		{
+			return 0;
+		}
+		start -= map->extents[loop].start;
+
+/* Loop through each block from there. */
+		for (; count && loop < map->count; loop++)
 		{
 /* For sanity sake, make these variables. */
-			uint64_t blkstart;
-			uint64_t blkcount;
+			uint64_t blkstart = map->extents[loop].sector + start;
+			uint64_t blkcount = map->extents[loop].count - start;
 			int result;
 
-			if (mfshnd->is_64)
-			{
-				blkstart = intswap64 (inode->datablocks.d64[loop].sector);
-				blkcount = intswap32 (inode->datablocks.d64[loop].count);
-			}
-			else
-			{
-				blkstart = intswap32 (inode->datablocks.d32[loop].sector);
-				blkcount = intswap32 (inode->datablocks.d32[loop].count);
-			}
-
-/* If the start offset has not been reached, skip to it. */
-			if (start)
-			{
-				if (blkcount <= start)
-				{
-/* If the start offset is not within this block, decrement the start and keep */
-/* going. */
-					start -= blkcount;
-					continue;
-				}
-				else
-				{
-/* The start offset is within this block.  Adjust the block parameters a */
-/* little, since this is just local variables. */
-					blkstart += start;
-					blkcount -= start;
-					start = 0;
-				}
-			}
+			start = 0;
+			map->hint = loop;
 
 /* If the entire data is within this block, make this block look like it */
 /* is no bigger than the data. */
@@ -430,7 +1268,10 @@ mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned
 				blkcount = count;
 			}
 
-			result = mfsvol_read_data (mfshnd->vols, data, blkstart, blkcount);
+			if (raw)
+				result = mfsvol_read_data_raw (mfshnd->vols, data, blkstart, blkcount);
+			else
+				result = mfsvol_read_data (mfshnd->vols, data, blkstart, blkcount);
 			count -= blkcount;
 
 /* Error - propogate it up. */
@@ -454,6 +1295,86 @@ mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned
 	return totread;
 }
 
+/*************************************/
+/* Read a portion of an inodes data. */
+int
+mfs_read_inode_data_part (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count)
+{
+	return mfs_read_inode_data_part_int (mfshnd, inode, data, start, count, 0);
+}
+
+/************************************************************************/
+/* Read a portion of an inodes data, leaving it byte-swapped.  Only for */
+/* volume sets where mfsvol_is_swabbed is true, so the caller can swap */
+/* it along with other work. */
+int
+mfs_read_inode_data_part_raw (struct mfs_handle *mfshnd, mfs_inode * inode, unsigned char *data, uint64_t start, unsigned int count)
+{
+	return mfs_read_inode_data_part_int (mfshnd, inode, data, start, count, 1);
+}
+
+/***************************************************************************/
+/* Tell the volume layer which extents of an inode are about to be read, */
+/* starting start sectors into the data and going for count sectors, so it */
+/* can read ahead of them. */
+int
+mfs_inode_readahead (struct mfs_handle *mfshnd, mfs_inode * inode, uint64_t start, uint64_t count)
+{
+	struct volume_readahead_extent *extents;
+	struct mfs_extent_map *map;
+	int nextents = 0;
+	int loop;
+	int ret;
+
+	if ((inode->inode_flags & intswap32 (INODE_DATA)) || !inode->numblocks)
+	{
+		return mfsvol_readahead_plan (mfshnd->vols, NULL, 0);
+	}
+
+	map = mfs_extent_map_get (mfshnd, inode);
+	if (!map)
+	{
+		return -1;
+	}
+
+	extents = malloc (sizeof (*extents) * map->count);
+	if (!extents)
+	{
+		return -1;
+	}
+
+/* Start at the extent holding the start offset, the same as */
+/* mfs_read_inode_data_part. */
+	loop = mfs_extent_find (map->extents, map->count, map->hint, start);
+	if (loop >= 0)
+	{
+		start -= map->extents[loop].start;
+	}
+
+	for (; loop >= 0 && count && loop < map->count; loop++)
+	{
+		uint64_t blkstart = map->extents[loop].sector + start;
+		uint64_t blkcount = map->extents[loop].count - start;
+
+		start = 0;
+
+		if (blkcount > count)
+		{
+			blkcount = count;
+		}
+
+		extents[nextents].sector = blkstart;
+		extents[nextents].count = blkcount;
+		nextents++;
+		count -= blkcount;
+	}
+
+	ret = mfsvol_readahead_plan (mfshnd->vols, extents, nextents);
+	free (extents);
+
+	return ret;
+}
+
 /******************************************************************************/
 /* Read all the data from an inode, set size to how much was read.  This does */
 /* not allow streams, since they are be so big. */
@@ -496,3 +1417,224 @@ mfs_read_inode_data (struct mfs_handle *mfshnd, mfs_inode * inode, int *size)
 
 	return data;
 }
+
+/* Sequential reader for an inode's data.  It keeps its own copy of the */
+/* inode and of its extents, with physically adjacent extents merged so */
+/* they are read in one go. */
+struct mfs_inode_reader
+{
+	struct mfs_handle *mfshnd;
+	uint64_t inode[512 / sizeof (uint64_t)];
+	uint64_t pos;				/* Sectors into the data */
+	unsigned int count;
+	unsigned int current;		/* Extent holding pos */
+	struct mfs_extent extents[MFS_INODE_MAX_EXTENTS_32];
+};
+
+/***************************************************************************/
+/* Start reading an inode's data from the beginning.  The inode can be */
+/* released once this returns.  If readahead is not 0, the volume layer is */
+/* told that many sectors of the data are about to be read, so it can */
+/* prefetch them while the caller works on what it already has. */
+struct mfs_inode_reader *
+mfs_inode_reader_open (struct mfs_handle *mfshnd, mfs_inode *inode, uint64_t readahead)
+{
+	struct mfs_inode_reader *reader = calloc (sizeof (*reader), 1);
+	unsigned int loop;
+
+	if (!reader)
+	{
+		mfshnd->err_msg = "Out of memory";
+		return NULL;
+	}
+
+	reader->mfshnd = mfshnd;
+	memcpy (reader->inode, inode, 512);
+
+	if (!(inode->inode_flags & intswap32 (INODE_DATA)) && inode->numblocks)
+	{
+		struct mfs_extent_map *map = mfs_extent_map_get (mfshnd, inode);
+
+		if (!map)
+		{
+			free (reader);
+			return NULL;
+		}
+
+		for (loop = 0; loop < map->count; loop++)
+		{
+			struct mfs_extent *last = reader->count? &reader->extents[reader->count - 1]: NULL;
+
+			if (!map->extents[loop].count)
+			{
+				continue;
+			}
+
+			if (last && last->sector + last->count == map->extents[loop].sector)
+			{
+				last->count += map->extents[loop].count;
+			}
+			else
+			{
+				reader->extents[reader->count++] = map->extents[loop];
+			}
+		}
+	}
+
+	if (readahead)
+	{
+		mfs_inode_readahead (mfshnd, inode, 0, readahead);
+	}
+
+	return reader;
+}
+
+/******************************************************/
+/* The reader's copy of the inode it is reading from. */
+mfs_inode *
+mfs_inode_reader_inode (struct mfs_inode_reader *reader)
+{
+	return (mfs_inode *) reader->inode;
+}
+
+/**************************************************/
+/* Where the reader is, in sectors into the data. */
+uint64_t
+mfs_inode_reader_tell (struct mfs_inode_reader *reader)
+{
+	return reader->pos;
+}
+
+/****************************************************************************/
+/* Move the reader to a sector offset into the data.  Returns -1 if that is */
+/* past the end, leaving the reader there, so reads return nothing. */
+int
+mfs_inode_reader_seek (struct mfs_inode_reader *reader, uint64_t start)
+{
+	int loop = mfs_extent_find (reader->extents, reader->count, reader->current, start);
+
+	reader->pos = start;
+
+	if (loop < 0)
+	{
+		reader->current = reader->count;
+		return (mfs_inode_reader_inode (reader)->inode_flags & intswap32 (INODE_DATA)) && !start? 0: -1;
+	}
+
+	reader->current = loop;
+	return 0;
+}
+
+/************************************************************************/
+/* Read the next count sectors of data, going across as many extents as */
+/* that takes, and return the number of bytes read. */
+static int
+mfs_inode_reader_read_int (struct mfs_inode_reader *reader, unsigned char *data, unsigned int count, int raw)
+{
+	struct mfs_handle *mfshnd = reader->mfshnd;
+	int totread = 0;
+
+	if (!data || !count)
+	{
+		return 0;
+	}
+
+/* Data in the inode is all read at once. */
+	if (mfs_inode_reader_inode (reader)->inode_flags & intswap32 (INODE_DATA))
+	{
+		if (reader->pos)
+		{
+			return 0;
+		}
+
+		reader->pos++;
+		return mfs_read_inode_data_part_int (mfshnd, mfs_inode_reader_inode (reader), data, 0, count, raw);
+	}
+
+/* Several extents at a time are read together, so they are all in flight */
+/* at once. */
+	while (count && reader->current < reader->count)
+	{
+		struct volume_readahead_extent list[MFSVOL_AIO_DEPTH];
+		unsigned int current = reader->current;
+		uint64_t pos = reader->pos;
+		unsigned int left = count;
+		int nlist = 0;
+		int result;
+
+		while (left && current < reader->count && nlist < MFSVOL_AIO_DEPTH)
+		{
+			struct mfs_extent *extent = &reader->extents[current];
+			uint64_t offset = pos - extent->start;
+			uint64_t blkcount = extent->count - offset;
+
+			if (blkcount > left)
+			{
+				blkcount = left;
+			}
+			else
+			{
+				current++;
+			}
+
+			list[nlist].sector = extent->sector + offset;
+			list[nlist].count = blkcount;
+			nlist++;
+
+			pos += blkcount;
+			left -= blkcount;
+		}
+
+		result = mfsvol_read_extents (mfshnd->vols, data, list, nlist, raw);
+
+/* Error - propogate it up. */
+		if (result < 0)
+		{
+			return result;
+		}
+
+		mfs_inode_reader_seek (reader, reader->pos + result / 512);
+
+		totread += result;
+		data += result;
+
+/* Stop short if the read was truncated. */
+		if (result != (count - left) * 512)
+		{
+			break;
+		}
+
+		count = left;
+	}
+
+	return totread;
+}
+
+/*****************************************************************/
+/* Read the next count sectors of an inode's data from a reader. */
+int
+mfs_inode_reader_read (struct mfs_inode_reader *reader, unsigned char *data, unsigned int count)
+{
+	return mfs_inode_reader_read_int (reader, data, count, 0);
+}
+
+/****************************************************************************/
+/* Read the next count sectors, leaving them byte-swapped.  Only for volume */
+/* sets where mfsvol_is_swabbed is true, the same as */
+/* mfs_read_inode_data_part_raw. */
+int
+mfs_inode_reader_read_raw (struct mfs_inode_reader *reader, unsigned char *data, unsigned int count)
+{
+	return mfs_inode_reader_read_int (reader, data, count, 1);
+}
+
+/*********************/
+/* Close the reader. */
+void
+mfs_inode_reader_close (struct mfs_inode_reader *reader)
+{
+	if (reader)
+	{
+		free (reader);
+	}
+}
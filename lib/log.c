@@ -300,6 +300,7 @@ int
 mfs_log_inode_update (struct mfs_handle *mfshnd, mfs_inode *inode)
 {
 	mfs_inode *oldinode;
+	unsigned char oldbuf[512];
 	log_inode_update *entry;
 	int datasize = 0;
 	int inodedata = 0;
@@ -314,7 +315,11 @@ mfs_log_inode_update (struct mfs_handle *mfshnd, mfs_inode *inode)
 	/* Read in the previous contents of the inode if there was any */
 	if (inode->inode != -1)
 	{
-		oldinode = mfs_read_inode (mfshnd, intswap32 (inode->inode));
+		oldinode = (mfs_inode *) oldbuf;
+		if (mfs_read_inode_to_buf (mfshnd, intswap32 (inode->inode), oldinode) <= 0)
+		{
+			oldinode = NULL;
+		}
 	}
 	else
 	{
@@ -401,9 +406,9 @@ mfs_log_sync_inode (struct mfs_handle *mfshnd, log_inode_update *entry)
 	mfs_inode *inode;
 
 	if (intswap32 (entry->inode) == -1)
-		inode = mfs_find_inode_for_fsid (mfshnd, intswap32 (entry->fsid));
+		inode = mfs_borrow_inode_for_fsid (mfshnd, intswap32 (entry->fsid));
 	else
-		inode = mfs_read_inode (mfshnd, intswap32 (entry->inode));
+		inode = mfs_borrow_inode (mfshnd, intswap32 (entry->inode));
 
 	if (!inode)
 	{
@@ -444,7 +449,11 @@ mfs_log_sync_inode (struct mfs_handle *mfshnd, log_inode_update *entry)
 	}
 	memcpy (&inode->datablocks.d32[0], &entry->datablocks.d32[0], intswap32 (entry->datasize));
 	if (mfs_write_inode (mfshnd, inode) < 0)
+	{
+		mfs_release_inode (mfshnd, inode);
 		return 0;
+	}
+	mfs_release_inode (mfshnd, inode);
 
 	/* Update the next fsid field in the volume header if it's needed */
 	if (mfshnd->is_64)
@@ -848,8 +857,8 @@ mfs_log_fssync (struct mfs_handle *mfshnd)
 	}
 	else if (mfshnd->current_log->logstamp == intswap32 (mfshnd->lastlogsync + 1))
 	{
-		/* Already synced */
-		return 1;
+		/* Already synced, but it is still a barrier */
+		return mfs_flush (mfshnd) < 0? 0: 1;
 	}
 	else if (mfshnd->current_log->logstamp != intswap32 (mfshnd->lastlogcommit + 1))
 	{
@@ -864,6 +873,12 @@ mfs_log_fssync (struct mfs_handle *mfshnd)
 	mfs_log_add_entry (mfshnd, &entry);
 	mfs_log_write_current_log (mfshnd);
 
+	/* The log has to reach the disk before the zone maps and volume header */
+	if (mfs_flush (mfshnd) < 0)
+	{
+		return 0;
+	}
+
 	/* Increment it again so this transaction will be distinct from */
 	/* updates before the next transaction */
 	mfshnd->bootsecs++;
@@ -876,6 +891,10 @@ mfs_log_fssync (struct mfs_handle *mfshnd)
 	{
 		return 0;
 	}
+	if (mfs_flush (mfshnd) < 0)
+	{
+		return 0;
+	}
 
 	return 1;
 }
@@ -910,12 +929,20 @@ mfs_log_commit (struct mfs_handle *mfshnd)
 	if (mfs_log_write_current_log (mfshnd) <= 0)
 		return 0;
 
+	/* The log has to reach the disk before the changes it covers */
+	if (mfs_flush (mfshnd) < 0)
+		return 0;
+
 	if (mfs_log_load_list (mfshnd, mfshnd->lastlogcommit + 1, endlog, &list) <= 0)
 		return 0;
 
 	if (mfs_log_commit_list (mfshnd, list, endlog) <= 0)
 		return 0;
 
+	/* And the changes before anything in the next transaction */
+	if (mfs_flush (mfshnd) < 0)
+		return 0;
+
 	/* Perform a periodic fssync */
 	if (mfshnd->lastlogcommit - mfshnd->lastlogsync > mfs_log_nentries (mfshnd) / 2)
 	{
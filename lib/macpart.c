@@ -3,6 +3,10 @@
 #endif
 /* For stat64 */
 #define _LARGEFILE64_SOURCE 1
+/* For O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,6 +30,9 @@
 #ifdef HAVE_LINUX_UNISTD_H
 #include <linux/unistd.h>
 #endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 
 /* #include "mfs.h" */
 #include "macpart.h"
@@ -103,6 +110,59 @@ file_or_dev_size (int fd, uint64_t *size)
 	return -1;
 }
 
+/****************************************************************************/
+/* Find the alignment, in sectors, for new partitions on a device.  This is */
+/* the physical sector size of the drive, so a partition on an Advanced */
+/* Format drive doesn't share physical sectors with its neighbors. */
+/* MFS_PARTITION_ALIGN overrides it, such as with 2048 for 1MiB alignment. */
+static unsigned int
+tivo_partition_dev_align (int fd)
+{
+	char *env = getenv ("MFS_PARTITION_ALIGN");
+	unsigned int align = 1;
+
+	if (env && *env)
+	{
+		align = strtoul (env, NULL, 0);
+	}
+	else
+	{
+#ifdef BLKPBSZGET
+		struct stat st;
+		unsigned int pbsz;
+
+		if (fstat (fd, &st) == 0 && S_ISBLK (st.st_mode) && ioctl (fd, BLKPBSZGET, &pbsz) == 0)
+			align = pbsz / 512;
+#else
+#ifdef DKIOCGETPHYSICALBLOCKSIZE	/* For Mac OS X */
+		uint32_t pbsz;
+
+		if (ioctl (fd, DKIOCGETPHYSICALBLOCKSIZE, &pbsz) == 0)
+			align = pbsz / 512;
+#endif
+#endif
+	}
+
+	if (align < 1)
+		align = 1;
+	if (align > TIVO_PARTITION_ALIGN_MAX)
+		align = TIVO_PARTITION_ALIGN_MAX;
+
+	return align;
+}
+
+/********************************************************************/
+/* Round a sector up to where the next partition on the table could */
+/* start. */
+static uint64_t
+tivo_partition_align_up (struct tivo_partition_table *table, uint64_t sector)
+{
+	if (table->align <= 1)
+		return sector;
+
+	return (sector + table->align - 1) / table->align * table->align;
+}
+
 /****************************************************************************/
 /* Opens a file normally.  If it fails with EFBIG open it with O_LARGEFILE. */
 int
@@ -121,6 +181,152 @@ lfopen (const char *device, int flags)
 	return fd;
 }
 
+/**************************************************************************/
+/* Backend for files and devices, which are reached through a descriptor. */
+/* The transfers are in readwrite.c. */
+static int
+tivo_partition_fd_open (tpFILE *file, const char *device, int flags)
+{
+	file->fd = lfopen (device, flags);
+	return file->fd < 0? -1: 0;
+}
+
+static int
+tivo_partition_fd_size (tpFILE *file, uint64_t *sectors)
+{
+	return file_or_dev_size (file->fd, sectors);
+}
+
+static void
+tivo_partition_fd_close (tpFILE *file)
+{
+	if (file->fd >= 0)
+		close (file->fd);
+	file->fd = -1;
+}
+
+static const struct tivo_partition_ops tivo_partition_fd_ops =
+{
+	tivo_partition_fd_open,
+	tivo_partition_fd_size,
+	tivo_partition_fd_read,
+	tivo_partition_fd_write,
+	tivo_partition_fd_readv,
+	tivo_partition_fd_writev,
+	tivo_partition_fd_close
+};
+
+/***********************************************************************/
+/* Pick the backend for a device name.  Names starting with "ram:" are */
+/* held in memory, and files with the compressed image header are read */
+/* through it.  Anything else is a file or device on the system. */
+const struct tivo_partition_ops *
+tivo_partition_backend (const char *device)
+{
+#if HAVE_LIBZ
+	struct tivo_partition_cimage_header hdr;
+#endif
+
+	if (!strncmp (device, TIVO_PARTITION_RAM_PREFIX, strlen (TIVO_PARTITION_RAM_PREFIX)))
+		return &tivo_partition_ram_ops;
+
+#if HAVE_LIBZ
+	if (tivo_partition_cimage_probe (device, &hdr) == 0)
+		return &tivo_partition_cimage_ops;
+#endif
+
+	return &tivo_partition_fd_ops;
+}
+
+/************************************************************************/
+/* Open a device for a partition table through its backend, keeping the */
+/* descriptor in fd.  A backend without descriptors leaves it at -1. */
+static int
+tivo_partition_table_open (struct tivo_partition_table *table, const char *device, int flags, int *fd)
+{
+	tpFILE dev;
+
+	bzero (&dev, sizeof (dev));
+	dev.fd = -1;
+	dev.ops = table->ops;
+
+	if (dev.ops->open (&dev, device, flags) < 0)
+		return -1;
+
+	*fd = dev.fd;
+	table->priv = dev.priv;
+
+	return 0;
+}
+
+/***************************************************************************/
+/* Set up a tpFILE on the stack for reading or writing a partition table's */
+/* device directly, through the given descriptor and part. */
+static void
+tivo_partition_table_file (struct tivo_partition_table *table, tpFILE *file, int fd, struct tivo_partition *part)
+{
+	bzero (file, sizeof (*file));
+	file->tptype = table->vol_flags & VOL_FILE? pDIRECTFILE: pDIRECT;
+	file->ops = table->ops;
+	file->fd = fd;
+	file->priv = table->priv;
+	file->dio_fd = -1;
+	file->map_state = -1;
+	file->sparse_state = -1;
+	file->extra.direct.pt = table;
+	file->extra.direct.part = part;
+}
+
+/****************************************************************************/
+/* Decide if a partition should get an O_DIRECT descriptor for bulk reads */
+/* and writes.  Either the caller asks for it in the open flags, or the env */
+/* MFS_DIRECT_IO is set.  The flag is always removed from the flags, since */
+/* the main descriptor is used for metadata and should stay buffered. */
+static int
+tivo_partition_want_dio (int *flags)
+{
+#ifdef O_DIRECT
+	char *env = getenv ("MFS_DIRECT_IO");
+	int want = (*flags & O_DIRECT) || (env && *env && *env != '0');
+
+	*flags &= ~O_DIRECT;
+	return want;
+#else
+	return 0;
+#endif
+}
+
+/**************************************************************************/
+/* Open the second descriptor with O_DIRECT.  This is only a hint, if the */
+/* device or filesystem refuses it the file just keeps using the page */
+/* cache. */
+static void
+tivo_partition_open_dio (tpFILE *file, const char *device, int flags)
+{
+	file->dio_fd = -1;
+	file->dio_align = TIVO_PARTITION_DIO_ALIGN;
+
+#ifdef O_DIRECT
+	file->dio_fd = lfopen (device, flags | O_DIRECT);
+
+#ifdef BLKSSZGET
+/* Block devices only need transfers aligned to their logical sector size. */
+/* Files are left at the conservative default, which covers any filesystem */
+/* block size in practice. */
+	if (file->dio_fd >= 0)
+	{
+		struct stat st;
+		int ssz;
+
+		if (fstat (file->dio_fd, &st) == 0 && S_ISBLK (st.st_mode) && ioctl (file->dio_fd, BLKSSZGET, &ssz) == 0 && ssz >= 512 && ssz <= TIVO_PARTITION_DIO_ALIGN)
+		{
+			file->dio_align = ssz;
+		}
+	}
+#endif
+#endif
+}
+
 /**************************************************/
 /* Read the TiVo partition table off of a device. */
 struct tivo_partition_table *
@@ -141,6 +347,7 @@ tivo_read_partition_table (const char *device, int flags)
 	if (!table)
 	{
 		int *fd;
+		tpFILE dev;
 		unsigned char buf[512];
 		int cursec;
 		int maxsec = 1;
@@ -157,35 +364,38 @@ tivo_read_partition_table (const char *device, int flags)
 
 		table->ro_fd = -1;
 		table->rw_fd = -1;
+		table->ops = tivo_partition_backend (device);
 
 /* Figure out if we are supposed to open it RO or RW, and use the right fd */
 /* variable. */
 		fd = (flags & O_ACCMODE) == O_RDONLY ? &table->ro_fd : &table->rw_fd;
-		*fd = lfopen (device, flags);
-		if (*fd < 0)
+		if (tivo_partition_table_open (table, device, flags, fd) < 0)
 		{
 			free (table);
 			return 0;
 		}
 
+		tivo_partition_table_file (table, &dev, *fd, NULL);
+
 /* Get the size and if it is a file or device. */
-		switch (file_or_dev_size (*fd, &table->devsize))
+		switch (table->ops->size (&dev, &table->devsize))
 		{
 		case 0:
 			table->vol_flags |= VOL_FILE;
 		case 1:
 			break;
 		default:
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
 
+		table->align = tivo_partition_dev_align (*fd);
+
 /* Read the boot block. */
-		lseek (*fd, 0, SEEK_SET);
-		if (read (*fd, buf, 512) != 512)
+		if (table->ops->read (&dev, buf, 0, 1) != 512)
 		{
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
@@ -202,7 +412,7 @@ tivo_read_partition_table (const char *device, int flags)
 			break;
 		default:
 /* Wrong magic.  Bail. */
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
@@ -213,10 +423,9 @@ tivo_read_partition_table (const char *device, int flags)
 		for (cursec = 1; cursec <= maxsec && partitions < 256; cursec++)
 		{
 			struct mac_partition *part;
-			lseek (*fd, 512 * cursec, SEEK_SET);
-			if (read (*fd, buf, 512) != 512)
+			if (table->ops->read (&dev, buf, cursec, 1) != 512)
 			{
-				close (*fd);
+				table->ops->close (&dev);
 				free (table);
 				return 0;
 			}
@@ -250,7 +459,7 @@ tivo_read_partition_table (const char *device, int flags)
 /* No partitions.  None.  Nada. */
 		if (partitions == 0)
 		{
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
@@ -258,7 +467,7 @@ tivo_read_partition_table (const char *device, int flags)
 /* If it doesn't make sense, it doesn't make sense. */
 		if (partitions > parts[0].sectors)
 		{
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
@@ -267,7 +476,7 @@ tivo_read_partition_table (const char *device, int flags)
 		table->partitions = calloc (parts[0].sectors, sizeof (struct tivo_partition));
 		if (!table->partitions)
 		{
-			close (*fd);
+			table->ops->close (&dev);
 			free (table);
 			return 0;
 		}
@@ -286,14 +495,14 @@ tivo_read_partition_table (const char *device, int flags)
 		{
 			if (table->ro_fd < 0)
 			{
-				table->ro_fd = lfopen (device, flags);
+				tivo_partition_table_open (table, device, flags, &table->ro_fd);
 			}
 		}
 		else
 		{
 			if (table->rw_fd < 0)
 			{
-				table->rw_fd = lfopen (device, flags);
+				tivo_partition_table_open (table, device, flags, &table->rw_fd);
 			}
 		}
 	}
@@ -563,9 +772,11 @@ tivo_partition_largest_free (const char *device)
 		{
 			first = table->partitions[nextpart].start;
 			last = first + table->partitions[nextpart].sectors;
-			if (last - first > largest)
-				largest = last - first;
 		}
+
+/* Only the space from the first aligned sector on is usable. */
+		if (last > tivo_partition_align_up (table, first) && last - tivo_partition_align_up (table, first) > largest)
+			largest = last - tivo_partition_align_up (table, first);
 	}
 
 	return largest;
@@ -607,13 +818,15 @@ tivo_partition_rename (const char *device, int partition, const char *name)
 
 /* Add a partition to the specified device.  Make the partition size */
 /* sectors, add it before a specific partition (Or 0 for at the end) */
-/* and assign it's name and type. */
+/* and assign it's name and type.  The partition starts on the alignment */
+/* of the device, leaving any space before that free. */
 int
 tivo_partition_add (const char *device, uint64_t size, int before, const char *name, const char *type)
 {
 	struct tivo_partition_table *table;
 	uint64_t first = 0;
 	uint64_t last = 0;
+	uint64_t gap;
 	int startpart = 0;
 	int loop;
 
@@ -654,8 +867,9 @@ tivo_partition_add (const char *device, uint64_t size, int before, const char *n
 		return -1;
 	}
 
-/* Loop until the current sector range is large enough. */
-	while (last - first < size)
+/* Loop until the current sector range is large enough, counting from */
+/* the first aligned sector in it. */
+	while (last < tivo_partition_align_up (table, first) + size)
 	{
 		int nextpart = 0;
 
@@ -690,11 +904,52 @@ tivo_partition_add (const char *device, uint64_t size, int before, const char *n
 		}
 	}
 
+	gap = first;
+	first = tivo_partition_align_up (table, first);
+
 	if (last - first > size)
 	{
 		last = first + size;
 	}
 
+/* A free partition running from before the aligned start into the used */
+/* range keeps just the part before it.  Whatever it had past the used */
+/* range becomes a free partition of its own. */
+	for (loop = startpart; gap < first && loop < table->count; loop++)
+	{
+		struct tivo_partition *part = &table->partitions[loop];
+
+		if (part->start >= gap && part->start < first && part->start + part->sectors > first)
+		{
+			if (part->start + part->sectors > last)
+			{
+				struct tivo_partition *rest;
+
+				if (table->count + 2 >= table->allocated)
+				{
+					return -1;
+				}
+
+				rest = &table->partitions[table->count];
+				rest->start = last;
+				rest->sectors = part->start + part->sectors - last;
+				rest->refs = 1;
+				rest->name = strdup ("Extra");
+				rest->type = strdup ("Apple_Free");
+				rest->table = table;
+				table->count++;
+
+				if (!rest->name || !rest->type)
+				{
+					table->vol_flags &= ~VOL_VALID;
+					return -1;
+				}
+			}
+
+			part->sectors = first - part->start;
+		}
+	}
+
 /* Delete all partitions that fall within the now used range. */
 	for (loop = startpart; loop < table->count; loop++)
 	{
@@ -746,6 +1001,81 @@ tivo_partition_add (const char *device, uint64_t size, int before, const char *n
 	return before + 1;
 }
 
+/***************************************************************************/
+/* Return the alignment, in sectors, that new partitions on a device start */
+/* on. */
+unsigned int
+tivo_partition_alignment (const char *device)
+{
+	struct tivo_partition_table *table;
+
+	table = tivo_read_partition_table (device, O_RDONLY);
+	if (!table || table->align < 1)
+		return 1;
+
+	return table->align;
+}
+
+/**********************************************************************/
+/* Round a partition size up so the partition after it stays aligned. */
+uint64_t
+tivo_partition_align_size (const char *device, uint64_t size)
+{
+	unsigned int align = tivo_partition_alignment (device);
+
+	return (size + align - 1) / align * align;
+}
+
+/****************************************************************************/
+/* Count the partitions on a device that don't start and end on its */
+/* alignment.  On a drive with larger physical sectors, writes at the edges */
+/* of each of these become read-modify-write cycles inside the drive.  The */
+/* partition map and free space are not counted.  If total is not NULL, it */
+/* is set to the number of partitions checked.  Returns -1 on error. */
+int
+tivo_partition_misaligned (const char *device, int *total)
+{
+	struct tivo_partition_table *table;
+	int checked = 0;
+	int misaligned = 0;
+	int loop;
+
+	table = tivo_read_partition_table (device, O_RDONLY);
+	if (!table)
+		return -1;
+
+	for (loop = 0; loop < table->count; loop++)
+	{
+		struct tivo_partition *part = &table->partitions[loop];
+
+		if (!strcmp (part->type, "Apple_Free") || !strcmp (part->type, "Apple_partition_map"))
+			continue;
+
+		checked++;
+		if (table->align > 1 && (part->start % table->align || part->sectors % table->align))
+			misaligned++;
+	}
+
+	if (total)
+		*total = checked;
+
+	return misaligned;
+}
+
+/***********************************************************/
+/* Report how well the partitions on a device are aligned. */
+void
+tivo_partition_print_alignment (const char *device)
+{
+	int total;
+	int misaligned = tivo_partition_misaligned (device, &total);
+
+	if (misaligned < 0)
+		return;
+
+	fprintf (stderr, "%s: %d of %d partitions not aligned to %d byte boundaries\n", device, misaligned, total, tivo_partition_alignment (device) * 512);
+}
+
 
 /***********************************************/
 /* Initialize the partition table for a drive. */
@@ -753,6 +1083,7 @@ int
 tivo_partition_table_init (const char *device, int swab)
 {
 	struct tivo_partition_table *table;
+	tpFILE dev;
 
 	if (tivo_partition_rrpart (device) != 0)
 	{
@@ -766,32 +1097,38 @@ tivo_partition_table_init (const char *device, int swab)
 		return -1;
 	}
 
-	table->rw_fd = lfopen (device, O_RDWR);
-	if (table->rw_fd < 0)
+	table->ro_fd = -1;
+	table->rw_fd = -1;
+	table->ops = tivo_partition_backend (device);
+	if (tivo_partition_table_open (table, device, O_RDWR, &table->rw_fd) < 0)
 	{
 		free (table);
 		return -1;
 	}
 
-	switch (file_or_dev_size (table->rw_fd, &table->devsize))
+	tivo_partition_table_file (table, &dev, table->rw_fd, NULL);
+
+	switch (table->ops->size (&dev, &table->devsize))
 	{
 	case 0:
 		table->vol_flags |= VOL_FILE;
 	case 1:
 		break;
 	default:
-		close (table->rw_fd);
+		table->ops->close (&dev);
 		free (table);
 		return -1;
 	}
 
+	table->align = tivo_partition_dev_align (table->rw_fd);
+
 	if (swab)
 		table->vol_flags |= VOL_SWAB;
 
 	table->partitions = calloc (63, sizeof (struct tivo_partition));
 	if (!table->partitions)
 	{
-		close (table->rw_fd);
+		table->ops->close (&dev);
 		free (table);
 		return -1;
 	}
@@ -829,9 +1166,7 @@ tivo_partition_table_write (const char *device)
 		return 0;
 	}
 
-	file.tptype = table->vol_flags & VOL_FILE? pDIRECTFILE: pDIRECT;
-	file.fd = table->rw_fd;
-	file.extra.direct.pt = table;
+	tivo_partition_table_file (table, &file, table->rw_fd, NULL);
 	bzero (buf, sizeof (buf));
 
 	if (table->vol_flags & VOL_NONINIT)
@@ -889,7 +1224,9 @@ tpFILE *
 tivo_partition_open (char *path, int flags)
 {
 	char devpath[MAXPATHLEN];
+	char *origpath = path;
 	int partnum;
+	int dio = tivo_partition_want_dio (&flags);
 	tpFILE newfile;
 	tpFILE *file = &newfile;
 
@@ -900,11 +1237,11 @@ tivo_partition_open (char *path, int flags)
 /* If the preferred access mode is kernel, or if it is auto, try to open it. */
 	if (tivo_partition_accmode == accAUTO || tivo_partition_accmode == accKERNEL)
 	{
-		newfile.fd = lfopen (path, flags);
-		if (newfile.fd >= 0)
+		newfile.ops = tivo_partition_backend (path);
+		if (newfile.ops->open (&newfile, path, flags) == 0)
 		{
 /* The file exists, time to see what it is. */
-			switch (file_or_dev_size (newfile.fd, &newfile.extra.kernel.sectors))
+			switch (newfile.ops->size (&newfile, &newfile.extra.kernel.sectors))
 			{
 			case 0:
 				newfile.tptype = pFILE;
@@ -914,15 +1251,14 @@ tivo_partition_open (char *path, int flags)
 				break;
 			default:
 				errno = ENOTBLK;
-				close (newfile.fd);
-				newfile.fd = -1;
+				newfile.extra.kernel.sectors = 0;
 			}
 
 			if (newfile.extra.kernel.sectors == 0)
 			{
 /* If it is too small, throw it back.  If the mode is accAUTO this will cause */
 /* it to try opening the entire device, instead. */
-				close (newfile.fd);
+				newfile.ops->close (&newfile);
 				bzero (file, sizeof (newfile));
 				newfile.fd = -1;
 			}
@@ -1001,13 +1337,17 @@ tivo_partition_open (char *path, int flags)
 /* opened, or the default access mode is invalid. */
 	if (newfile.tptype == pUNKNOWN)
 	{
-		if (newfile.fd >= 0)
-		{
-			close (newfile.fd);
-		}
 		return 0;
 	}
 
+	newfile.dio_fd = -1;
+	if (dio && _tivo_partition_fd (&newfile) >= 0)
+	{
+		const char *dev = tivo_partition_device_name (&newfile);
+
+		tivo_partition_open_dio (&newfile, dev? dev: origpath, flags);
+	}
+
 /* Allocate the actual file structure now that it is certain it will be used. */
 	file = malloc (sizeof (*file));
 	if (file)
@@ -1016,7 +1356,10 @@ tivo_partition_open (char *path, int flags)
 	}
 	else
 	{
-		close (newfile.fd);
+		if (newfile.tptype == pFILE || newfile.tptype == pDEVICE)
+			newfile.ops->close (&newfile);
+		if (newfile.dio_fd >= 0)
+			close (newfile.dio_fd);
 		errno = ENOMEM;
 	}
 
@@ -1053,6 +1396,8 @@ tivo_partition_open_direct_int (tpFILE *file, char *path, int partnum, int flags
 		{
 			file->fd = table->rw_fd;
 		}
+		file->ops = table->ops;
+		file->priv = table->priv;
 
 		if (table->vol_flags & VOL_FILE)
 		{
@@ -1082,17 +1427,28 @@ tivo_partition_open_direct (char *path, int partnum, int flags)
 {
 	tpFILE newfile;
 	tpFILE *file = NULL;
+	int dio = tivo_partition_want_dio (&flags);
 
 	bzero (&newfile, sizeof (newfile));
 
 	if (tivo_partition_open_direct_int (&newfile, path, partnum, flags))
 	{
+		newfile.dio_fd = -1;
+		if (dio && _tivo_partition_fd (&newfile) >= 0)
+		{
+			tivo_partition_open_dio (&newfile, path, flags);
+		}
+
 		file = malloc (sizeof (newfile));
 
 		if (file)
 		{
 			memcpy (file, &newfile, sizeof (newfile));
 		}
+		else if (newfile.dio_fd >= 0)
+		{
+			close (newfile.dio_fd);
+		}
 	} 
 
 	return file;
@@ -1187,16 +1543,26 @@ tivo_partition_close (tpFILE * file)
 {
 /* Only close the file if it is owned by this tpFILE pointer.  If it is a */
 /* shared file leave it for the unwritten cleanup code. */
-	if (file->fd >= 0 && file->tptype != pDIRECT && file->tptype != pDIRECTFILE)
+	if (file->tptype != pDIRECT && file->tptype != pDIRECTFILE)
 	{
-		close (file->fd);
-		file->fd = -1;
+		file->ops->close (file);
 	}
 	else
 	{
 		file->extra.direct.pt->refs--;
 		file->extra.direct.part->refs--;
 	}
+	if (file->dio_fd >= 0)
+	{
+		close (file->dio_fd);
+		file->dio_fd = -1;
+	}
+#ifdef HAVE_SYS_MMAN_H
+	if (file->map_state > 0)
+	{
+		munmap (file->map - file->map_skip, file->map_len);
+	}
+#endif
 	free (file);
 }
 
@@ -1303,6 +1669,70 @@ tivo_partition_device_name (tpFILE * file)
 	}
 }
 
+/****************************************************************************/
+/* Return a read-only pointer to the first sector of the partition, mapping */
+/* it on first use.  Only image files are mapped, and never byte-swapped */
+/* ones, since the data in the mapping is as it sits on disk.  Returns NULL */
+/* if the partition can't be mapped, in which case it still has to be read */
+/* the normal way. */
+void *
+tivo_partition_map (tpFILE * file)
+{
+#ifdef HAVE_SYS_MMAN_H
+	uint64_t offset;
+	uint64_t len;
+	uint64_t filesize;
+	long pagesize;
+	void *map;
+
+	if (file->map_state)
+	{
+		return file->map_state > 0? file->map: NULL;
+	}
+
+	file->map_state = -1;
+
+	if (file->tptype != pFILE && file->tptype != pDIRECTFILE)
+		return NULL;
+	if (_tivo_partition_fd (file) < 0)
+		return NULL;
+	if (_tivo_partition_swab (file))
+		return NULL;
+
+/* The mapping has to start on a page boundry, so map from the start of the */
+/* page holding the first sector and remember how far in the partition is. */
+	pagesize = sysconf (_SC_PAGESIZE);
+	if (pagesize <= 0)
+		pagesize = 4096;
+
+	offset = tivo_partition_offset (file) * 512;
+	file->map_skip = offset % pagesize;
+	offset -= file->map_skip;
+	len = tivo_partition_size (file) * 512 + file->map_skip;
+
+/* Give up if it won't fit in the address space or the offset type. */
+	if (len == 0 || (size_t) len != len || (off_t) offset != offset)
+		return NULL;
+
+/* Touching a mapping past the end of the file is a SIGBUS, so a truncated */
+/* image has to be read the normal way. */
+	if (file_or_dev_size (_tivo_partition_fd (file), &filesize) != 0 || filesize * 512 < offset + len)
+		return NULL;
+
+	map = mmap (NULL, (size_t) len, PROT_READ, MAP_SHARED, _tivo_partition_fd (file), (off_t) offset);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	file->map = (unsigned char *) map + file->map_skip;
+	file->map_len = len;
+	file->map_state = 1;
+
+	return file->map;
+#else
+	return NULL;
+#endif
+}
+
 /*****************************/
 /* Read the first 512 bytes. */
 int
@@ -1322,10 +1752,7 @@ tivo_partition_read_bootsector (const char *device, void *buf)
 	part.sectors = 1;
 	part.start = 0;
 	part.table = table;
-	file.tptype = table->vol_flags & VOL_FILE? pDIRECTFILE: pDIRECT;
-	file.fd = table->ro_fd;
-	file.extra.direct.pt = table;
-	file.extra.direct.part = &part;
+	tivo_partition_table_file (table, &file, table->ro_fd, &part);
 
 	return (tivo_partition_read (&file, buf, 0, 1));
 }
@@ -1349,10 +1776,7 @@ tivo_partition_write_bootsector (const char *device, void *buf)
 	part.sectors = 1;
 	part.start = 0;
 	part.table = table;
-	file.tptype = table->vol_flags & VOL_FILE? pDIRECTFILE: pDIRECT;
-	file.fd = table->rw_fd;
-	file.extra.direct.pt = table;
-	file.extra.direct.part = &part;
+	tivo_partition_table_file (table, &file, table->rw_fd, &part);
 
 	return (tivo_partition_write (&file, buf, 0, 1));
 }
@@ -65,6 +65,7 @@ mfs_load_volume_header (struct mfs_handle *mfshnd, int flags)
 {
 	unsigned char buf[512];
 	unsigned char *volume_names;
+	struct volume_info *vol;
 	unsigned int total_sectors = 0;
 
 /* Read in the volume header. */
@@ -128,8 +129,8 @@ mfs_load_volume_header (struct mfs_handle *mfshnd, int flags)
 	mfshnd->bootsecs = 1;
 
 
-/* Skip the first volume since it's already loaded. */
-	if (*volume_names)
+/* Skip the volumes already loaded.  Normally that is just the first. */
+	for (vol = mfshnd->vols->volumes; vol && *volume_names; vol = vol->next)
 	{
 		volume_names += strcspn (volume_names, " \t\r\n");
 		volume_names += strspn (volume_names, " \t\r\n");
@@ -262,6 +263,26 @@ mfs_init (char *hda, char *hdb, int flags)
 	return mfshnd;
 }
 
+/****************************************************************************/
+/* Initialize MFS on a volume set that is already open, such as one holding */
+/* writes in memory that are not on disk yet.  The handle takes over vols. */
+/* The caller is responsible for checking for error cases. */
+struct mfs_handle *
+mfs_init_volumes (struct volume_handle *vols, int flags)
+{
+	struct mfs_handle *mfshnd = malloc (sizeof (*mfshnd));
+	if (!mfshnd)
+		return 0;
+
+	bzero (mfshnd, sizeof (*mfshnd));
+	mfshnd->vols = vols;
+
+	if (mfs_load_volume_header (mfshnd, flags) > 0)
+		mfs_load_zone_maps (mfshnd);
+
+	return mfshnd;
+}
+
 /*************************/
 /* Display the MFS error */
 void
@@ -328,10 +349,12 @@ mfs_clearerror (struct mfs_handle *mfshnd)
 
 /************************************************/
 /* Free all used memory and close opened files. */
+/* Closing the volumes flushes any writes still buffered. */
 void
 mfs_cleanup (struct mfs_handle *mfshnd)
 {
 	mfs_cleanup_zone_maps (mfshnd);
+	mfs_inode_arena_free (mfshnd);
 	if (mfshnd->vols)
 		mfsvol_cleanup (mfshnd->vols);
 	if (mfshnd->current_log)
@@ -347,11 +370,33 @@ mfs_reinit (struct mfs_handle *mfshnd, int flags)
 {
 	int ret = 0;
 	struct volume_handle *vols = mfshnd->vols;
+	struct mfs_inode_slab *inode_slabs = mfshnd->inode_slabs;
+	union mfs_inode_slot *inode_free = mfshnd->inode_free;
+	int memwrite = vols->write_mode & vwLocal;
+
+/* Anything still buffered has to be on disk before it is read back in. */
+	mfsvol_flush (vols);
+
+/* Writes held in memory can't be read back from disk.  They are lost, but */
+/* at least they don't end up in the overlay file on their own, and nothing */
+/* is written to disk after. */
+	if (memwrite)
+		mfsvol_discard_memwrite (vols);
 
 	mfs_cleanup_zone_maps (mfshnd);
 
 	mfs_init_internal (mfshnd, vols->hda, vols->hdb, flags);
 
+	if (memwrite && mfshnd->vols)
+		mfsvol_enable_memwrite (mfshnd->vols);
+
+/* Borrowed inodes outlive the reinit. */
+	mfshnd->inode_slabs = inode_slabs;
+	mfshnd->inode_free = inode_free;
+
+	if (mfshnd->vols)
+		mfshnd->vols->writeback_limit = vols->writeback_limit;
+
 	mfsvol_cleanup (vols);
 
 	return 0;
@@ -0,0 +1,400 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#ifdef HAVE_ERRNO_H
+#include <errno.h>
+#endif
+
+#include "macpart.h"
+
+/* Drives held in memory.  These stand in for a real drive anywhere a */
+/* device name is taken, so whole volume sets can be built and worked on */
+/* without touching a disk, such as to time the CPU side of a restore. */
+struct tivo_partition_ram
+{
+	char *device;
+	unsigned char *data;
+	uint64_t sectors;
+	struct tivo_partition_ram *next;
+};
+
+static struct tivo_partition_ram *ram_devices = NULL;
+
+/* Sectors copied at a time when loading a drive from an image. */
+#define TIVO_PARTITION_RAM_CHUNK 2048
+
+/***************************************/
+/* Find a drive in memory by its name. */
+static struct tivo_partition_ram *
+tivo_partition_ram_find (const char *device)
+{
+	struct tivo_partition_ram *ram;
+
+	for (ram = ram_devices; ram; ram = ram->next)
+	{
+		if (!strcmp (ram->device, device))
+			break;
+	}
+
+	return ram;
+}
+
+/**************************************************************************/
+/* Create a zeroed drive in memory.  The name must start with "ram:", and */
+/* partitions on it are named by appending the partition number, the same */
+/* as with /dev/hda.  Memory is only used as sectors are written to. */
+int
+tivo_partition_ram_create (const char *device, uint64_t sectors)
+{
+	struct tivo_partition_ram *ram;
+
+	if (strncmp (device, TIVO_PARTITION_RAM_PREFIX, strlen (TIVO_PARTITION_RAM_PREFIX)) || sectors == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (tivo_partition_ram_find (device))
+	{
+		errno = EEXIST;
+		return -1;
+	}
+
+	if ((size_t) (sectors * 512) / 512 != sectors)
+	{
+		errno = EFBIG;
+		return -1;
+	}
+
+	ram = calloc (sizeof (*ram), 1);
+	if (!ram)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+/* Large zeroed allocations come straight from the kernel, so pages that */
+/* are never written don't take any memory. */
+	ram->data = calloc ((size_t) sectors, 512);
+	ram->device = strdup (device);
+	if (!ram->data || !ram->device)
+	{
+		free (ram->data);
+		free (ram->device);
+		free (ram);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	ram->sectors = sectors;
+	ram->next = ram_devices;
+	ram_devices = ram;
+
+	return 0;
+}
+
+/****************************************************************************/
+/* Free a drive in memory.  Its partition table is dropped as well, so this */
+/* fails with EBUSY if any partitions on it are still open. */
+int
+tivo_partition_ram_destroy (const char *device)
+{
+	struct tivo_partition_ram **ram;
+	struct tivo_partition_ram *tofree;
+
+	for (ram = &ram_devices; *ram; ram = &(*ram)->next)
+	{
+		if (!strcmp ((*ram)->device, device))
+			break;
+	}
+
+	if (!*ram)
+	{
+		errno = ENOENT;
+		return -1;
+	}
+
+	if (tivo_partition_rrpart (device) < 0)
+		return -1;
+
+	tofree = *ram;
+	*ram = tofree->next;
+
+	free (tofree->data);
+	free (tofree->device);
+	free (tofree);
+
+	return 0;
+}
+
+/***************************************************************************/
+/* Clip a transfer to the end of the drive.  Returns the number of sectors */
+/* that can be transferred. */
+static int
+tivo_partition_ram_clip (struct tivo_partition_ram *ram, uint64_t sector, int count)
+{
+	if (sector >= ram->sectors)
+		return 0;
+
+	if (sector + count > ram->sectors)
+		return ram->sectors - sector;
+
+	return count;
+}
+
+/***************************************************************************/
+/* Copy a drive or image into a new drive in memory.  The source is read */
+/* through its own backend, so it can also be a compressed image.  Sectors */
+/* that are all zero are skipped, so they don't take any memory. */
+static int
+tivo_partition_ram_load (const char *device, const char *source)
+{
+	struct tivo_partition_ram *ram;
+	tpFILE src;
+	uint64_t sectors;
+	uint64_t sector;
+	unsigned char *buf;
+	int retval = -1;
+
+	bzero (&src, sizeof (src));
+	src.fd = -1;
+	src.dio_fd = -1;
+	src.ops = tivo_partition_backend (source);
+
+	if (src.ops->open (&src, source, O_RDONLY) < 0)
+		return -1;
+
+	buf = tivo_partition_buffer_alloc (TIVO_PARTITION_RAM_CHUNK * 512);
+
+	if (!buf || src.ops->size (&src, &sectors) < 0 || tivo_partition_ram_create (device, sectors) < 0)
+		goto out;
+
+	ram = tivo_partition_ram_find (device);
+
+	for (sector = 0; sector < sectors; sector += TIVO_PARTITION_RAM_CHUNK)
+	{
+		int count = sectors - sector < TIVO_PARTITION_RAM_CHUNK? sectors - sector: TIVO_PARTITION_RAM_CHUNK;
+		int loop;
+
+		if (src.ops->read (&src, buf, sector, count) != count * 512)
+		{
+			if (errno == 0)
+				errno = EIO;
+			tivo_partition_ram_destroy (device);
+			goto out;
+		}
+
+		for (loop = 0; loop < count; loop++)
+		{
+			uint64_t *data = (uint64_t *) (buf + loop * 512);
+			int word;
+
+			for (word = 0; word < 512 / 8 && !data[word]; word++)
+				;
+
+			if (word < 512 / 8)
+				memcpy (ram->data + (sector + loop) * 512, data, 512);
+		}
+	}
+
+	retval = 0;
+
+out:
+	if (buf)
+		tivo_partition_buffer_free (buf);
+	src.ops->close (&src);
+
+	return retval;
+}
+
+/**************************************************************************/
+/* Create a drive named in MFS_RAM_DRIVES the first time it is opened, so */
+/* any of the tools can be run against one.  The list is separated by */
+/* spaces, with each entry either name=sectors for an empty drive or */
+/* name=image to start with a copy of a drive or image, such as */
+/* "ram:A=/dev/hdc ram:B=312581808". */
+static struct tivo_partition_ram *
+tivo_partition_ram_env (const char *device)
+{
+	char *env = getenv ("MFS_RAM_DRIVES");
+	size_t devlen = strlen (device);
+
+	while (env && *env)
+	{
+		size_t len;
+
+		env += strspn (env, " \t");
+		len = strcspn (env, " \t");
+
+		if (len > devlen && env[devlen] == '=' && !strncmp (env, device, devlen))
+		{
+			char source[MAXPATHLEN];
+			char *end;
+			uint64_t sectors;
+
+			len -= devlen + 1;
+			if (len == 0 || len >= sizeof (source))
+				break;
+
+			memcpy (source, env + devlen + 1, len);
+			source[len] = 0;
+
+			sectors = strtoull (source, &end, 10);
+			if (isdigit (source[0]) && *end == 0)
+			{
+				if (tivo_partition_ram_create (device, sectors) < 0)
+					return NULL;
+			}
+			else if (tivo_partition_ram_load (device, source) < 0)
+			{
+				fprintf (stderr, "Unable to load %s into %s: %s\n", source, device, strerror (errno));
+				return NULL;
+			}
+
+			return tivo_partition_ram_find (device);
+		}
+
+		env += len;
+	}
+
+	errno = ENOENT;
+	return NULL;
+}
+
+/*************************************************************************/
+/* Backend for drives in memory.  Opening a partition on one, such as */
+/* ram:A10, fails here, which sends tivo_partition_open to the partition */
+/* table on ram:A for it. */
+static int
+tivo_partition_ram_open (tpFILE * file, const char *device, int flags)
+{
+	struct tivo_partition_ram *ram = tivo_partition_ram_find (device);
+
+	if (!ram)
+		ram = tivo_partition_ram_env (device);
+
+	if (!ram)
+		return -1;
+
+	file->fd = -1;
+	file->priv = ram;
+
+	return 0;
+}
+
+/******************************************************************/
+/* Drives in memory act like image files, there is no hardware to */
+/* byte-swap them or issue raw sector commands to. */
+static int
+tivo_partition_ram_size (tpFILE * file, uint64_t *sectors)
+{
+	struct tivo_partition_ram *ram = file->priv;
+
+	*sectors = ram->sectors;
+
+	return 0;
+}
+
+static int
+tivo_partition_ram_read (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_partition_ram *ram = file->priv;
+
+	count = tivo_partition_ram_clip (ram, sector, count);
+	memcpy (buf, ram->data + sector * 512, count * 512);
+
+	return count * 512;
+}
+
+static int
+tivo_partition_ram_write (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	struct tivo_partition_ram *ram = file->priv;
+	int towrite = tivo_partition_ram_clip (ram, sector, count);
+
+	if (towrite == 0 && count > 0)
+	{
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memcpy (ram->data + sector * 512, buf, towrite * 512);
+
+	return towrite * 512;
+}
+
+/*****************************************************************************/
+/* Vectored transfers are just a copy per buffer.  The buffers are all whole */
+/* sectors, as with tivo_partition_readv. */
+static int
+tivo_partition_ram_readv (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int count = iov[loop].iov_len / 512;
+		int retval = tivo_partition_ram_read (file, iov[loop].iov_base, sector, count);
+
+		total += retval;
+		if (retval < count * 512)
+			break;
+
+		sector += count;
+	}
+
+	return total;
+}
+
+static int
+tivo_partition_ram_writev (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int count = iov[loop].iov_len / 512;
+		int retval = tivo_partition_ram_write (file, iov[loop].iov_base, sector, count);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < count * 512)
+			break;
+
+		sector += count;
+	}
+
+	return total;
+}
+
+/**********************************************************************/
+/* The drive lives until tivo_partition_ram_destroy, not until close. */
+static void
+tivo_partition_ram_close (tpFILE * file)
+{
+	file->priv = NULL;
+}
+
+const struct tivo_partition_ops tivo_partition_ram_ops =
+{
+	tivo_partition_ram_open,
+	tivo_partition_ram_size,
+	tivo_partition_ram_read,
+	tivo_partition_ram_write,
+	tivo_partition_ram_readv,
+	tivo_partition_ram_writev,
+	tivo_partition_ram_close
+};
@@ -3,6 +3,10 @@
 #endif
 
 #define _LARGEFILE64_SOURCE
+/* For fallocate */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -13,6 +17,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -23,6 +28,18 @@
 #ifdef HAVE_LINUX_UNISTD_H
 #include <linux/unistd.h>
 #endif
+/* SIMD byte-swapping needs a compiler that can build the kernels with the */
+/* target attribute, so the rest of the file does not require SSE. */
+#if !TARGET_OS_MAC && (defined (__i386__) || defined (__x86_64__)) && defined (HAVE_IMMINTRIN_H) && \
+	(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# include <immintrin.h>
+# define USE_SIMD_SWAB
+#endif
+#if defined (HAVE_LINUX_IO_URING_H) && defined (HAVE_SYS_MMAN_H) && defined (__NR_io_uring_setup)
+# include <linux/io_uring.h>
+# include <sys/mman.h>
+# define USE_IO_URING
+#endif
 
 /* #include "mfs.h" */
 #include "macpart.h"
@@ -49,10 +66,14 @@ static _syscall5 (int, _llseek, uint, fd, ulong, hi, ulong, lo, loff_t *, res, u
 #endif
 #endif
 
+/* Maximum number of ranges tivo_partition_readv and tivo_partition_writev */
+/* hand to the kernel in one system call. */
+#define TIVO_PARTITION_MAXIOV 64
+
 /*********************************************/
 /* Preform byte-swapping in a block of data. */
-void
-data_swab (void *data, int size)
+static void
+data_swab_scalar (void *data, int size)
 {
 	unsigned int *idata = data;
 
@@ -82,15 +103,272 @@ data_swab (void *data, int size)
 	}
 }
 
-/*****************************************************************************/
-/* Read data from the MFS volume set.  It must be in whole sectors, and must */
-/* not cross a volume boundry. */
+#ifdef USE_SIMD_SWAB
+/*************************************************************************/
+/* SSE2 byte-swapping, 16 bytes at a time with shifts.  Anything left at */
+/* the end goes through the scalar code. */
+__attribute__ ((target ("sse2"))) static void
+data_swab_sse2 (void *data, int size)
+{
+	unsigned char *cdata = data;
+
+	while (size >= 16)
+	{
+		__m128i val = _mm_loadu_si128 ((__m128i *) cdata);
+
+		val = _mm_or_si128 (_mm_slli_epi16 (val, 8), _mm_srli_epi16 (val, 8));
+		_mm_storeu_si128 ((__m128i *) cdata, val);
+		size -= 16;
+		cdata += 16;
+	}
+
+	data_swab_scalar (cdata, size);
+}
+
+/*************************************************************/
+/* SSSE3 byte-swapping, using pshufb to swap each byte pair. */
+__attribute__ ((target ("ssse3"))) static void
+data_swab_ssse3 (void *data, int size)
+{
+	unsigned char *cdata = data;
+	__m128i mask = _mm_set_epi8 (14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+/* Two at a time, so the loads and stores can overlap. */
+	while (size >= 32)
+	{
+		__m128i val1 = _mm_loadu_si128 ((__m128i *) cdata);
+		__m128i val2 = _mm_loadu_si128 ((__m128i *) (cdata + 16));
+
+		_mm_storeu_si128 ((__m128i *) cdata, _mm_shuffle_epi8 (val1, mask));
+		_mm_storeu_si128 ((__m128i *) (cdata + 16), _mm_shuffle_epi8 (val2, mask));
+		size -= 32;
+		cdata += 32;
+	}
+
+	data_swab_scalar (cdata, size);
+}
+
+/******************************************************************/
+/* AVX2 byte-swapping.  A sector is 16 of these 32 byte shuffles. */
+__attribute__ ((target ("avx2"))) static void
+data_swab_avx2 (void *data, int size)
+{
+	unsigned char *cdata = data;
+	__m256i mask = _mm256_set_epi8 (14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1,
+		14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1);
+
+	while (size >= 64)
+	{
+		__m256i val1 = _mm256_loadu_si256 ((__m256i *) cdata);
+		__m256i val2 = _mm256_loadu_si256 ((__m256i *) (cdata + 32));
+
+		_mm256_storeu_si256 ((__m256i *) cdata, _mm256_shuffle_epi8 (val1, mask));
+		_mm256_storeu_si256 ((__m256i *) (cdata + 32), _mm256_shuffle_epi8 (val2, mask));
+		size -= 64;
+		cdata += 64;
+	}
+
+	data_swab_scalar (cdata, size);
+}
+#endif
+
+/* The byte-swapping routine in use, picked the first time it is needed. */
+static void (*data_swab_kernel) (void *data, int size) = NULL;
+
+/****************************************************************************/
+/* Pick the fastest byte-swapping routine the CPU supports.  The CPU checks */
+/* include whether the OS saves the AVX registers. */
+static void
+data_swab_select (void)
+{
+	data_swab_kernel = data_swab_scalar;
+
+#ifdef USE_SIMD_SWAB
+	__builtin_cpu_init ();
+
+	if (__builtin_cpu_supports ("avx2"))
+		data_swab_kernel = data_swab_avx2;
+	else if (__builtin_cpu_supports ("ssse3"))
+		data_swab_kernel = data_swab_ssse3;
+	else if (__builtin_cpu_supports ("sse2"))
+		data_swab_kernel = data_swab_sse2;
+#endif
+}
+
+/*********************************************/
+/* Preform byte-swapping in a block of data. */
+void
+data_swab (void *data, int size)
+{
+	if (!data_swab_kernel)
+		data_swab_select ();
+
+	data_swab_kernel (data, size);
+}
+
+/***************************************************************************/
+/* Read from a file or device at an absolute sector, without going through */
+/* the file position.  This keeps it to a single system call, and lets the */
+/* same file be used from more than one place at a time. */
 int
-tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
+tivo_partition_pread (int fd, void *buf, uint64_t sector, int count)
 {
+#if HAVE_PREAD64
+	return pread64 (fd, buf, count * 512, (off64_t)sector << 9);
+#else
 #ifdef USE__LLSEEK
 	loff_t result;
+
+	if (_llseek (fd, sector >> 23, sector << 9, &result, SEEK_SET) < 0)
+#elif HAVE_LSEEK64
+	if (lseek64 (fd, (off64_t)sector << 9, SEEK_SET) != (off64_t)sector << 9)
+#else
+	if (lseek (fd, (off_t)sector << 9, SEEK_SET) != (off_t)sector << 9)
+#endif
+	{
+		return -1;
+	}
+
+	return read (fd, buf, count * 512);
 #endif
+}
+
+/****************************************************/
+/* Write to a file or device at an absolute sector. */
+int
+tivo_partition_pwrite (int fd, void *buf, uint64_t sector, int count)
+{
+#if HAVE_PWRITE64
+	return pwrite64 (fd, buf, count * 512, (off64_t)sector << 9);
+#else
+#ifdef USE__LLSEEK
+	loff_t result;
+
+	if (_llseek (fd, sector >> 23, sector << 9, &result, SEEK_SET) < 0)
+#elif HAVE_LSEEK64
+	if (lseek64 (fd, (off64_t)sector << 9, SEEK_SET) != (off64_t)sector << 9)
+#else
+	if (lseek (fd, (off_t)sector << 9, SEEK_SET) != (off_t)sector << 9)
+#endif
+	{
+		return -1;
+	}
+
+	return write (fd, buf, count * 512);
+#endif
+}
+
+/**************************************************************************/
+/* Scatter read a run of sectors starting at an absolute sector.  Without */
+/* preadv, just do it one buffer at a time. */
+static int
+tivo_partition_preadv (int fd, struct iovec *iov, int niov, uint64_t sector)
+{
+#if HAVE_PREADV64
+	return preadv64 (fd, iov, niov, (off64_t)sector << 9);
+#else
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int retval = tivo_partition_pread (fd, iov[loop].iov_base, sector, iov[loop].iov_len / 512);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < iov[loop].iov_len)
+			break;
+
+		sector += iov[loop].iov_len / 512;
+	}
+
+	return total;
+#endif
+}
+
+/*****************************************************************/
+/* Gather write a run of sectors starting at an absolute sector. */
+static int
+tivo_partition_pwritev (int fd, struct iovec *iov, int niov, uint64_t sector)
+{
+#if HAVE_PWRITEV64
+	return pwritev64 (fd, iov, niov, (off64_t)sector << 9);
+#else
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < niov; loop++)
+	{
+		int retval = tivo_partition_pwrite (fd, iov[loop].iov_base, sector, iov[loop].iov_len / 512);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < iov[loop].iov_len)
+			break;
+
+		sector += iov[loop].iov_len / 512;
+	}
+
+	return total;
+#endif
+}
+
+/************************************************************************/
+/* Pick the descriptor for a transfer.  The O_DIRECT descriptor is only */
+/* usable when the buffer, offset and length all meet its alignment, */
+/* anything else goes through the page cache on the normal descriptor. */
+static int
+tivo_partition_pick_fd (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	unsigned int align = file->dio_align;
+
+	if (file->dio_fd < 0)
+		return _tivo_partition_fd (file);
+
+	if ((unsigned long) buf % align || (sector * 512) % align || ((unsigned int) count * 512) % align)
+		return _tivo_partition_fd (file);
+
+	return file->dio_fd;
+}
+
+/***************************************************************************/
+/* Give up on O_DIRECT for a file.  This happens when a filesystem accepts */
+/* the open but not the transfer. */
+static void
+tivo_partition_drop_dio (tpFILE * file)
+{
+	close (file->dio_fd);
+	file->dio_fd = -1;
+}
+
+/****************************************************************************/
+/* Backend read for files and devices.  If the O_DIRECT descriptor turns */
+/* out not to work, it is dropped and the read done through the normal one. */
+int
+tivo_partition_fd_read (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	int fd = tivo_partition_pick_fd (file, buf, sector, count);
+	int retval;
+
+	retval = tivo_partition_pread (fd, buf, sector, count);
+	if (retval < 0 && errno == EINVAL && fd == file->dio_fd)
+	{
+		tivo_partition_drop_dio (file);
+		retval = tivo_partition_pread (_tivo_partition_fd (file), buf, sector, count);
+	}
+
+	return retval;
+}
+
+/***********************************************/
+/* Read data, byte-swapping it if swab is set. */
+static int
+tivo_partition_read_int (tpFILE * file, void *buf, uint64_t sector, int count, int swab)
+{
 	int retval;
 
 	if (sector + count > tivo_partition_size (file))
@@ -122,7 +400,7 @@ tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
 		req.deadline = 0;
 
 		retval = readsectors (_tivo_partition_fd (file), &vec, 1, &req);
-		if (_tivo_partition_swab (file))
+		if (swab)
 		{
 			data_swab (buf, count * 512);
 		}
@@ -130,35 +408,226 @@ tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 #endif
 
-/* A file, or not TiVo, use llseek and read. */
-#ifdef USE__LLSEEK
-	if (_llseek (_tivo_partition_fd (file), sector >> 23, sector << 9, &result, SEEK_SET) < 0)
-#elif HAVE_LSEEK64
-	if (lseek64 (_tivo_partition_fd (file), (off64_t)sector << 9, SEEK_SET) != (off64_t)sector << 9)
-#else
-	if (lseek (_tivo_partition_fd (file), (off_t)sector << 9, SEEK_SET) != (off_t)sector << 9)
+/* A file, or not TiVo, leave it to the backend. */
+	retval = file->ops->read (file, buf, sector, count);
+	if (retval > 0 && swab)
+	{
+		data_swab (buf, retval);
+	}
+	return retval;
+}
+
+/*****************************************************************************/
+/* Read data from the MFS volume set.  It must be in whole sectors, and must */
+/* not cross a volume boundry. */
+int
+tivo_partition_read (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	return tivo_partition_read_int (file, buf, sector, count, _tivo_partition_swab (file));
+}
+
+/***************************************************************************/
+/* Read data without byte-swapping it, even if the volume is byte-swapped. */
+/* For callers that swap the data themselves, along with other work. */
+int
+tivo_partition_read_raw (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	return tivo_partition_read_int (file, buf, sector, count, 0);
+}
+
+/*************************************************************************/
+/* Return true if a sector is all zeros.  This is done a word at a time, */
+/* with several words in flight, which the compiler can vectorize. */
+static int
+tivo_partition_sector_is_zero (const void *buf)
+{
+	const uint64_t *words = buf;
+	uint64_t acc0 = 0, acc1 = 0, acc2 = 0, acc3 = 0;
+	int loop;
+
+	for (loop = 0; loop < 512 / sizeof (uint64_t); loop += 4)
+	{
+		acc0 |= words[loop];
+		acc1 |= words[loop + 1];
+		acc2 |= words[loop + 2];
+		acc3 |= words[loop + 3];
+	}
+
+	return (acc0 | acc1 | acc2 | acc3) == 0;
+}
+
+/***************************************************************/
+/* Return the number of zero sectors at the start of a buffer. */
+static int
+tivo_partition_zero_run (const unsigned char *buf, int count)
+{
+	int run;
+
+	for (run = 0; run < count && tivo_partition_sector_is_zero (buf + run * 512); run++)
+		;
+
+	return run;
+}
+
+/***************************************************************************/
+/* Check whether zero runs can be left as holes in this file.  They can if */
+/* it is a regular file and MFS_SPARSE is not set to 0. */
+static int
+tivo_partition_want_sparse (tpFILE * file)
+{
+	if (!file->sparse_state)
+	{
+		struct stat st;
+		char *env = getenv ("MFS_SPARSE");
+
+		file->sparse_state = -1;
+#if HAVE_FALLOCATE && defined (FALLOC_FL_PUNCH_HOLE)
+		if (!_tivo_partition_isdevice (file) && (!env || strcmp (env, "0")) && fstat (_tivo_partition_fd (file), &st) == 0 && S_ISREG (st.st_mode))
+		{
+			file->sparse_state = 1;
+		}
 #endif
+	}
+
+	return file->sparse_state > 0;
+}
+
+/****************************************************************************/
+/* Make a run of sectors read back as zeros without writing them.  Anything */
+/* past the end of the file is covered by growing it, the rest is punched */
+/* out.  Returns -1 with errno set if the filesystem can't do it, or if the */
+/* offset doesn't fit in a 64 bit file offset. */
+static int
+tivo_partition_punch (int fd, uint64_t sector, int count)
+{
+#if HAVE_FALLOCATE && defined (FALLOC_FL_PUNCH_HOLE)
+	struct stat64 st;
+	off64_t start;
+	off64_t len;
+
+/* Byte offsets have to stay below 2^63. */
+	if (sector + count > (uint64_t)1 << 54)
 	{
+		errno = EFBIG;
 		return -1;
 	}
 
-	retval = read (_tivo_partition_fd (file), buf, count * 512);
-	if (_tivo_partition_swab (file))
+	start = (off64_t)sector << 9;
+	len = (off64_t)count << 9;
+
+	if (fstat64 (fd, &st) < 0)
+		return -1;
+
+	if (start + len > st.st_size)
 	{
-		data_swab (buf, count * 512);
+		if (ftruncate64 (fd, start + len) < 0)
+			return -1;
+
+		if (start >= st.st_size)
+			return 0;
+
+		len = st.st_size - start;
 	}
-	return retval;
+
+	return fallocate64 (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, len);
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
 }
 
-/****************************************************************************/
-/* Write data to the MFS volume set.  It must be in whole sectors, and must */
-/* not cross a volume boundry. */
+/**************************************************************************/
+/* Write to a regular file, leaving holes for runs of at least */
+/* TIVO_PARTITION_SPARSE_MIN zero sectors.  Shorter runs are just written */
+/* along with the data around them.  If the filesystem can't punch holes, */
+/* the file is written normally from then on. */
+static int
+tivo_partition_pwrite_sparse (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	unsigned char *data = buf;
+	int done = 0;
+
+	while (done < count)
+	{
+		int zeros = tivo_partition_zero_run (data + done * 512, count - done);
+		int end;
+		int retval;
+
+		if (zeros >= TIVO_PARTITION_SPARSE_MIN)
+		{
+			if (tivo_partition_punch (_tivo_partition_fd (file), sector + done, zeros) == 0)
+			{
+				done += zeros;
+				continue;
+			}
+
+			file->sparse_state = -1;
+			end = count;
+		}
+		else
+		{
+/* Take the data up to the next long run of zeros. */
+			end = done + zeros;
+			while (end < count)
+			{
+				if (!tivo_partition_sector_is_zero (data + end * 512))
+				{
+					end++;
+					continue;
+				}
+
+				zeros = tivo_partition_zero_run (data + end * 512, count - end);
+				if (zeros >= TIVO_PARTITION_SPARSE_MIN)
+					break;
+
+				end += zeros;
+			}
+		}
+
+		retval = tivo_partition_pwrite (_tivo_partition_fd (file), data + done * 512, sector + done, end - done);
+		if (retval != (end - done) * 512)
+		{
+			if (retval < 0)
+				return retval;
+			return done * 512 + retval;
+		}
+
+		done = end;
+	}
+
+	return count * 512;
+}
+
+/***************************************************************************/
+/* Backend write for files and devices.  Long zero runs in image files */
+/* are left as holes, and O_DIRECT is dropped if it turns out not to work. */
+/* The pieces between the holes are not aligned for O_DIRECT, so sparse */
+/* writes always go through the buffered descriptor. */
 int
-tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
+tivo_partition_fd_write (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	int fd;
+	int retval;
+
+	if (count >= TIVO_PARTITION_SPARSE_MIN && tivo_partition_want_sparse (file))
+		return tivo_partition_pwrite_sparse (file, buf, sector, count);
+
+	fd = tivo_partition_pick_fd (file, buf, sector, count);
+	retval = tivo_partition_pwrite (fd, buf, sector, count);
+	if (retval < 0 && errno == EINVAL && fd == file->dio_fd)
+	{
+		tivo_partition_drop_dio (file);
+		retval = tivo_partition_pwrite (_tivo_partition_fd (file), buf, sector, count);
+	}
+
+	return retval;
+}
+
+/***********************************************************/
+/* Write data, byte-swapping it on the way if swab is set. */
+static int
+tivo_partition_write_int (tpFILE * file, void *buf, uint64_t sector, int count, int swab)
 {
-#ifdef USE__LLSEEK
-	loff_t result;
-#endif
 	int retval;
 
 	if (sector + count > tivo_partition_size (file))
@@ -189,12 +658,12 @@ tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
 		req.num_sectors = count;
 		req.deadline = 0;
 
-		if (_tivo_partition_swab (file))
+		if (swab)
 		{
 			data_swab (buf, count * 512);
 		}
 		retval = writesectors (_tivo_partition_fd (file), &vec, 1, &req);
-		if (_tivo_partition_swab (file))
+		if (swab)
 		{
 /* Fix the data since we don't own it. */
 			data_swab (buf, count * 512);
@@ -203,27 +672,729 @@ tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
 	}
 #endif
 
-/* A file, or not TiVo, use llseek and write. */
-#ifdef USE__LLSEEK
-	if (_llseek (_tivo_partition_fd (file), sector >> 23, sector << 9, &result, SEEK_SET) < 0)
-#elif HAVE_LSEEK64
-	if (lseek64 (_tivo_partition_fd (file), (off64_t)sector << 9, SEEK_SET) != (off64_t)sector << 9)
-#else
-	if (lseek (_tivo_partition_fd (file), (off_t)sector << 9, SEEK_SET) != (off_t)sector << 9)
+/* A file, or not TiVo, leave it to the backend. */
+	if (swab)
+	{
+		data_swab (buf, count * 512);
+	}
+	retval = file->ops->write (file, buf, sector, count);
+	if (swab)
+	{
+/* Fix the data since we don't own it. */
+		data_swab (buf, count * 512);
+	}
+	return retval;
+}
+
+/****************************************************************************/
+/* Write data to the MFS volume set.  It must be in whole sectors, and must */
+/* not cross a volume boundry. */
+int
+tivo_partition_write (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	return tivo_partition_write_int (file, buf, sector, count, _tivo_partition_swab (file));
+}
+
+/***************************************************************************/
+/* Write data that is already in the byte order of the volume.  The buffer */
+/* is not touched. */
+int
+tivo_partition_write_raw (tpFILE * file, void *buf, uint64_t sector, int count)
+{
+	return tivo_partition_write_int (file, buf, sector, count, 0);
+}
+
+/***************************************************************************/
+/* Collect ranges that follow each other on disk into a single I/O vector. */
+/* Returns the number of ranges used, which is at least 1. */
+static int
+tivo_partition_gather (struct tivo_partition_iovec *vec, int nvec, struct iovec *iov, int *bytes)
+{
+	int loop;
+
+	*bytes = 0;
+
+	for (loop = 0; loop < nvec && loop < TIVO_PARTITION_MAXIOV; loop++)
+	{
+		if (loop > 0 && vec[loop].sector != vec[loop - 1].sector + vec[loop - 1].count)
+			break;
+
+		iov[loop].iov_base = vec[loop].buf;
+		iov[loop].iov_len = vec[loop].count * 512;
+		*bytes += vec[loop].count * 512;
+	}
+
+	return loop;
+}
+
+/**************************************************************/
+/* Byte-swap the first bytes of the buffers in an I/O vector. */
+static void
+tivo_partition_swab_iov (struct iovec *iov, int niov, int bytes)
+{
+	int loop;
+
+	for (loop = 0; loop < niov && bytes > 0; loop++)
+	{
+		int toswab = iov[loop].iov_len < bytes? iov[loop].iov_len: bytes;
+
+		data_swab (iov[loop].iov_base, toswab);
+		bytes -= toswab;
+	}
+}
+
+/**********************************************************/
+/* Backend vectored read and write for files and devices. */
+int
+tivo_partition_fd_readv (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	return tivo_partition_preadv (_tivo_partition_fd (file), iov, niov, sector);
+}
+
+int
+tivo_partition_fd_writev (tpFILE * file, struct iovec *iov, int niov, uint64_t sector)
+{
+	return tivo_partition_pwritev (_tivo_partition_fd (file), iov, niov, sector);
+}
+
+/***************************************************************************/
+/* Read a list of ranges from the partition.  Ranges that are adjacent on */
+/* disk are read with a single system call.  Returns the total bytes read. */
+/* A short read stops processing there. */
+int
+tivo_partition_readv (tpFILE * file, struct tivo_partition_iovec *vec, int nvec)
+{
+	struct iovec iov[TIVO_PARTITION_MAXIOV];
+	uint64_t offset = tivo_partition_offset (file);
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < nvec; loop++)
+	{
+		if (vec[loop].sector + vec[loop].count > tivo_partition_size (file))
+		{
+			fprintf (stderr, "Attempt to read across partition boundry!");
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	while (nvec > 0)
+	{
+		int bytes;
+		int niov = tivo_partition_gather (vec, nvec, iov, &bytes);
+		int retval;
+
+		if (bytes == 0)
+		{
+			vec += niov;
+			nvec -= niov;
+			continue;
+		}
+
+#ifdef TIVO
+/* If it is not a file, and this is for TiVo, use readsector. */
+		if (_tivo_partition_isdevice (file))
+		{
+			struct FsIovec fsvec[TIVO_PARTITION_MAXIOV];
+			struct FsIoRequest req;
+
+			for (loop = 0; loop < niov; loop++)
+			{
+				fsvec[loop].pb = iov[loop].iov_base;
+				fsvec[loop].cb = iov[loop].iov_len;
+			}
+			req.sector = vec->sector + offset;
+			req.num_sectors = bytes / 512;
+			req.deadline = 0;
+
+			retval = readsectors (_tivo_partition_fd (file), fsvec, niov, &req);
+		}
+		else
 #endif
+		retval = file->ops->readv (file, iov, niov, vec->sector + offset);
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		if (_tivo_partition_swab (file))
+		{
+			tivo_partition_swab_iov (iov, niov, retval);
+		}
+
+		total += retval;
+		if (retval < bytes)
+			break;
+
+		vec += niov;
+		nvec -= niov;
+	}
+
+	return total;
+}
+
+/*************************************************************************/
+/* Write a list of ranges to the partition.  Ranges that are adjacent on */
+/* disk are written with a single system call.  Returns the total bytes */
+/* written.  A short write stops processing there. */
+int
+tivo_partition_writev (tpFILE * file, struct tivo_partition_iovec *vec, int nvec)
+{
+	struct iovec iov[TIVO_PARTITION_MAXIOV];
+	uint64_t offset = tivo_partition_offset (file);
+	int total = 0;
+	int loop;
+
+	for (loop = 0; loop < nvec; loop++)
+	{
+		if (vec[loop].sector + vec[loop].count > tivo_partition_size (file))
+		{
+			fprintf (stderr, "Attempt to write across partition boundry!\n");
+			errno = EIO;
+			return -1;
+		}
+	}
+
+	while (nvec > 0)
 	{
+		int bytes;
+		int niov = tivo_partition_gather (vec, nvec, iov, &bytes);
+		int retval;
+
+		if (bytes == 0)
+		{
+			vec += niov;
+			nvec -= niov;
+			continue;
+		}
+
+		if (_tivo_partition_swab (file))
+		{
+			tivo_partition_swab_iov (iov, niov, bytes);
+		}
+
+#ifdef TIVO
+/* If it is not a file, and this is for TiVo, use writesector. */
+		if (_tivo_partition_isdevice (file))
+		{
+			struct FsIovec fsvec[TIVO_PARTITION_MAXIOV];
+			struct FsIoRequest req;
+
+			for (loop = 0; loop < niov; loop++)
+			{
+				fsvec[loop].pb = iov[loop].iov_base;
+				fsvec[loop].cb = iov[loop].iov_len;
+			}
+			req.sector = vec->sector + offset;
+			req.num_sectors = bytes / 512;
+			req.deadline = 0;
+
+			retval = writesectors (_tivo_partition_fd (file), fsvec, niov, &req);
+		}
+		else
+#endif
+		retval = file->ops->writev (file, iov, niov, vec->sector + offset);
+
+		if (_tivo_partition_swab (file))
+		{
+/* Fix the data since we don't own it. */
+			tivo_partition_swab_iov (iov, niov, bytes);
+		}
+
+		if (retval < 0)
+			return total > 0? total: retval;
+
+		total += retval;
+		if (retval < bytes)
+			break;
+
+		vec += niov;
+		nvec -= niov;
+	}
+
+	return total;
+}
+
+/*****************************************************************************/
+/* Tell the kernel a range of sectors will be read soon, and in order, so it */
+/* can start reading them in the background.  Nothing is done if reads skip */
+/* the page cache through O_DIRECT, since the hint would only waste memory, */
+/* or if there is no descriptor because the partition is held in memory. */
+int
+tivo_partition_advise (tpFILE * file, uint64_t sector, uint64_t count)
+{
+#if HAVE_POSIX_FADVISE
+	int fd = _tivo_partition_fd (file);
+	int err;
+
+	if (fd < 0 || file->dio_fd >= 0 || sector >= tivo_partition_size (file))
+	{
+		return 0;
+	}
+
+	if (sector + count > tivo_partition_size (file))
+	{
+		count = tivo_partition_size (file) - sector;
+	}
+
+/* Account for sector offset. */
+	sector += tivo_partition_offset (file);
+
+	posix_fadvise64 (fd, (off64_t)sector << 9, (off64_t)count << 9, POSIX_FADV_SEQUENTIAL);
+	err = posix_fadvise64 (fd, (off64_t)sector << 9, (off64_t)count << 9, POSIX_FADV_WILLNEED);
+	if (err)
+	{
+		errno = err;
 		return -1;
 	}
+#endif
+
+	return 0;
+}
 
-	if (_tivo_partition_swab (file))
+/* Asynchronous I/O engine.  With io_uring, requests go into the submission */
+/* ring and are handed to the kernel in batches when completions are */
+/* polled for.  Without it, or for TiVo devices, requests are queued and */
+/* carried out one at a time as completions are polled for.  Reads are */
+/* hinted to the kernel as they are queued, so it can fetch them in the */
+/* background while the earlier ones are carried out. */
+struct tivo_partition_aio
+{
+	unsigned int depth;
+	unsigned int inflight;
+	struct tivo_partition_aio_req *queue;
+	struct tivo_partition_aio_req *queuetail;
+#ifdef USE_IO_URING
+	int ring_fd;
+	unsigned int ring_inflight;
+	unsigned int to_submit;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+#endif
+};
+
+#ifdef USE_IO_URING
+/***********************************************************************/
+/* Set up an io_uring for the engine.  Returns -1 if the kernel can't. */
+static int
+tivo_partition_aio_ring_init (struct tivo_partition_aio *aio)
+{
+	struct io_uring_params params;
+	int fd;
+
+	memset (&params, 0, sizeof (params));
+
+	fd = syscall (__NR_io_uring_setup, aio->depth, &params);
+	if (fd < 0)
+		return -1;
+
+	aio->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+	aio->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
 	{
-		data_swab (buf, count * 512);
+		if (aio->cq_ring_size > aio->sq_ring_size)
+			aio->sq_ring_size = aio->cq_ring_size;
+		aio->cq_ring_size = 0;
 	}
-	retval = write (_tivo_partition_fd (file), buf, count * 512);
-	if (_tivo_partition_swab (file))
+
+	aio->sq_ring = mmap (0, aio->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (aio->sq_ring == MAP_FAILED)
 	{
-/* Fix the data since we don't own it. */
-		data_swab (buf, count * 512);
+		close (fd);
+		return -1;
 	}
-	return retval;
+
+	if (aio->cq_ring_size)
+	{
+		aio->cq_ring = mmap (0, aio->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (aio->cq_ring == MAP_FAILED)
+		{
+			munmap (aio->sq_ring, aio->sq_ring_size);
+			close (fd);
+			return -1;
+		}
+	}
+	else
+	{
+		aio->cq_ring = aio->sq_ring;
+	}
+
+	aio->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+	aio->sqes = mmap (0, aio->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (aio->sqes == MAP_FAILED)
+	{
+		if (aio->cq_ring_size)
+			munmap (aio->cq_ring, aio->cq_ring_size);
+		munmap (aio->sq_ring, aio->sq_ring_size);
+		close (fd);
+		return -1;
+	}
+
+	aio->sq_tail = (unsigned int *)((char *)aio->sq_ring + params.sq_off.tail);
+	aio->sq_mask = (unsigned int *)((char *)aio->sq_ring + params.sq_off.ring_mask);
+	aio->sq_array = (unsigned int *)((char *)aio->sq_ring + params.sq_off.array);
+	aio->cq_head = (unsigned int *)((char *)aio->cq_ring + params.cq_off.head);
+	aio->cq_tail = (unsigned int *)((char *)aio->cq_ring + params.cq_off.tail);
+	aio->cq_mask = (unsigned int *)((char *)aio->cq_ring + params.cq_off.ring_mask);
+	aio->cqes = (struct io_uring_cqe *)((char *)aio->cq_ring + params.cq_off.cqes);
+
+/* The kernel may round the depth up. */
+	if (params.sq_entries < aio->depth)
+		aio->depth = params.sq_entries;
+
+	aio->ring_fd = fd;
+
+	return 0;
+}
+
+/************************************/
+/* Tear down the engine's io_uring. */
+static void
+tivo_partition_aio_ring_cleanup (struct tivo_partition_aio *aio)
+{
+	if (aio->ring_fd < 0)
+		return;
+
+	munmap (aio->sqes, aio->sqes_size);
+	if (aio->cq_ring_size)
+		munmap (aio->cq_ring, aio->cq_ring_size);
+	munmap (aio->sq_ring, aio->sq_ring_size);
+	close (aio->ring_fd);
+	aio->ring_fd = -1;
+}
+
+/**************************************************************************/
+/* Hand queued submissions to the kernel, optionally waiting for at least */
+/* one completion. */
+static int
+tivo_partition_aio_ring_enter (struct tivo_partition_aio *aio, int wait)
+{
+	int retval;
+
+	do
+	{
+		retval = syscall (__NR_io_uring_enter, aio->ring_fd, aio->to_submit, wait? 1: 0, wait? IORING_ENTER_GETEVENTS: 0, NULL, 0);
+	}
+	while (retval < 0 && errno == EINTR);
+
+	if (retval < 0)
+		return -1;
+
+	aio->to_submit -= retval < aio->to_submit? retval: aio->to_submit;
+
+	return 0;
+}
+#endif
+
+/****************************************************************************/
+/* True if the data of a request is in the opposite byte order to the disk. */
+/* Raw requests are byte-swapped from what tivo_partition_read would give. */
+static int
+tivo_partition_aio_swab (struct tivo_partition_aio_req *req)
+{
+	return !_tivo_partition_swab (req->file) != !req->raw;
+}
+
+/*********************************************************/
+/* Carry out a request right now, and record the result. */
+static void
+tivo_partition_aio_sync (struct tivo_partition_aio_req *req)
+{
+	errno = 0;
+
+	if (req->write)
+		req->result = tivo_partition_write_int (req->file, req->buf, req->sector, req->count, tivo_partition_aio_swab (req));
+	else
+		req->result = tivo_partition_read_int (req->file, req->buf, req->sector, req->count, tivo_partition_aio_swab (req));
+
+	if (req->result < 0)
+		req->result = errno? -errno: -EIO;
+}
+
+/****************************************************************************/
+/* Create an asynchronous I/O engine that allows up to depth requests in */
+/* flight.  If io_uring can't be used, requests will be done synchronously. */
+struct tivo_partition_aio *
+tivo_partition_aio_init (unsigned int depth)
+{
+	struct tivo_partition_aio *aio;
+
+	aio = calloc (sizeof (*aio), 1);
+	if (!aio)
+		return NULL;
+
+	if (depth < 1)
+		depth = 1;
+	aio->depth = depth;
+
+#ifdef USE_IO_URING
+	aio->ring_fd = -1;
+	tivo_partition_aio_ring_init (aio);
+#endif
+
+	return aio;
+}
+
+/**************************************************************************/
+/* Queue a request.  Returns -1 with errno EBUSY if depth requests are */
+/* already in flight, in which case some must be completed first.  The */
+/* buffer must be left alone until the request is completed.  Requests in */
+/* flight at the same time must not overlap. */
+int
+tivo_partition_aio_submit (struct tivo_partition_aio *aio, struct tivo_partition_aio_req *req)
+{
+	if (aio->inflight >= aio->depth)
+	{
+		errno = EBUSY;
+		return -1;
+	}
+
+	if (req->sector + req->count > tivo_partition_size (req->file))
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	req->next = NULL;
+	req->result = 0;
+	aio->inflight++;
+
+#ifdef USE_IO_URING
+	if (aio->ring_fd >= 0 && _tivo_partition_fd (req->file) >= 0
+#ifdef TIVO
+		&& !_tivo_partition_isdevice (req->file)
+#endif
+		)
+	{
+		unsigned int tail = *aio->sq_tail;
+		unsigned int idx = tail & *aio->sq_mask;
+		struct io_uring_sqe *sqe = &aio->sqes[idx];
+
+		memset (sqe, 0, sizeof (*sqe));
+		sqe->opcode = req->write? IORING_OP_WRITE: IORING_OP_READ;
+		sqe->fd = _tivo_partition_fd (req->file);
+		sqe->off = (req->sector + tivo_partition_offset (req->file)) << 9;
+		sqe->addr = (unsigned long)req->buf;
+		sqe->len = req->count * 512;
+		sqe->user_data = (unsigned long)req;
+
+/* The kernel gets the data in the buffer, so swab it now, and fix it */
+/* when it is completed. */
+		if (req->write && tivo_partition_aio_swab (req))
+		{
+			data_swab (req->buf, req->count * 512);
+		}
+
+		aio->sq_array[idx] = idx;
+		__atomic_store_n (aio->sq_tail, tail + 1, __ATOMIC_RELEASE);
+		aio->to_submit++;
+		aio->ring_inflight++;
+
+		return 0;
+	}
+#endif
+
+/* Start the kernel reading ahead, so the read is quick when its turn comes. */
+	if (!req->write)
+		tivo_partition_advise (req->file, req->sector, req->count);
+
+	if (aio->queuetail)
+		aio->queuetail->next = req;
+	else
+		aio->queue = req;
+	aio->queuetail = req;
+
+	return 0;
+}
+
+/**************************************************************************/
+/* Return a completed request, or NULL if there is none.  If wait is set, */
+/* block until a request completes, unless there is nothing in flight. */
+struct tivo_partition_aio_req *
+tivo_partition_aio_complete (struct tivo_partition_aio *aio, int wait)
+{
+	struct tivo_partition_aio_req *req;
+
+#ifdef USE_IO_URING
+	if (aio->ring_inflight > 0)
+	{
+		unsigned int head = *aio->cq_head;
+
+		if (head == __atomic_load_n (aio->cq_tail, __ATOMIC_ACQUIRE))
+		{
+/* Nothing done yet.  Only wait if there is nothing synchronous to do. */
+			if (tivo_partition_aio_ring_enter (aio, wait && !aio->queue) < 0)
+				return NULL;
+		}
+
+		if (head != __atomic_load_n (aio->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe *cqe = &aio->cqes[head & *aio->cq_mask];
+
+			req = (struct tivo_partition_aio_req *)(unsigned long)cqe->user_data;
+			req->result = cqe->res;
+			__atomic_store_n (aio->cq_head, head + 1, __ATOMIC_RELEASE);
+			aio->inflight--;
+			aio->ring_inflight--;
+
+			if (tivo_partition_aio_swab (req))
+			{
+				if (req->write)
+					data_swab (req->buf, req->count * 512);
+				else if (req->result > 0)
+					data_swab (req->buf, req->result);
+			}
+
+/* Kernels before 5.6 know io_uring, but not plain reads and writes. */
+/* Do this one by hand, and don't bother with the ring from here on. */
+			if (req->result == -EINVAL)
+			{
+				tivo_partition_aio_sync (req);
+				if (!aio->ring_inflight)
+					tivo_partition_aio_ring_cleanup (aio);
+			}
+
+			return req;
+		}
+	}
+#endif
+
+	req = aio->queue;
+	if (!req)
+		return NULL;
+
+	aio->queue = req->next;
+	if (!aio->queue)
+		aio->queuetail = NULL;
+	aio->inflight--;
+
+	tivo_partition_aio_sync (req);
+
+	return req;
+}
+
+/********************************************/
+/* Return the number of requests in flight. */
+int
+tivo_partition_aio_pending (struct tivo_partition_aio *aio)
+{
+	return aio->inflight;
+}
+
+/**********************************************************/
+/* Return true if requests really are run asynchronously. */
+int
+tivo_partition_aio_is_async (struct tivo_partition_aio *aio)
+{
+#ifdef USE_IO_URING
+	return aio->ring_fd >= 0;
+#else
+	return 0;
+#endif
+}
+
+/***************************************************************************/
+/* Free the engine.  Any requests still in flight are waited for first, as */
+/* the kernel may still be using their buffers. */
+void
+tivo_partition_aio_cleanup (struct tivo_partition_aio *aio)
+{
+	while (aio->inflight > 0 && tivo_partition_aio_complete (aio, 1))
+		;
+
+#ifdef USE_IO_URING
+	tivo_partition_aio_ring_cleanup (aio);
+#endif
+
+	free (aio);
+}
+
+/* Header kept in front of every pooled buffer.  It takes up a whole */
+/* alignment unit so the buffer after it stays aligned. */
+struct tivo_partition_buffer
+{
+	size_t size;
+	void *base;
+	struct tivo_partition_buffer *next;
+};
+
+static struct tivo_partition_buffer *tivo_partition_buffer_pool = NULL;
+static int tivo_partition_buffer_pooled = 0;
+
+/*****************************************************************************/
+/* Allocate a zeroed buffer aligned well enough for O_DIRECT transfers.  The */
+/* bulk copy loops allocate and free the same few sizes over and over, so */
+/* freed buffers are kept in a small pool and handed out again. */
+void *
+tivo_partition_buffer_alloc (size_t size)
+{
+	struct tivo_partition_buffer **loop;
+	struct tivo_partition_buffer *hdr;
+	void *base;
+
+	for (loop = &tivo_partition_buffer_pool; *loop; loop = &(*loop)->next)
+	{
+		if ((*loop)->size == size)
+		{
+			hdr = *loop;
+			*loop = hdr->next;
+			tivo_partition_buffer_pooled--;
+			memset ((char *) hdr + TIVO_PARTITION_DIO_ALIGN, 0, size);
+			return (char *) hdr + TIVO_PARTITION_DIO_ALIGN;
+		}
+	}
+
+#if HAVE_POSIX_MEMALIGN
+	if (posix_memalign (&base, TIVO_PARTITION_DIO_ALIGN, size + TIVO_PARTITION_DIO_ALIGN) != 0)
+		return NULL;
+	hdr = base;
+#else
+	base = malloc (size + TIVO_PARTITION_DIO_ALIGN * 2);
+	if (!base)
+		return NULL;
+	hdr = (struct tivo_partition_buffer *) (((unsigned long) base + TIVO_PARTITION_DIO_ALIGN - 1) & ~(unsigned long) (TIVO_PARTITION_DIO_ALIGN - 1));
+#endif
+
+	hdr->size = size;
+	hdr->base = base;
+	hdr->next = NULL;
+	memset ((char *) hdr + TIVO_PARTITION_DIO_ALIGN, 0, size);
+
+	return (char *) hdr + TIVO_PARTITION_DIO_ALIGN;
+}
+
+/**************************************************************************/
+/* Return a buffer from tivo_partition_buffer_alloc.  It goes back in the */
+/* pool if there is room, otherwise it is really freed. */
+void
+tivo_partition_buffer_free (void *buf)
+{
+	struct tivo_partition_buffer *hdr;
+
+	if (!buf)
+		return;
+
+	hdr = (struct tivo_partition_buffer *) ((char *) buf - TIVO_PARTITION_DIO_ALIGN);
+
+	if (tivo_partition_buffer_pooled < TIVO_PARTITION_BUFFER_POOL)
+	{
+		hdr->next = tivo_partition_buffer_pool;
+		tivo_partition_buffer_pool = hdr;
+		tivo_partition_buffer_pooled++;
+		return;
+	}
+
+	free (hdr->base);
 }
@@ -2,6 +2,7 @@
 #include <config.h>
 #endif
 #include <stdlib.h>
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
@@ -10,6 +11,11 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#if HAVE_CLOCK_GETTIME
+#include <time.h>
+#else
+#include <sys/time.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -24,6 +30,13 @@
 #include "mfs.h"
 #include "macpart.h"
 
+static void mfsvol_mem_data_free (struct volume_mem_list *list);
+static int mfsvol_overlay_close (struct volume_handle *hnd);
+
+/* Handles keeping I/O statistics, to be reported at exit if they haven't */
+/* been cleaned up by then. */
+static struct volume_handle *mfsvol_stats_handles = NULL;
+
 /***********************************************************************/
 /* Translate a device name from the TiVo view of the world to reality, */
 /* allowing relocating of MFS volumes by setting MFS_... variables. */
@@ -84,9 +97,28 @@ mfsvol_add_volume (struct volume_handle *hnd, char *path, int flags)
 {
 	struct volume_info *newvol;
 	struct volume_info **loop;
+	struct volume_extent *extents;
 
 	newvol = calloc (sizeof (*newvol), 1);
 
+/* Keep the name as given, for overlay files to reopen the volume set by. */
+	if (newvol)
+	{
+		int len = strcspn (path, " \t\r\n");
+
+		newvol->name = malloc (len + 1);
+		if (!newvol->name)
+		{
+			free (newvol);
+			newvol = NULL;
+		}
+		else
+		{
+			memcpy (newvol->name, path, len);
+			newvol->name[len] = 0;
+		}
+	}
+
 	if (!newvol)
 	{
 		hnd->err_msg = "Out of memory";
@@ -102,11 +134,13 @@ mfsvol_add_volume (struct volume_handle *hnd, char *path, int flags)
 /* If the user requested RO, let them have it.  This may break a writer */
 /* program, but thats what it is intended to do.  Also if write mode is */
 /* nor normal, set RO as well, for the actual file, just in case. */
-	if (hnd->write_mode != vwNormal || !strncmp (path, "RO:", 3))
+	if (!strncmp (path, "RO:", 3))
 	{
 		path += 3;
 		flags = (flags & ~O_ACCMODE) | O_RDONLY;
 	}
+	else if (hnd->write_mode != vwNormal)
+		flags = (flags & ~O_ACCMODE) | O_RDONLY;
 
 /* Open the file. */
 	newvol->file = tivo_partition_open (path, flags);
@@ -143,9 +177,22 @@ mfsvol_add_volume (struct volume_handle *hnd, char *path, int flags)
 		hnd->err_msg = "Empty partition %s";
 		hnd->err_arg1 = path;
 		tivo_partition_close (newvol->file);
+		free (newvol->name);
+		free (newvol);
+		return -1;
+	}
+
+/* Make room for it in the volume map. */
+	extents = realloc (hnd->extents, sizeof (*extents) * (hnd->extent_count + 1));
+	if (!extents)
+	{
+		hnd->err_msg = "Out of memory";
+		tivo_partition_close (newvol->file);
+		free (newvol->name);
 		free (newvol);
 		return -1;
 	}
+	hnd->extents = extents;
 
 /* Add it to the tail of the volume list. */
 	for (loop = &hnd->volumes; *loop; loop = &(*loop)->next)
@@ -155,6 +202,20 @@ mfsvol_add_volume (struct volume_handle *hnd, char *path, int flags)
 
 	*loop = newvol;
 
+/* Statistics are just left off if there's no memory for them. */
+	if (hnd->stats)
+	{
+		newvol->stats = calloc (sizeof (*newvol->stats), 1);
+		if (newvol->stats)
+			newvol->stats->path = strdup (path);
+	}
+
+/* Volumes only ever go on the end, so the map stays sorted. */
+	extents[hnd->extent_count].start = newvol->start;
+	extents[hnd->extent_count].end = newvol->start + newvol->sectors;
+	extents[hnd->extent_count].vol = newvol;
+	hnd->extent_count++;
+
 	return newvol->start;
 }
 
@@ -163,18 +224,37 @@ mfsvol_add_volume (struct volume_handle *hnd, char *path, int flags)
 struct volume_info *
 mfsvol_get_volume (struct volume_handle *hnd, uint64_t sector)
 {
-	struct volume_info *vol;
+	struct volume_extent *extent;
+	int low, high;
+
+/* Most access is sequential, so try the last volume found first. */
+	if (hnd->extent_count > 0)
+	{
+		extent = &hnd->extents[hnd->extent_hit];
+		if (extent->start <= sector && extent->end > sector)
+			return extent->vol;
+	}
 
 /* Find the volume this sector is from in the table of open volumes. */
-	for (vol = hnd->volumes; vol; vol = vol->next)
+	low = 0;
+	high = hnd->extent_count;
+	while (low < high)
 	{
-		if (vol->start <= sector && vol->start + vol->sectors > sector)
+		int mid = (low + high) / 2;
+
+		extent = &hnd->extents[mid];
+		if (extent->end <= sector)
+			low = mid + 1;
+		else if (extent->start > sector)
+			high = mid;
+		else
 		{
-			break;
+			hnd->extent_hit = mid;
+			return extent->vol;
 		}
 	}
 
-	return vol;
+	return NULL;
 }
 
 /*************************************************/
@@ -184,16 +264,9 @@ mfsvol_volume_size (struct volume_handle *hnd, uint64_t sector)
 {
 	struct volume_info *vol;
 
-/* Find the volume this sector is from in the table of open volumes. */
-	for (vol = hnd->volumes; vol; vol = vol->next)
-	{
-		if (vol->start == sector)
-		{
-			break;
-		}
-	}
+	vol = mfsvol_get_volume (hnd, sector);
 
-	if (vol)
+	if (vol && vol->start == sector)
 	{
 		return (vol->sectors);
 	}
@@ -206,15 +279,12 @@ mfsvol_volume_size (struct volume_handle *hnd, uint64_t sector)
 uint64_t
 mfsvol_volume_set_size (struct volume_handle *hnd)
 {
-	struct volume_info *vol;
-	uint64_t total = 0;
-
-	for (vol = hnd->volumes; vol; vol = vol->next)
+	if (hnd->extent_count > 0)
 	{
-		total += vol->sectors;
+		return hnd->extents[hnd->extent_count - 1].end;
 	}
 
-	return total;
+	return 0;
 }
 
 /****************************************************************************/
@@ -239,263 +309,1554 @@ mfsvol_is_writable (struct volume_handle *hnd, uint64_t sector)
 	return 1;
 }
 
-/***********************************************/
-/* Free space used by the volumes linked list. */
-void
-mfsvol_cleanup (struct volume_handle *hnd)
+/***************************************************************************/
+/* Allocate the sector cache.  This is put off until the first read, so */
+/* programs that never read through the volume layer don't pay for it.  If */
+/* the memory isn't there, just run without a cache. */
+static struct volume_cache *
+mfsvol_cache_alloc (struct volume_handle *hnd)
 {
-	while (hnd->volumes)
+	struct volume_cache *cache;
+	unsigned int hashsize;
+	unsigned int loop;
+
+	if (hnd->cache || !hnd->cache_size)
+		return hnd->cache;
+
+/* Keep the hash at least as big as the cache, to keep the chains short. */
+	for (hashsize = 1; hashsize < hnd->cache_size; hashsize <<= 1)
+		;
+
+	cache = calloc (sizeof (*cache), 1);
+	if (!cache)
 	{
-		struct volume_info *cur;
+		hnd->cache_size = 0;
+		return NULL;
+	}
 
-		cur = hnd->volumes;
-		hnd->volumes = hnd->volumes->next;
+	cache->entries = malloc (sizeof (*cache->entries) * hnd->cache_size);
+	cache->hash = malloc (sizeof (*cache->hash) * hashsize);
 
-		tivo_partition_close (cur->file);
-		free (cur);
+	if (!cache->entries || !cache->hash)
+	{
+		if (cache->entries)
+			free (cache->entries);
+		if (cache->hash)
+			free (cache->hash);
+		free (cache);
+		hnd->cache_size = 0;
+		return NULL;
 	}
 
-	if (hnd->hda)
-		free (hnd->hda);
-	if (hnd->hdb)
-		free (hnd->hdb);
+	cache->size = hnd->cache_size;
+	cache->hashmask = hashsize - 1;
 
-	free (hnd);
+	for (loop = 0; loop < hashsize; loop++)
+	{
+		cache->hash[loop] = -1;
+	}
+
+	hnd->cache = cache;
+
+	return cache;
 }
 
-/*****************************************************************************/
-/* Locate a block in memory for reading. */
-/* This returns the first sector with data for the read, so the reader will */
-/* need to walk the list to get the rest. */
-struct volume_mem_data *
-mfsvol_locate_mem_data_for_read (struct volume_info *volume, uint64_t sector, int count)
+/******************************************/
+/* Return the hash chain head for sector. */
+static int *
+mfsvol_cache_bucket (struct volume_cache *cache, uint64_t sector)
 {
-	struct volume_mem_data *block;
-	
-	for (block = volume->mem_blocks; block; block = block->next)
-	{
-		if (block->start + block->sectors > sector)
-		{
-			if (block->start < sector + count)
-				return block;
+	return &cache->hash[(unsigned int)(sector ^ (sector >> 24)) & cache->hashmask];
+}
 
-			return NULL;
-		}
+/**********************************************************/
+/* Find a sector in the cache, or NULL if it isn't there. */
+static struct volume_cache_entry *
+mfsvol_cache_lookup (struct volume_cache *cache, uint64_t sector)
+{
+	int idx;
+
+	for (idx = *mfsvol_cache_bucket (cache, sector); idx >= 0; idx = cache->entries[idx].next)
+	{
+		if (cache->entries[idx].sector == sector)
+			return &cache->entries[idx];
 	}
 
 	return NULL;
 }
 
-/*****************************************************************************/
-/* Locate a block in memory for writing. */
-/* This allocates a new block if needed, and will coalesce neighboring blocks. */
-struct volume_mem_data *
-mfsvol_locate_mem_data_for_write (struct volume_info *volume, uint64_t sector, int count)
+/**************************************************************************/
+/* Remove an entry from its hash chain.  The entry itself is left for the */
+/* clock to pick up. */
+static void
+mfsvol_cache_unlink (struct volume_cache *cache, struct volume_cache_entry *entry)
 {
-	struct volume_mem_data **block;
-	struct volume_mem_data *ret, *tmp;
-	uint64_t last_sector = sector + count;
-	
-	/* Find the first block that overlaps or butts up against the block to write */
-	for (block = &volume->mem_blocks; *block; block = &(*block)->next)
+	int idx = entry - cache->entries;
+	int *link;
+
+	for (link = mfsvol_cache_bucket (cache, entry->sector); *link >= 0; link = &cache->entries[*link].next)
 	{
-		if ((*block)->start + (*block)->sectors >= sector)
+		if (*link == idx)
 		{
+			*link = entry->next;
 			break;
 		}
 	}
 
-	/* Find the last sector in blocks that overlap or butt up against the block to write */
-	for (tmp = *block; tmp; tmp = tmp->next)
+	entry->sector = ~(uint64_t)0;
+	entry->next = -1;
+	entry->referenced = 0;
+}
+
+/*****************************************************************************/
+/* Add a sector to the cache.  Once the cache is full, the clock hand sweeps */
+/* around for an entry that has not been hit since the last pass. */
+static void
+mfsvol_cache_insert (struct volume_cache *cache, uint64_t sector, void *data)
+{
+	struct volume_cache_entry *entry;
+	int *bucket;
+
+	entry = mfsvol_cache_lookup (cache, sector);
+
+	if (!entry)
 	{
-		if (tmp->start + tmp->sectors >= sector + count)
+		if (cache->used < cache->size)
 		{
-			if (tmp->start <= last_sector)
+			entry = &cache->entries[cache->used++];
+		}
+		else
+		{
+			while (cache->entries[cache->hand].referenced)
 			{
-				last_sector = tmp->start + tmp->sectors;
+				cache->entries[cache->hand].referenced = 0;
+				cache->hand = (cache->hand + 1) % cache->size;
 			}
-			
-			break;
-		}
-	}
 
-	if (*block && (*block)->start <= sector)
-	{
-		/* Simple case, the desired write is entirely within an existing block. */
-		if ((*block)->start + (*block)->sectors >= sector + count)
-		{
-			return *block;
-		}
-		
-		/* Re-use the existing block, reallocating it to be big enough. */
-		*block = realloc (*block, sizeof (struct volume_mem_data) + (last_sector - (*block)->start) * 512);
-		ret = *block;
+			entry = &cache->entries[cache->hand];
+			cache->hand = (cache->hand + 1) % cache->size;
 
-		/* Out of memory */
-		if (!ret)
-		{
-			return NULL;
+			if (entry->sector != ~(uint64_t)0)
+				mfsvol_cache_unlink (cache, entry);
 		}
-		
-		ret->sectors = last_sector - ret->start;
-	}
-	else
-	{
-		/* No blocks overlap with the beginning of the area to write, so create a new entry */
-		ret = malloc (sizeof (struct volume_mem_data) + (last_sector - sector) * 512);
-		ret->start = sector;
-		ret->sectors = last_sector - sector;
-		ret->next = *block;
-		*block = ret;
-	}
 
-	for (tmp = ret->next; tmp && tmp->start < last_sector; tmp = ret->next)
-	{
-		/* Only copy the tail end of the overlap, the rest is about to be overwritten */
-		if (tmp->start + tmp->sectors > sector + count)
-		{
-			memcpy (&ret->data[(sector + count - ret->start) * 512], &tmp->data[(sector + count - tmp->start) * 512], (tmp->start + tmp->sectors - (sector + count)) * 512);
-		}
-		ret->next = tmp->next;
-		free (tmp);
+		bucket = mfsvol_cache_bucket (cache, sector);
+		entry->sector = sector;
+		entry->next = *bucket;
+		*bucket = entry - cache->entries;
 	}
-	
-	/* Zero out the data that is about to be overwritten */
-	memset (&ret->data[(sector - ret->start) * 512], 0, count * 512);
 
-	return ret;
+/* New entries are not marked referenced, so a sector that is read only */
+/* once is the first to go. */
+	entry->referenced = 0;
+	memcpy (entry->data, data, 512);
 }
 
-/*****************************************************************************/
-/* Read data from the MFS volume set.  It must be in whole sectors, and must */
-/* not cross a volume boundry. */
-int
-mfsvol_read_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+/**************************************************************************/
+/* Bring the cache in line with data just written to the volume.  Sectors */
+/* already cached are updated, nothing new is added. */
+static void
+mfsvol_cache_update (struct volume_cache *cache, void *buf, uint64_t sector, int count)
 {
-	struct volume_info *vol;
-	struct volume_mem_data *block;
-	int nread = 0;
+	int loop;
 
-	vol = mfsvol_get_volume (hnd, sector);
+	if (!cache->used)
+		return;
 
-/* If no volumes claim this sector, it's an IO error. */
-	if (!vol)
+	for (loop = 0; loop < count; loop++)
 	{
-		errno = EIO;
-		return -1;
+		struct volume_cache_entry *entry = mfsvol_cache_lookup (cache, sector + loop);
+
+		if (entry)
+			memcpy (entry->data, (unsigned char *)buf + loop * 512, 512);
 	}
+}
 
-/* Make the sector number relative to this volume. */
-	sector -= vol->start;
+/*************************************************************************/
+/* Drop any cached copies of sectors, such as after a failed write where */
+/* the state of the disk is unknown. */
+static void
+mfsvol_cache_invalidate (struct volume_cache *cache, uint64_t sector, int count)
+{
+	int loop;
 
-	if (sector + count > vol->sectors)
-	{
-#if DEBUG
-		fprintf (stderr, "Attempt to read across volume boundry %d %d %d %d!", sector + vol->start, count, vol->start, vol->sectors);
-#else
-		fprintf (stderr, "Attempt to read across volume boundry!");
-#endif
-		errno = EIO;
-		return -1;
-	}
+	if (!cache->used)
+		return;
 
-	/* Search for any mem data blocks within the read region. */
-	block = mfsvol_locate_mem_data_for_read (vol, sector, count);
-	
-	while (nread < count * 512)
+	for (loop = 0; loop < count; loop++)
 	{
-		if (block && block->start <= sector + nread / 512)
-		{
-			/* Copy the data from a memory block if available */
-			int tocopy = block->sectors - (sector + nread / 512 - block->start);
-			if (block->start + block->sectors > sector + count)
-				tocopy -= block->start + block->sectors - (sector + count);
-			
-			memcpy (buf + (nread & ~511), &block->data[(sector + nread / 512 - block->start) * 512], tocopy * 512);
-			nread += tocopy * 512;
-			
-			block = block->next;
-			/* Make sure the new block is still within the read */
-			if (block && block->start >= sector + count)
-			{
-				block = NULL;
-			}
-		}
-		else
-		{
-			/* Only read to the beginning of a memory block, is one is present. */
-			int newread;
-			int toread = count - nread / 512;
-			if (block)
-			{
-				toread = block->start - sector - nread / 512;
-			}
-			
-			newread = tivo_partition_read (vol->file, buf + (nread & ~511), sector + nread / 512, toread);
-			/* Propogate errors from any read up */
-			if (newread < 512)
-			{
-				if (newread < 0)
-					return newread;
-				
-				errno = EIO;
-				return -1;
-			}
-			
-			nread += newread & ~511;
-		}
+		struct volume_cache_entry *entry = mfsvol_cache_lookup (cache, sector + loop);
+
+		if (entry)
+			mfsvol_cache_unlink (cache, entry);
 	}
-/* Read the data. */
-	return nread;
 }
 
-/****************************************************************************/
-/* Doesn't really belong here, but useful for debugging with MFS_FAKE_WRITE */
-/* set, this gets called instead of writing. */
-static void
-hexdump (unsigned char *buf, unsigned int sector)
+/******************************************************************************/
+/* Read sectors from a volume through the sector cache.  Sector is relative */
+/* to the volume.  Any leading sectors found in the cache are copied from */
+/* there, the rest are read from the volume in one go and added to the cache. */
+static int
+mfsvol_cache_read (struct volume_handle *hnd, struct volume_info *vol, void *buf, uint64_t sector, int count)
 {
-	int ofs;
+	struct volume_cache *cache = hnd->cache;
+	int nread;
+	int loop;
 
-	for (ofs = 0; ofs < 512; ofs += 16)
+	if (count > MFSVOL_CACHE_MAXREAD || (!cache && !(cache = mfsvol_cache_alloc (hnd))))
 	{
-		unsigned char line[20];
-		int myo;
+		return tivo_partition_read (vol->file, buf, sector, count);
+	}
 
-		fprintf (stderr, "%05x:%03x ", sector, ofs);
+	for (loop = 0; loop < count; loop++)
+	{
+		struct volume_cache_entry *entry = mfsvol_cache_lookup (cache, vol->start + sector + loop);
 
-		for (myo = 0; myo < 16; myo++)
-		{
-			fprintf (stderr, "%02x%c", buf[myo + ofs], myo < 15 && (myo & 3) == 3 ? '-' : ' ');
-			line[myo] = (isprint (buf[myo + ofs]) ? buf[myo + ofs] : '.');
-		}
+		if (!entry)
+			break;
 
-		fprintf (stderr, "|");
-		line[16] = ':';
-		line[17] = '\n';
-		line[18] = 0;
-		fprintf (stderr, "%s", line);
+		memcpy ((unsigned char *)buf + loop * 512, entry->data, 512);
+		entry->referenced = 1;
 	}
-}
 
-/****************************************************************************/
-/* Write data to the MFS volume set.  It must be in whole sectors, and must */
-/* not cross a volume boundry. */
-int
-mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
-{
-	struct volume_info *vol;
+	cache->hits += loop;
 
-	vol = mfsvol_get_volume (hnd, sector);
+	if (loop == count)
+		return count * 512;
 
-/* If no volumes claim this sector, it's an IO error. */
-	if (!vol)
+	cache->misses += count - loop;
+
+	nread = tivo_partition_read (vol->file, (unsigned char *)buf + loop * 512, sector + loop, count - loop);
+
+	if (nread < 0)
+		return nread;
+
+	nread /= 512;
+	while (nread-- > 0)
 	{
-		errno = EIO;
-		return -1;
+		mfsvol_cache_insert (cache, vol->start + sector + loop, (unsigned char *)buf + loop * 512);
+		loop++;
 	}
 
-	if (hnd->write_mode & vwFake)
+	return loop * 512;
+}
+
+/******************************************************************************/
+/* Change the number of sectors held in the sector cache.  Any sectors cached */
+/* are dropped.  A size of 0 disables the cache. */
+void
+mfsvol_cache_set_size (struct volume_handle *hnd, unsigned int sectors)
+{
+	if (hnd->cache)
+	{
+		free (hnd->cache->entries);
+		free (hnd->cache->hash);
+		free (hnd->cache);
+		hnd->cache = NULL;
+	}
+
+	hnd->cache_size = sectors;
+}
+
+/**************************************************************************/
+/* Empty the sector cache.  Needed if the volumes are modified behind the */
+/* volume layer's back. */
+void
+mfsvol_cache_flush (struct volume_handle *hnd)
+{
+	struct volume_cache *cache = hnd->cache;
+	unsigned int loop;
+
+	if (!cache)
+		return;
+
+	for (loop = 0; loop <= cache->hashmask; loop++)
+	{
+		cache->hash[loop] = -1;
+	}
+
+	cache->used = 0;
+	cache->hand = 0;
+}
+
+/************************************************/
+/* Return the hit and miss counts of the cache. */
+void
+mfsvol_cache_stats (struct volume_handle *hnd, uint64_t *hits, uint64_t *misses)
+{
+	if (hits)
+		*hits = hnd->cache? hnd->cache->hits: 0;
+	if (misses)
+		*misses = hnd->cache? hnd->cache->misses: 0;
+}
+
+/****************************************************************/
+/* Hint extents of the readahead plan up to and including last. */
+static void
+mfsvol_readahead_hint (struct volume_handle *hnd, int last)
+{
+	struct volume_readahead *ra = &hnd->readahead;
+
+	if (last >= ra->count)
+		last = ra->count - 1;
+
+	for (; ra->hinted <= last; ra->hinted++)
+	{
+		struct volume_readahead_extent *extent = &ra->extents[ra->hinted];
+		struct volume_info *vol = mfsvol_get_volume (hnd, extent->sector);
+		uint64_t count = extent->count;
+
+		if (!vol)
+			continue;
+
+		if (extent->sector - vol->start + count > vol->sectors)
+			count = vol->sectors - (extent->sector - vol->start);
+
+		if (tivo_partition_advise (vol->file, extent->sector - vol->start, count) == 0)
+			ra->hinted_sectors += count;
+	}
+}
+
+/**************************************************************************/
+/* Note a read for the readahead plan.  If it is from one of the next few */
+/* extents of the plan, count whether it was hinted in time and hint the */
+/* extents after it.  Reads from anywhere else are left alone. */
+static void
+mfsvol_readahead_read (struct volume_handle *hnd, uint64_t sector, int count)
+{
+	struct volume_readahead *ra = &hnd->readahead;
+	int loop;
+
+	for (loop = ra->current; loop < ra->count && loop <= ra->current + (int) hnd->readahead_depth + 1; loop++)
+	{
+		struct volume_readahead_extent *extent = &ra->extents[loop];
+
+		if (sector >= extent->sector && sector < extent->sector + extent->count)
+		{
+			if (loop < ra->hinted)
+				ra->hits += count;
+			else
+				ra->misses += count;
+
+			ra->current = loop;
+			mfsvol_readahead_hint (hnd, loop + hnd->readahead_depth);
+			return;
+		}
+	}
+}
+
+/*************************************************************************/
+/* Set the extents that are about to be read, in the order they will be */
+/* read, replacing any earlier plan.  The first extents are hinted right */
+/* away, the rest as the reads get to them. */
+int
+mfsvol_readahead_plan (struct volume_handle *hnd, struct volume_readahead_extent *extents, int count)
+{
+	struct volume_readahead *ra = &hnd->readahead;
+
+	ra->count = 0;
+	ra->current = 0;
+	ra->hinted = 0;
+
+	if (!hnd->readahead_depth || count <= 0)
+		return 0;
+
+	if (count > ra->alloc)
+	{
+		struct volume_readahead_extent *tmp = realloc (ra->extents, sizeof (*tmp) * count);
+
+		if (!tmp)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+
+		ra->extents = tmp;
+		ra->alloc = count;
+	}
+
+	memcpy (ra->extents, extents, sizeof (*extents) * count);
+	ra->count = count;
+
+	mfsvol_readahead_hint (hnd, hnd->readahead_depth);
+
+	return 0;
+}
+
+/***************************************************************************/
+/* Return how well readahead is doing.  hinted is the sectors hinted, hits */
+/* the sectors read after being hinted and misses the sectors read from a */
+/* plan before they were hinted. */
+void
+mfsvol_readahead_stats (struct volume_handle *hnd, uint64_t *hinted, uint64_t *hits, uint64_t *misses)
+{
+	if (hinted)
+		*hinted = hnd->readahead.hinted_sectors;
+	if (hits)
+		*hits = hnd->readahead.hits;
+	if (misses)
+		*misses = hnd->readahead.misses;
+}
+
+/**********************************************************/
+/* Current time in microseconds, for timing I/O requests. */
+static uint64_t
+mfsvol_stats_clock ()
+{
+#if HAVE_CLOCK_GETTIME
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/******************************************/
+/* Pick the histogram bucket for a value. */
+static int
+mfsvol_stats_bucket (uint64_t value)
+{
+	int bucket = 0;
+
+	while (value && bucket < MFSVOL_STATS_BUCKETS - 1)
+	{
+		value >>= 1;
+		bucket++;
+	}
+
+	return bucket;
+}
+
+/*********************************************************************/
+/* Count a finished request against the volume it went to.  Start is */
+/* when it was started, from mfsvol_stats_clock. */
+static void
+mfsvol_stats_record (struct volume_handle *hnd, int write, uint64_t sector, int count, uint64_t start, int result)
+{
+	struct volume_info *vol = mfsvol_get_volume (hnd, sector);
+	struct volume_stats_io *io;
+	uint64_t usecs = mfsvol_stats_clock () - start;
+	uint64_t distance;
+
+	if (!vol || !vol->stats)
+		return;
+
+	io = &vol->stats->io[write? 1: 0];
+
+	io->ops++;
+	if (result > 0)
+		io->bytes += result;
+	io->usecs += usecs;
+	io->sizes[mfsvol_stats_bucket (count)]++;
+	io->latency[mfsvol_stats_bucket (usecs)]++;
+
+/* The first request on a volume has nowhere to seek from. */
+	if (vol->stats->io[0].ops + vol->stats->io[1].ops > 1 && sector != vol->stats->next_sector)
+	{
+		distance = sector > vol->stats->next_sector? sector - vol->stats->next_sector: vol->stats->next_sector - sector;
+		io->seeks++;
+		io->seek_sectors += distance;
+		io->distance[mfsvol_stats_bucket (distance)]++;
+	}
+
+	vol->stats->next_sector = sector + count;
+}
+
+/************************************************************************/
+/* Print the non-empty buckets of a histogram, labeled by their bottom. */
+static void
+mfsvol_stats_print_hist (const char *title, uint64_t *hist)
+{
+	int loop;
+
+	fprintf (stderr, "    %-9s", title);
+	for (loop = 0; loop < MFSVOL_STATS_BUCKETS; loop++)
+	{
+		if (hist[loop])
+			fprintf (stderr, " %llu:%llu", loop? 1ULL << (loop - 1): 0ULL, (unsigned long long) hist[loop]);
+	}
+	fprintf (stderr, "\n");
+}
+
+/*************************************************************************/
+/* Print the I/O statistics for each volume, along with the sector cache */
+/* and readahead counters, to stderr. */
+void
+mfsvol_stats_print (struct volume_handle *hnd)
+{
+	struct volume_info *vol;
+	uint64_t hinted, hits, misses;
+
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		int loop;
+
+		if (!vol->stats || vol->stats->io[0].ops + vol->stats->io[1].ops == 0)
+			continue;
+
+		fprintf (stderr, "I/O statistics for %s:\n", vol->stats->path? vol->stats->path: "volume");
+
+		for (loop = 0; loop < 2; loop++)
+		{
+			struct volume_stats_io *io = &vol->stats->io[loop];
+
+			if (!io->ops)
+				continue;
+
+			fprintf (stderr, "  %s: %llu requests, %llu KiB in %llu.%03llu seconds, %llu seeks averaging %llu sectors\n",
+				loop? "Writes": "Reads",
+				(unsigned long long) io->ops,
+				(unsigned long long) io->bytes / 1024,
+				(unsigned long long) io->usecs / 1000000,
+				(unsigned long long) io->usecs / 1000 % 1000,
+				(unsigned long long) io->seeks,
+				(unsigned long long) (io->seeks? io->seek_sectors / io->seeks: 0));
+			mfsvol_stats_print_hist ("Sectors", io->sizes);
+			mfsvol_stats_print_hist ("Usecs", io->latency);
+			mfsvol_stats_print_hist ("Seek", io->distance);
+		}
+	}
+
+	if (hnd->cache && hnd->cache->hits + hnd->cache->misses)
+		fprintf (stderr, "Sector cache: %llu hits, %llu misses\n", (unsigned long long) hnd->cache->hits, (unsigned long long) hnd->cache->misses);
+
+	mfsvol_readahead_stats (hnd, &hinted, &hits, &misses);
+	if (hinted)
+		fprintf (stderr, "Readahead: %llu sectors hinted, %llu hits, %llu misses\n", (unsigned long long) hinted, (unsigned long long) hits, (unsigned long long) misses);
+}
+
+/********************************************************************/
+/* Report the statistics of any handles that were never cleaned up. */
+static void
+mfsvol_stats_atexit ()
+{
+	struct volume_handle *hnd;
+
+	for (hnd = mfsvol_stats_handles; hnd; hnd = hnd->stats_next)
+		mfsvol_stats_print (hnd);
+}
+
+/***********************************************/
+/* Free space used by the volumes linked list. */
+void
+mfsvol_cleanup (struct volume_handle *hnd)
+{
+/* Wait for anything still in flight before closing the files. */
+	if (hnd->aio)
+		tivo_partition_aio_cleanup (hnd->aio);
+
+	if (mfsvol_flush (hnd) < 0)
+		mfsvol_perror (hnd, "mfsvol_cleanup");
+
+	if (hnd->stats)
+	{
+		struct volume_handle **loop;
+
+		mfsvol_stats_print (hnd);
+
+		for (loop = &mfsvol_stats_handles; *loop; loop = &(*loop)->stats_next)
+		{
+			if (*loop == hnd)
+			{
+				*loop = hnd->stats_next;
+				break;
+			}
+		}
+	}
+
+/* Keep a named overlay file for mfsoverlay to commit later. */
+	if (hnd->overlay_path && (hnd->write_mode & vwLocal) && mfsvol_overlay_close (hnd) < 0)
+	{
+		fprintf (stderr, "Could not write overlay file %s: %s\n", hnd->overlay_path, strerror (errno));
+		unlink (hnd->overlay_path);
+	}
+
+	if (hnd->overlay_fd >= 0)
+		close (hnd->overlay_fd);
+
+	while (hnd->volumes)
+	{
+		struct volume_info *cur;
+
+		cur = hnd->volumes;
+		hnd->volumes = hnd->volumes->next;
+
+		tivo_partition_close (cur->file);
+		mfsvol_mem_data_free (&cur->mem);
+		mfsvol_mem_data_free (&cur->spilled);
+		mfsvol_mem_data_free (&cur->dirty);
+		if (cur->stats)
+		{
+			free (cur->stats->path);
+			free (cur->stats);
+		}
+		free (cur->name);
+		free (cur);
+	}
+
+#if HAVE_LIBZ
+/* Compressed images held open by the partition tables are written out */
+/* along with the volumes. */
+	tivo_partition_cimage_sync ();
+#endif
+
+	mfsvol_cache_set_size (hnd, 0);
+
+	if (hnd->extents)
+		free (hnd->extents);
+	if (hnd->readahead.extents)
+		free (hnd->readahead.extents);
+
+	if (hnd->hda)
+		free (hnd->hda);
+	if (hnd->hdb)
+		free (hnd->hdb);
+	if (hnd->overlay_path)
+		free (hnd->overlay_path);
+
+	free (hnd);
+}
+
+/**************************************************************************/
+/* Pick the height of a new mem block in the skip list.  Each level holds */
+/* about a quarter of the blocks of the level below it. */
+static int
+mfsvol_mem_data_levels ()
+{
+	static unsigned int seed = 2463534242U;
+	int levels = 1;
+
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+
+	while (levels < MFSVOL_MEM_LEVELS && !(seed & (3U << (levels * 2))))
+		levels++;
+
+	return levels;
+}
+
+/***************************************************************************/
+/* Walk the skip list for the last block at each level that ends before */
+/* sector, or that ends at or before it if adjacent is set.  If update is */
+/* not NULL, the forward links leading past those blocks are stored in it. */
+/* Returns the first block after them. */
+static struct volume_mem_data *
+mfsvol_mem_data_search (struct volume_mem_list *list, uint64_t sector, int adjacent, struct volume_mem_data ***update)
+{
+	struct volume_mem_data **links = list->blocks;
+	int level;
+
+	for (level = list->levels - 1; level >= 0; level--)
+	{
+		while (links[level] && (adjacent? links[level]->start + links[level]->sectors < sector: links[level]->start + links[level]->sectors <= sector))
+			links = links[level]->next;
+
+		if (update)
+			update[level] = links;
+	}
+
+	return links[0];
+}
+
+/*****************************************************************************/
+/* Return the first block in the list with data for the range, or NULL. */
+static struct volume_mem_data *
+mfsvol_mem_data_find (struct volume_mem_list *list, uint64_t sector, int count)
+{
+	struct volume_mem_data *block;
+
+	block = mfsvol_mem_data_search (list, sector, 0, NULL);
+
+	if (block && block->start < sector + count)
+		return block;
+
+	return NULL;
+}
+
+/*****************************************************************************/
+/* Add a range to the list, coalescing it with any blocks it overlaps or */
+/* butts up against.  If withdata is not set, only the ranges are tracked. */
+/* Returns the block now holding the range, or NULL if out of memory. */
+static struct volume_mem_data *
+mfsvol_mem_data_insert (struct volume_mem_list *list, uint64_t sector, int count, int withdata)
+{
+	struct volume_mem_data **update[MFSVOL_MEM_LEVELS];
+	struct volume_mem_data *block;
+	struct volume_mem_data *ret, *tmp;
+	uint64_t last_sector = sector + count;
+	int level;
+
+	/* Find the first block that overlaps or butts up against the block to write */
+	block = mfsvol_mem_data_search (list, sector, 1, update);
+
+	/* Find the last sector in blocks that overlap or butt up against the block to write */
+	for (tmp = block; tmp; tmp = tmp->next[0])
+	{
+		if (tmp->start + tmp->sectors >= sector + count)
+		{
+			if (tmp->start <= last_sector)
+			{
+				last_sector = tmp->start + tmp->sectors;
+			}
+
+			break;
+		}
+	}
+
+	if (block && block->start <= sector)
+	{
+		/* Simple case, the desired write is entirely within an existing block. */
+		if (block->start + block->sectors >= sector + count)
+		{
+			return block;
+		}
+
+		/* Re-use the existing block, growing it to be big enough.  Grow by */
+		/* at least double so a run of appending writes isn't quadratic. */
+		ret = block;
+		if (withdata && last_sector - ret->start > ret->room)
+		{
+			uint64_t room = ret->room * 2;
+			unsigned char *data;
+
+			if (room < last_sector - ret->start)
+				room = last_sector - ret->start;
+
+			data = realloc (ret->data, room * 512);
+
+			/* Out of memory */
+			if (!data)
+			{
+				return NULL;
+			}
+
+			list->room += room - ret->room;
+			ret->data = data;
+			ret->room = room;
+		}
+
+		ret->sectors = last_sector - ret->start;
+	}
+	else
+	{
+		/* No blocks overlap with the beginning of the area to write, so create a new entry */
+		int levels = mfsvol_mem_data_levels ();
+
+		ret = malloc (sizeof (struct volume_mem_data) + levels * sizeof (struct volume_mem_data *));
+		if (!ret)
+		{
+			return NULL;
+		}
+
+		ret->start = sector;
+		ret->sectors = last_sector - sector;
+		ret->room = 0;
+		ret->data = NULL;
+		ret->levels = levels;
+
+		if (withdata)
+		{
+			ret->data = malloc ((last_sector - sector) * 512);
+			if (!ret->data)
+			{
+				free (ret);
+				return NULL;
+			}
+
+			ret->room = ret->sectors;
+			list->room += ret->room;
+		}
+
+		for (; list->levels < levels; list->levels++)
+		{
+			update[list->levels] = list->blocks;
+		}
+
+		for (level = 0; level < levels; level++)
+		{
+			ret->next[level] = update[level][level];
+			update[level][level] = ret;
+		}
+	}
+
+	/* Anything following at the levels of the new block now links from it */
+	for (level = 0; level < ret->levels; level++)
+	{
+		update[level] = ret->next;
+	}
+
+	for (tmp = ret->next[0]; tmp && tmp->start < last_sector; tmp = ret->next[0])
+	{
+		/* Only copy the tail end of the overlap, the rest is about to be overwritten */
+		if (withdata && tmp->start + tmp->sectors > sector + count)
+		{
+			memcpy (&ret->data[(sector + count - ret->start) * 512], &tmp->data[(sector + count - tmp->start) * 512], (tmp->start + tmp->sectors - (sector + count)) * 512);
+		}
+
+		for (level = 0; level < tmp->levels; level++)
+		{
+			update[level][level] = tmp->next[level];
+		}
+
+		list->room -= tmp->room;
+		free (tmp->data);
+		free (tmp);
+	}
+
+	while (list->levels > 0 && !list->blocks[list->levels - 1])
+	{
+		list->levels--;
+	}
+
+	/* Zero out the data that is about to be overwritten */
+	if (withdata)
+	{
+		memset (&ret->data[(sector - ret->start) * 512], 0, count * 512);
+	}
+
+	return ret;
+}
+
+/*********************************/
+/* Free every block in the list. */
+static void
+mfsvol_mem_data_free (struct volume_mem_list *list)
+{
+	struct volume_mem_data *cur, *next;
+
+	for (cur = list->blocks[0]; cur; cur = next)
+	{
+		next = cur->next[0];
+		free (cur->data);
+		free (cur);
+	}
+
+	memset (list, 0, sizeof (*list));
+}
+
+/****************************************************************************/
+/* Locate a block in memory for reading. */
+/* This returns the first sector with data for the read, so the reader will */
+/* need to walk the list to get the rest. */
+struct volume_mem_data *
+mfsvol_locate_mem_data_for_read (struct volume_info *volume, uint64_t sector, int count)
+{
+	return mfsvol_mem_data_find (&volume->mem, sector, count);
+}
+
+/*******************************************************************************/
+/* Locate a block in memory for writing. */
+/* This allocates a new block if needed, and will coalesce neighboring blocks. */
+struct volume_mem_data *
+mfsvol_locate_mem_data_for_write (struct volume_info *volume, uint64_t sector, int count)
+{
+	return mfsvol_mem_data_insert (&volume->mem, sector, count, 1);
+}
+
+/***********************************************************************/
+/* Return true if any of the range has been written in mem write mode, */
+/* either still in memory or spilled to the overlay file, or is waiting in */
+/* the write-back buffer. */
+static int
+mfsvol_overlay_overlaps (struct volume_info *volume, uint64_t sector, int count)
+{
+	return mfsvol_mem_data_find (&volume->mem, sector, count) || mfsvol_mem_data_find (&volume->spilled, sector, count) || mfsvol_mem_data_find (&volume->dirty, sector, count);
+}
+
+/****************************************************************************/
+/* Open the overlay file if it isn't already.  A named one is started over, */
+/* otherwise an anonymous one is used which goes away when closed. */
+static int
+mfsvol_overlay_open (struct volume_handle *hnd)
+{
+	if (hnd->overlay_fd >= 0)
+		return 0;
+
+	if (hnd->overlay_path)
+	{
+		hnd->overlay_fd = open (hnd->overlay_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	}
+	else
+	{
+		FILE *tmp = tmpfile ();
+
+		if (tmp)
+		{
+			hnd->overlay_fd = dup (fileno (tmp));
+			fclose (tmp);
+		}
+	}
+
+	return hnd->overlay_fd < 0? -1: 0;
+}
+
+/***********************************************************/
+/* Move everything held in memory out to the overlay file. */
+int
+mfsvol_overlay_spill (struct volume_handle *hnd)
+{
+	struct volume_info *vol;
+
+	if (mfsvol_overlay_open (hnd) < 0)
+		return -1;
+
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		struct volume_mem_data *block;
+
+		for (block = vol->mem.blocks[0]; block; block = block->next[0])
+		{
+			uint64_t done;
+
+			for (done = 0; done < block->sectors; done += MFSVOL_OVERLAY_CHUNK)
+			{
+				int count = block->sectors - done > MFSVOL_OVERLAY_CHUNK? MFSVOL_OVERLAY_CHUNK: block->sectors - done;
+
+				errno = 0;
+				if (tivo_partition_pwrite (hnd->overlay_fd, &block->data[done * 512], 1 + vol->start + block->start + done, count) != count * 512)
+				{
+					if (errno == 0)
+						errno = ENOSPC;
+					return -1;
+				}
+			}
+
+			if (!mfsvol_mem_data_insert (&vol->spilled, block->start, block->sectors, 0))
+			{
+				errno = ENOMEM;
+				return -1;
+			}
+		}
+
+		mfsvol_mem_data_free (&vol->mem);
+	}
+
+	hnd->mem_used = 0;
+
+	return 0;
+}
+
+/**********************************************************************/
+/* Read sectors that are not held in memory.  Anything spilled to the */
+/* overlay file comes from there, the rest from the volume. */
+static int
+mfsvol_overlay_read (struct volume_handle *hnd, struct volume_info *vol, void *buf, uint64_t sector, int count)
+{
+	struct volume_mem_data *block;
+	int nread = 0;
+
+	block = mfsvol_mem_data_find (&vol->spilled, sector, count);
+
+	if (!block)
+		return mfsvol_cache_read (hnd, vol, buf, sector, count);
+
+	while (nread < count)
+	{
+		int toread = count - nread;
+		int newread;
+
+		if (block && block->start <= sector + nread)
+		{
+			if (block->start + block->sectors < sector + count)
+				toread = block->start + block->sectors - (sector + nread);
+
+			newread = tivo_partition_pread (hnd->overlay_fd, buf + nread * 512, 1 + vol->start + sector + nread, toread);
+
+			block = block->next[0];
+			if (block && block->start >= sector + count)
+				block = NULL;
+		}
+		else
+		{
+			if (block)
+				toread = block->start - (sector + nread);
+
+			newread = mfsvol_cache_read (hnd, vol, buf + nread * 512, sector + nread, toread);
+		}
+
+		if (newread != toread * 512)
+		{
+			if (newread >= 0)
+				errno = EIO;
+			return -1;
+		}
+
+		nread += toread;
+	}
+
+	return nread * 512;
+}
+
+/*****************************************************************************/
+/* Identify the volume set by the logstamp and checksum of the volume header */
+/* on disk.  The volume header is only ever changed in memory while the */
+/* overlay is being made, so this is what it will be committed on top of. */
+static int
+mfsvol_overlay_identity (struct volume_handle *hnd, uint32_t *logstamp, uint32_t *checksum)
+{
+	unsigned char buf[512];
+	volume_header *vol_hdr = (volume_header *) buf;
+
+	if (!hnd->volumes || mfsvol_cache_read (hnd, hnd->volumes, buf, 0, 1) != 512)
+		return -1;
+
+	if (vol_hdr->v64.magic == intswap32 (MFS64_MAGIC))
+	{
+		*logstamp = intswap32 (vol_hdr->v64.logstamp);
+		*checksum = intswap32 (vol_hdr->v64.checksum);
+	}
+	else
+	{
+		*logstamp = intswap32 (vol_hdr->v32.logstamp);
+		*checksum = intswap32 (vol_hdr->v32.checksum);
+	}
+
+	return 0;
+}
+
+/****************************************************************************/
+/* Finish off a named overlay file.  Everything still in memory is spilled, */
+/* then the index of what was written and the header go out. */
+static int
+mfsvol_overlay_close (struct volume_handle *hnd)
+{
+	struct volume_overlay_header *hdr;
+	struct volume_overlay_extent *index;
+	struct volume_info *vol;
+	uint64_t sectors = mfsvol_volume_set_size (hnd);
+	unsigned int extents = 0;
+	unsigned int size;
+	int retval = -1;
+
+	if (mfsvol_overlay_spill (hnd) < 0)
+		return -1;
+
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		struct volume_mem_data *block;
+
+		for (block = vol->spilled.blocks[0]; block; block = block->next[0])
+			extents++;
+	}
+
+/* The index is padded out to whole sectors, with the header taking one */
+/* more sector in front of it. */
+	size = (extents * sizeof (*index) + 511) / 512;
+	hdr = calloc (size + 1, 512);
+	if (!hdr)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	index = (struct volume_overlay_extent *) ((unsigned char *) hdr + 512);
+	extents = 0;
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		struct volume_mem_data *block;
+
+		for (block = vol->spilled.blocks[0]; block; block = block->next[0])
+		{
+			index[extents].sector = vol->start + block->start;
+			index[extents].count = block->sectors;
+			extents++;
+		}
+	}
+
+	hdr->magic = MFSVOL_OVERLAY_MAGIC;
+	hdr->extents = extents;
+	hdr->sectors = sectors;
+	hdr->index = (1 + sectors) * 512;
+
+/* The volume set may have grown since it was opened, so the committer opens */
+/* it from this rather than the volume header on disk. */
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		if (strlen (hdr->volumes) + strlen (vol->name) + 2 > sizeof (hdr->volumes))
+		{
+			free (hdr);
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+
+		if (vol != hnd->volumes)
+			strcat (hdr->volumes, " ");
+		strcat (hdr->volumes, vol->name);
+	}
+
+	errno = 0;
+	if (mfsvol_overlay_identity (hnd, &hdr->logstamp, &hdr->checksum) == 0 && (size == 0 || tivo_partition_pwrite (hnd->overlay_fd, index, 1 + sectors, size) == size * 512) && tivo_partition_pwrite (hnd->overlay_fd, hdr, 0, 1) == 512)
+		retval = 0;
+	else if (errno == 0)
+		errno = ENOSPC;
+
+	free (hdr);
+	return retval;
+}
+
+/**************************************************************************/
+/* Read the header of an overlay file.  Returns the open file, or -1 with */
+/* errno set to EINVAL if it is not an overlay file. */
+static int
+mfsvol_overlay_read_header (const char *path, struct volume_overlay_header *hdr)
+{
+	unsigned char buf[512];
+	int fd;
+
+	fd = open (path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+
+	errno = 0;
+	if (tivo_partition_pread (fd, buf, 0, 1) != 512)
+	{
+		if (errno == 0)
+			errno = EINVAL;
+		close (fd);
+		return -1;
+	}
+
+	memcpy (hdr, buf, sizeof (*hdr));
+	if (hdr->magic != MFSVOL_OVERLAY_MAGIC || hdr->index != (1 + hdr->sectors) * 512 || !memchr (hdr->volumes, 0, sizeof (hdr->volumes)))
+	{
+		close (fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	return fd;
+}
+
+/***************************************************************************/
+/* Check that a file is an overlay file and return its header.  Returns -1 */
+/* with errno set to EINVAL if it is not. */
+int
+mfsvol_overlay_info (const char *path, struct volume_overlay_header *hdr)
+{
+	int fd = mfsvol_overlay_read_header (path, hdr);
+
+	if (fd < 0)
+		return -1;
+
+	close (fd);
+	return 0;
+}
+
+/************************************************************************/
+/* Write everything recorded in an overlay file to the volume set.  The */
+/* overlay must have been made against a volume set of the same size, with */
+/* the same volume header. */
+int
+mfsvol_overlay_commit (struct volume_handle *hnd, const char *path)
+{
+	struct volume_overlay_header hdr;
+	struct volume_overlay_extent *index;
+	unsigned char *buf;
+	struct stat st;
+	size_t size;
+	uint32_t logstamp, checksum;
+	unsigned int loop;
+	int fd;
+
+	fd = mfsvol_overlay_read_header (path, &hdr);
+	if (fd < 0)
+	{
+		hnd->err_msg = "%s: %s";
+		hnd->err_arg1 = (void *) path;
+		hnd->err_arg2 = errno == EINVAL? "Not an overlay file": strerror (errno);
+		return -1;
+	}
+
+	if (hdr.sectors != mfsvol_volume_set_size (hnd))
+	{
+		close (fd);
+		hnd->err_msg = "Overlay file %s is for a different volume set";
+		hnd->err_arg1 = (void *) path;
+		return -1;
+	}
+
+	if (mfsvol_overlay_identity (hnd, &logstamp, &checksum) < 0)
+	{
+		close (fd);
+		hnd->err_msg = "%s reading volume header";
+		hnd->err_arg1 = strerror (errno);
+		return -1;
+	}
+
+/* Anything else would have the overlay undo whatever happened in between. */
+	if (hdr.logstamp != logstamp || hdr.checksum != checksum)
+	{
+		close (fd);
+		hnd->err_msg = "Overlay file %s was made against a different volume header";
+		hnd->err_arg1 = (void *) path;
+		return -1;
+	}
+
+/* Every extent is at least a sector, and the index has to actually be in */
+/* the file, so the header can't ask for more than that. */
+	size = ((size_t) hdr.extents * sizeof (*index) + 511) / 512;
+	if (fstat (fd, &st) < 0 || hdr.extents > hdr.sectors || size > INT_MAX / 512 || (size && (hdr.sectors >= (uint64_t) st.st_size / 512 || (uint64_t) st.st_size / 512 - 1 - hdr.sectors < size)))
+	{
+		close (fd);
+		hnd->err_msg = "%s: Index is truncated";
+		hnd->err_arg1 = (void *) path;
+		return -1;
+	}
+
+	index = malloc (size * 512 + 1);
+	buf = malloc (MFSVOL_OVERLAY_CHUNK * 512);
+	if (!index || !buf)
+	{
+		close (fd);
+		free (index);
+		free (buf);
+		hnd->err_msg = "Out of memory";
+		return -1;
+	}
+
+	if (size && tivo_partition_pread (fd, index, 1 + hdr.sectors, size) != size * 512)
+	{
+		close (fd);
+		free (index);
+		free (buf);
+		hnd->err_msg = "%s: Index is truncated";
+		hnd->err_arg1 = (void *) path;
+		return -1;
+	}
+
+	for (loop = 0; loop < hdr.extents; loop++)
+	{
+		uint64_t done;
+
+		if (index[loop].sector > hdr.sectors || index[loop].count > hdr.sectors - index[loop].sector)
+		{
+			hnd->err_msg = "%s: Index is corrupt";
+			hnd->err_arg1 = (void *) path;
+			break;
+		}
+
+		for (done = 0; done < index[loop].count; done += MFSVOL_OVERLAY_CHUNK)
+		{
+			int count = index[loop].count - done > MFSVOL_OVERLAY_CHUNK? MFSVOL_OVERLAY_CHUNK: index[loop].count - done;
+
+			if (tivo_partition_pread (fd, buf, 1 + index[loop].sector + done, count) != count * 512)
+			{
+				hnd->err_msg = "%s: Data is truncated";
+				hnd->err_arg1 = (void *) path;
+				break;
+			}
+
+			if (mfsvol_write_data (hnd, buf, index[loop].sector + done, count) != count * 512)
+			{
+				hnd->err_msg = "Error writing overlay to volume: %s";
+				hnd->err_arg1 = strerror (errno);
+				break;
+			}
+		}
+
+		if (done < index[loop].count)
+			break;
+	}
+
+	close (fd);
+	free (index);
+	free (buf);
+
+	return loop < hdr.extents? -1: 0;
+}
+
+/*****************************************************************************/
+/* Read data from the MFS volume set, for mfsvol_read_data. */
+static int
+mfsvol_read_data_int (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	struct volume_info *vol;
+	struct volume_mem_data *block;
+	int nread = 0;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+/* If no volumes claim this sector, it's an IO error. */
+	if (!vol)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+/* Keep the readahead plan going. */
+	if (hnd->readahead.count)
+		mfsvol_readahead_read (hnd, sector, count);
+
+/* Make the sector number relative to this volume. */
+	sector -= vol->start;
+
+	if (sector + count > vol->sectors)
+	{
+#if DEBUG
+		fprintf (stderr, "Attempt to read across volume boundry %d %d %d %d!", sector + vol->start, count, vol->start, vol->sectors);
+#else
+		fprintf (stderr, "Attempt to read across volume boundry!");
+#endif
+		errno = EIO;
+		return -1;
+	}
+
+	/* Search for any mem data blocks within the read region.  Writes waiting */
+	/* in the write-back buffer are read the same way.  The buffer is flushed */
+	/* before mem write mode starts, so there are never both. */
+	if (vol->dirty.levels)
+		block = mfsvol_mem_data_find (&vol->dirty, sector, count);
+	else
+		block = mfsvol_locate_mem_data_for_read (vol, sector, count);
+	
+	while (nread < count * 512)
+	{
+		if (block && block->start <= sector + nread / 512)
+		{
+			/* Copy the data from a memory block if available */
+			int tocopy = block->sectors - (sector + nread / 512 - block->start);
+			if (block->start + block->sectors > sector + count)
+				tocopy -= block->start + block->sectors - (sector + count);
+			
+			memcpy (buf + (nread & ~511), &block->data[(sector + nread / 512 - block->start) * 512], tocopy * 512);
+			nread += tocopy * 512;
+			
+			block = block->next[0];
+			/* Make sure the new block is still within the read */
+			if (block && block->start >= sector + count)
+			{
+				block = NULL;
+			}
+		}
+		else
+		{
+			/* Only read to the beginning of a memory block, is one is present. */
+			int newread;
+			int toread = count - nread / 512;
+			if (block)
+			{
+				toread = block->start - sector - nread / 512;
+			}
+			
+			newread = mfsvol_overlay_read (hnd, vol, buf + (nread & ~511), sector + nread / 512, toread);
+			/* Propogate errors from any read up */
+			if (newread < 512)
+			{
+				if (newread < 0)
+					return newread;
+				
+				errno = EIO;
+				return -1;
+			}
+			
+			nread += newread & ~511;
+		}
+	}
+/* Read the data. */
+	return nread;
+}
+
+/*****************************************************************************/
+/* Read data from the MFS volume set.  It must be in whole sectors, and must */
+/* not cross a volume boundry. */
+int
+mfsvol_read_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	uint64_t start;
+	int nread;
+
+	if (!hnd->stats)
+		return mfsvol_read_data_int (hnd, buf, sector, count);
+
+	start = mfsvol_stats_clock ();
+	nread = mfsvol_read_data_int (hnd, buf, sector, count);
+	mfsvol_stats_record (hnd, 0, sector, count, start, nread);
+
+	return nread;
+}
+
+/**************************************************************************/
+/* Return true if every volume in the set is byte-swapped.  Only then can */
+/* the caller use mfsvol_read_data_raw and mfsvol_write_data_raw to fold */
+/* the byte-swapping into its own pass over the data. */
+int
+mfsvol_is_swabbed (struct volume_handle *hnd)
+{
+	struct volume_info *vol;
+
+	if (!hnd->volumes)
+		return 0;
+
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		if (!_tivo_partition_swab (vol->file))
+			return 0;
+	}
+
+	return 1;
+}
+
+/**************************************************************************/
+/* Read data, but leave it byte-swapped, the way it is on a byte-swapped */
+/* volume.  The caller has to data_swab it.  This skips the sector cache, */
+/* which is fine since it is write-through.  Volumes that are not */
+/* byte-swapped, or reads that overlap data held in memory, are read */
+/* normally and swapped to match. */
+int
+mfsvol_read_data_raw (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	struct volume_info *vol;
+	int nread;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+	if (vol && _tivo_partition_swab (vol->file) && sector - vol->start + count <= vol->sectors && !mfsvol_overlay_overlaps (vol, sector - vol->start, count))
+	{
+		uint64_t start = hnd->stats? mfsvol_stats_clock (): 0;
+
+		if (hnd->readahead.count)
+			mfsvol_readahead_read (hnd, sector, count);
+
+		nread = tivo_partition_read_raw (vol->file, buf, sector - vol->start, count);
+
+		if (hnd->stats)
+			mfsvol_stats_record (hnd, 0, sector, count, start, nread);
+
+		return nread;
+	}
+
+	nread = mfsvol_read_data (hnd, buf, sector, count);
+	if (nread > 0)
+	{
+		data_swab (buf, nread);
+	}
+
+	return nread;
+}
+
+/*************************************************************************/
+/* Write data that is already byte-swapped, the way it goes on a */
+/* byte-swapped volume.  The buffer is left as it was.  Anything but a */
+/* normal write to a byte-swapped volume, or one that would go into the */
+/* write-back buffer, is swapped back and written the normal way. */
+int
+mfsvol_write_data_raw (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	struct volume_info *vol;
+	int nwrit;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+	if (vol && _tivo_partition_swab (vol->file) && hnd->write_mode == vwNormal && !hnd->writeback_limit && !(vol->vol_flags & VOL_RDONLY) && sector - vol->start + count <= vol->sectors)
+	{
+		uint64_t start = hnd->stats? mfsvol_stats_clock (): 0;
+
+		nwrit = tivo_partition_write_raw (vol->file, buf, sector - vol->start, count);
+
+		if (hnd->stats)
+			mfsvol_stats_record (hnd, 1, sector, count, start, nwrit);
+
+/* The cache holds the data the normal way around, so just drop it. */
+		if (hnd->cache)
+			mfsvol_cache_invalidate (hnd->cache, sector, count);
+
+		return nwrit;
+	}
+
+	data_swab (buf, count * 512);
+	nwrit = mfsvol_write_data (hnd, buf, sector, count);
+	data_swab (buf, count * 512);
+
+	return nwrit;
+}
+
+/****************************************************************************/
+/* Return a read-only pointer to count sectors of the volume set.  If the */
+/* volume is a mapped image file this points straight into the mapping, and */
+/* stays valid until the volume is cleaned up.  Otherwise, for devices, */
+/* byte-swapped images and anything with data held in memory, the sectors */
+/* are read into buf and buf is returned.  Either way the data must not be */
+/* modified through the returned pointer.  Returns NULL on error. */
+void *
+mfsvol_map_sectors (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	struct volume_info *vol;
+	unsigned char *map;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+	if (vol && sector - vol->start + count <= vol->sectors && !mfsvol_overlay_overlaps (vol, sector - vol->start, count))
+	{
+		map = tivo_partition_map (vol->file);
+		if (map)
+		{
+			return map + (sector - vol->start) * 512;
+		}
+	}
+
+/* No mapping, copy it the normal way.  This also takes care of all the */
+/* error reporting. */
+	if (mfsvol_read_data (hnd, buf, sector, count) != count * 512)
+	{
+		return NULL;
+	}
+
+	return buf;
+}
+
+/****************************************************************************/
+/* Doesn't really belong here, but useful for debugging with MFS_FAKE_WRITE */
+/* set, this gets called instead of writing. */
+static void
+hexdump (unsigned char *buf, unsigned int sector)
+{
+	int ofs;
+
+	for (ofs = 0; ofs < 512; ofs += 16)
+	{
+		unsigned char line[20];
+		int myo;
+
+		fprintf (stderr, "%05x:%03x ", sector, ofs);
+
+		for (myo = 0; myo < 16; myo++)
+		{
+			fprintf (stderr, "%02x%c", buf[myo + ofs], myo < 15 && (myo & 3) == 3 ? '-' : ' ');
+			line[myo] = (isprint (buf[myo + ofs]) ? buf[myo + ofs] : '.');
+		}
+
+		fprintf (stderr, "|");
+		line[16] = ':';
+		line[17] = '\n';
+		line[18] = 0;
+		fprintf (stderr, "%s", line);
+	}
+}
+
+/****************************************************************************/
+/* Write data to the MFS volume set, for mfsvol_write_data. */
+static int
+mfsvol_write_data_int (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	struct volume_info *vol;
+	int nwrit;
+
+	vol = mfsvol_get_volume (hnd, sector);
+
+/* If no volumes claim this sector, it's an IO error. */
+	if (!vol)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	if (hnd->write_mode & vwFake)
 	{
 		int loop;
 		for (loop = 0; loop < count; loop++)
@@ -512,6 +1873,7 @@ mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int co
 
 	if (hnd->write_mode & vwLocal)
 	{
+		uint64_t room = vol->mem.room;
 		struct volume_mem_data *block = mfsvol_locate_mem_data_for_write (vol, sector, count);
 		if (!block)
 		{
@@ -519,6 +1881,12 @@ mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int co
 			return -1;
 		}
 		memcpy (&block->data[(sector - block->start) * 512], buf, count * 512);
+
+/* Over budget, move it all out to the overlay file. */
+		hnd->mem_used += vol->mem.room - room;
+		if (hnd->mem_limit && hnd->mem_used > hnd->mem_limit && mfsvol_overlay_spill (hnd) < 0)
+			return -1;
+
 		return count * 512;
 	}
 
@@ -537,8 +1905,392 @@ mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int co
 		return -1;
 	}
 
+/* Hold it in the write-back buffer to go out with its neighbors at the */
+/* next flush. */
+	if (hnd->writeback_limit)
+	{
+		uint64_t room = vol->dirty.room;
+		struct volume_mem_data *block = mfsvol_mem_data_insert (&vol->dirty, sector, count, 1);
+		if (!block)
+		{
+			errno = ENOMEM;
+			return -1;
+		}
+		memcpy (&block->data[(sector - block->start) * 512], buf, count * 512);
+
+		hnd->writeback_used += vol->dirty.room - room;
+		if (hnd->writeback_used > hnd->writeback_limit && mfsvol_flush (hnd) < 0)
+			return -1;
+
+		return count * 512;
+	}
+
 /* Write the data. */
-	return tivo_partition_write (vol->file, buf, sector, count);
+	nwrit = tivo_partition_write (vol->file, buf, sector, count);
+
+/* Keep the sector cache in sync with what is on disk. */
+	if (hnd->cache)
+	{
+		if (nwrit == count * 512)
+			mfsvol_cache_update (hnd->cache, buf, vol->start + sector, count);
+		else
+			mfsvol_cache_invalidate (hnd->cache, vol->start + sector, count);
+	}
+
+	return nwrit;
+}
+
+/****************************************************************************/
+/* Write data to the MFS volume set.  It must be in whole sectors, and must */
+/* not cross a volume boundry. */
+int
+mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int count)
+{
+	uint64_t start;
+	int nwrit;
+
+	if (!hnd->stats)
+		return mfsvol_write_data_int (hnd, buf, sector, count);
+
+	start = mfsvol_stats_clock ();
+	nwrit = mfsvol_write_data_int (hnd, buf, sector, count);
+	mfsvol_stats_record (hnd, 1, sector, count, start, nwrit);
+
+	return nwrit;
+}
+
+/*****************************************************************************/
+/* Set up asynchronous I/O for the volume set, allowing up to depth requests */
+/* in flight at once.  This is done with the default depth on the first */
+/* request if it hasn't been done already. */
+int
+mfsvol_aio_init (struct volume_handle *hnd, unsigned int depth)
+{
+	if (hnd->aio)
+	{
+		if (hnd->aio_pending > 0)
+		{
+			hnd->err_msg = "Asynchronous requests still pending";
+			return -1;
+		}
+
+		tivo_partition_aio_cleanup (hnd->aio);
+	}
+
+	hnd->aio = tivo_partition_aio_init (depth);
+
+	if (!hnd->aio)
+	{
+		hnd->err_msg = "Out of memory";
+		return -1;
+	}
+
+	return 0;
+}
+
+/*********************************************************/
+/* Queue a request that was finished without the engine. */
+static void
+mfsvol_aio_done (struct volume_handle *hnd, struct volume_aio_request *req, int result)
+{
+	req->result = result;
+	req->next = NULL;
+
+	if (hnd->aio_done_tail)
+		hnd->aio_done_tail->next = req;
+	else
+		hnd->aio_done = req;
+	hnd->aio_done_tail = req;
+
+	hnd->aio_pending++;
+}
+
+/*****************************************************************************/
+/* Start an asynchronous read or write.  Like mfsvol_read_data, it must be */
+/* whole sectors, and must not cross a volume boundry.  Returns -1 and sets */
+/* errno if the request could not be started, EBUSY meaning too many are */
+/* already in flight.  The buffer belongs to the volume layer until the */
+/* request is returned by mfsvol_aio_complete, and requests in flight at the */
+/* same time must not overlap. */
+int
+mfsvol_aio_submit (struct volume_handle *hnd, struct volume_aio_request *req)
+{
+	struct volume_info *vol;
+	uint64_t sector;
+
+	if (!hnd->aio && mfsvol_aio_init (hnd, MFSVOL_AIO_DEPTH) < 0)
+	{
+		errno = ENOMEM;
+		return -1;
+	}
+
+	vol = mfsvol_get_volume (hnd, req->sector);
+
+/* If no volumes claim this sector, it's an IO error. */
+	if (!vol)
+	{
+		errno = EIO;
+		return -1;
+	}
+
+	sector = req->sector - vol->start;
+
+	if (sector + req->count > vol->sectors)
+	{
+		fprintf (stderr, "Attempt to access across volume boundry!\n");
+		errno = EIO;
+		return -1;
+	}
+
+/* Anything that does not go straight to the disk is done right away, */
+/* through the normal paths. */
+	if (req->write? hnd->write_mode != vwNormal || hnd->writeback_limit: mfsvol_overlay_overlaps (vol, sector, req->count))
+	{
+		int result;
+
+		errno = 0;
+		if (req->write && req->raw)
+			result = mfsvol_write_data_raw (hnd, req->buf, req->sector, req->count);
+		else if (req->write)
+			result = mfsvol_write_data (hnd, req->buf, req->sector, req->count);
+		else if (req->raw)
+			result = mfsvol_read_data_raw (hnd, req->buf, req->sector, req->count);
+		else
+			result = mfsvol_read_data (hnd, req->buf, req->sector, req->count);
+
+		if (result < 0)
+			result = errno? -errno: -EIO;
+
+		mfsvol_aio_done (hnd, req, result);
+		return 0;
+	}
+
+/* If the volume this sector is in was opened read-only, it's an error. */
+	if (req->write && (vol->vol_flags & VOL_RDONLY))
+	{
+		fprintf (stderr, "mfsvol_aio_submit: Attempt to write to read-only volume. \n");
+		errno = EPERM;
+		return -1;
+	}
+
+	req->req.file = vol->file;
+	req->req.buf = req->buf;
+	req->req.sector = sector;
+	req->req.count = req->count;
+	req->req.write = req->write;
+	req->req.raw = req->raw;
+	req->req.data = req;
+
+	if (tivo_partition_aio_submit (hnd->aio, &req->req) < 0)
+		return -1;
+
+/* Keep the readahead plan going. */
+	if (!req->write && hnd->readahead.count)
+		mfsvol_readahead_read (hnd, req->sector, req->count);
+
+/* The data on disk is about to change, so stop caching it. */
+	if (req->write && hnd->cache)
+		mfsvol_cache_invalidate (hnd->cache, req->sector, req->count);
+
+	hnd->aio_pending++;
+
+	return 0;
+}
+
+/*************************************************************************/
+/* Return a finished asynchronous request, or NULL if there is none.  If */
+/* wait is set, block until one finishes, unless there are none pending. */
+struct volume_aio_request *
+mfsvol_aio_complete (struct volume_handle *hnd, int wait)
+{
+	struct volume_aio_request *req;
+	struct tivo_partition_aio_req *tpreq;
+
+	if (hnd->aio_done)
+	{
+		req = hnd->aio_done;
+		hnd->aio_done = req->next;
+		if (!hnd->aio_done)
+			hnd->aio_done_tail = NULL;
+		hnd->aio_pending--;
+		return req;
+	}
+
+	if (!hnd->aio)
+		return NULL;
+
+	tpreq = tivo_partition_aio_complete (hnd->aio, wait);
+	if (!tpreq)
+		return NULL;
+
+	req = tpreq->data;
+	req->result = tpreq->result;
+
+/* Anything cached while the write was in flight may be stale. */
+	if (req->write && hnd->cache)
+		mfsvol_cache_invalidate (hnd->cache, req->sector, req->count);
+
+	hnd->aio_pending--;
+
+	return req;
+}
+
+/*****************************************************************/
+/* Return the number of asynchronous requests not yet completed. */
+int
+mfsvol_aio_pending (struct volume_handle *hnd)
+{
+	return hnd->aio_pending;
+}
+
+/***************************************************************************/
+/* Read a list of extents into one buffer, one after the other, with up to */
+/* MFSVOL_AIO_DEPTH of them in flight at once.  Each extent must be inside */
+/* a single volume, and nothing else may be in flight.  Returns the bytes */
+/* read, stopping at the first extent that comes up short, or -1 if the */
+/* first one fails.  A single extent is just read the normal way. */
+int
+mfsvol_read_extents (struct volume_handle *hnd, void *buf, struct volume_readahead_extent *extents, int count, int raw)
+{
+	struct volume_aio_request reqs[MFSVOL_AIO_DEPTH];
+	unsigned char *data = buf;
+	int total = 0;
+
+	if (count == 1 && raw)
+		return mfsvol_read_data_raw (hnd, buf, extents->sector, extents->count);
+	if (count == 1)
+		return mfsvol_read_data (hnd, buf, extents->sector, extents->count);
+
+	while (count > 0)
+	{
+		int batch = count < MFSVOL_AIO_DEPTH? count: MFSVOL_AIO_DEPTH;
+		int submitted;
+		int busy = 0;
+		int done;
+		int loop;
+
+		for (submitted = 0; submitted < batch; submitted++)
+		{
+			struct volume_aio_request *req = &reqs[submitted];
+
+			req->buf = data;
+			req->sector = extents[submitted].sector;
+			req->count = extents[submitted].count;
+			req->write = 0;
+			req->raw = raw;
+
+			if (mfsvol_aio_submit (hnd, req) < 0)
+			{
+				busy = errno == EBUSY;
+				break;
+			}
+
+			data += req->count * 512;
+		}
+
+/* The buffer is in use until every request is back. */
+		for (done = 0; done < submitted && mfsvol_aio_complete (hnd, 1); done++)
+			;
+
+		for (loop = 0; loop < submitted; loop++)
+		{
+			if (reqs[loop].result != reqs[loop].count * 512)
+			{
+				if (reqs[loop].result > 0)
+					return total + (reqs[loop].result & ~511);
+
+				if (total == 0 && reqs[loop].result < 0)
+				{
+					errno = -reqs[loop].result;
+					return -1;
+				}
+
+				return total;
+			}
+
+			total += reqs[loop].result;
+		}
+
+/* An extent that could not be started ends the read there, unless the */
+/* engine was only full. */
+		if (submitted < batch && !(busy && submitted > 0))
+			return total > 0? total: -1;
+
+		extents += submitted;
+		count -= submitted;
+	}
+
+	return total;
+}
+
+/****************************************************************************/
+/* Write out everything held in the write-back buffer, a block at a time in */
+/* sector order.  This is the barrier callers use to keep their ordering, */
+/* so nothing written after it can reach the disk before what came before. */
+/* The buffer is emptied even on error, as a failed write would have been. */
+int
+mfsvol_flush (struct volume_handle *hnd)
+{
+	struct volume_info *vol;
+	int retval = 0;
+
+	for (vol = hnd->volumes; vol; vol = vol->next)
+	{
+		struct volume_mem_data *block;
+
+		for (block = vol->dirty.blocks[0]; block; block = block->next[0])
+		{
+			int nwrit;
+
+			errno = 0;
+			nwrit = tivo_partition_write (vol->file, block->data, block->start, block->sectors);
+
+/* Keep the sector cache in sync with what is on disk. */
+			if (hnd->cache)
+			{
+				if (nwrit == block->sectors * 512)
+					mfsvol_cache_update (hnd->cache, block->data, vol->start + block->start, block->sectors);
+				else
+					mfsvol_cache_invalidate (hnd->cache, vol->start + block->start, block->sectors);
+			}
+
+			if (nwrit != block->sectors * 512 && retval == 0)
+			{
+				hnd->err_msg = "Error flushing writes to volume: %s";
+				hnd->err_arg1 = errno? strerror (errno): "Short write";
+				retval = -1;
+			}
+		}
+
+		mfsvol_mem_data_free (&vol->dirty);
+	}
+
+	hnd->writeback_used = 0;
+
+	if (retval < 0)
+		errno = EIO;
+
+	return retval;
+}
+
+/****************************************************************************/
+/* Set how many sectors of writes the write-back buffer can hold before it */
+/* is flushed, or 0 to write straight through.  If MFS_WRITEBACK is set, it */
+/* wins over the size asked for. */
+int
+mfsvol_set_writeback (struct volume_handle *hnd, uint64_t sectors)
+{
+	char *writeback = getenv ("MFS_WRITEBACK");
+
+	if (writeback && *writeback)
+		sectors = strtoull (writeback, NULL, 0);
+
+	hnd->writeback_limit = sectors;
+
+	if (!sectors || hnd->writeback_used > sectors)
+		return mfsvol_flush (hnd);
+
+	return 0;
 }
 
 /******************************************************************************/
@@ -546,6 +2298,10 @@ mfsvol_write_data (struct volume_handle *hnd, void *buf, uint64_t sector, int co
 void
 mfsvol_enable_memwrite (struct volume_handle *hnd)
 {
+/* Real writes still buffered must not end up mixed in with the temp ones. */
+	if (mfsvol_flush (hnd) < 0)
+		mfsvol_perror (hnd, "mfsvol_enable_memwrite");
+
 	hnd->write_mode |= vwLocal;
 }
 
@@ -558,26 +2314,40 @@ mfsvol_discard_memwrite (struct volume_handle *hnd)
 	
 	for (volume = hnd->volumes; volume; volume = volume->next)
 	{
-		struct volume_mem_data *cur, *next;
-		
-		for (cur = volume->mem_blocks; cur; next = (cur = next)->next)
-		{
-			free (cur);
-		}
-		
-		volume->mem_blocks = NULL;
+		mfsvol_mem_data_free (&volume->mem);
+		mfsvol_mem_data_free (&volume->spilled);
+	}
+
+	hnd->mem_used = 0;
+
+/* Nothing in the overlay file is wanted anymore either. */
+	if (hnd->overlay_fd >= 0)
+	{
+		close (hnd->overlay_fd);
+		hnd->overlay_fd = -1;
+
+		if (hnd->overlay_path)
+			unlink (hnd->overlay_path);
 	}
 
 	hnd->write_mode &= ~vwLocal;
 }
 
 /******************************************************************************/
-/* Just a quick init.  All it really does is scan for the env MFS_FAKE_WRITE. */
+/* Just a quick init.  All it really does is scan for the env MFS_FAKE_WRITE, */
+/* MFS_CACHE_SIZE, MFS_MEMWRITE_LIMIT, MFS_OVERLAY_FILE, MFS_READAHEAD, */
+/* MFS_WRITEBACK and MFS_STATS. */
 /* Also get the real device names of hda and hdb. */
 struct volume_handle *
 mfsvol_init (const char *hda, const char *hdb)
 {
 	char *fake = getenv ("MFS_FAKE_WRITE");
+	char *cachesize = getenv ("MFS_CACHE_SIZE");
+	char *memlimit = getenv ("MFS_MEMWRITE_LIMIT");
+	char *overlay = getenv ("MFS_OVERLAY_FILE");
+	char *readahead = getenv ("MFS_READAHEAD");
+	char *writeback = getenv ("MFS_WRITEBACK");
+	char *stats = getenv ("MFS_STATS");
 	struct volume_handle *hnd;
 
 	hnd = calloc (sizeof (*hnd), 1);
@@ -589,6 +2359,43 @@ mfsvol_init (const char *hda, const char *hdb)
 		hnd->write_mode |= vwFake;
 	}
 
+/* Size of the sector cache, in sectors. */
+	if (cachesize && *cachesize)
+		hnd->cache_size = strtoul (cachesize, NULL, 0);
+	else
+		hnd->cache_size = MFSVOL_CACHE_DEFAULT;
+
+/* Sectors of mem writes to hold before spilling them to the overlay file. */
+	if (memlimit && *memlimit)
+		hnd->mem_limit = strtoull (memlimit, NULL, 0);
+
+	if (overlay && *overlay)
+		hnd->overlay_path = strdup (overlay);
+	hnd->overlay_fd = -1;
+
+/* Sectors of writes to buffer before flushing them. */
+	if (writeback && *writeback)
+		hnd->writeback_limit = strtoull (writeback, NULL, 0);
+
+/* Extents to hint ahead of reads in a readahead plan. */
+	if (readahead && *readahead)
+		hnd->readahead_depth = strtoul (readahead, NULL, 0);
+	else
+		hnd->readahead_depth = MFSVOL_READAHEAD_DEFAULT;
+
+/* Keep I/O statistics, reported when the handle is cleaned up or at exit. */
+	if (stats && *stats && strcmp (stats, "0"))
+	{
+		static int registered = 0;
+
+		if (!registered)
+			registered = atexit (mfsvol_stats_atexit) == 0;
+
+		hnd->stats = 1;
+		hnd->stats_next = mfsvol_stats_handles;
+		mfsvol_stats_handles = hnd;
+	}
+
 	if (hda && *hda)
 		hnd->hda = strdup (hda);
 
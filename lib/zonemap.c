@@ -118,36 +118,44 @@ mfs_inode_to_sector (struct mfs_handle *mfshnd, unsigned int inode)
 static inline struct zone_map *
 mfs_zone_for_block (struct mfs_handle *mfshnd, uint64_t sector, uint64_t size)
 {
-	struct zone_map *zone;
+	struct zone_map_extent *extent = NULL;
+	int low, high;
 
-	if (mfshnd->is_64)
+/* Blocks tend to be freed and allocated near each other, so try the last */
+/* zone found first. */
+	if (mfshnd->zone_extent_count > 0)
 	{
-	/* Find the zone to update based on the start sector */
-		for (zone = mfshnd->loaded_zones; zone; zone = zone->next_loaded)
-		{
-			if (sector >= intswap64 (zone->map->z64.first) && sector <= intswap64 (zone->map->z64.last))
-				break;
-		}
+		extent = &mfshnd->zone_extents[mfshnd->zone_extent_hit];
+		if (sector < extent->first || sector > extent->last)
+			extent = NULL;
 	}
-	else
+
+/* Find the zone to update based on the start sector */
+	low = 0;
+	high = mfshnd->zone_extent_count;
+	while (!extent && low < high)
 	{
-	/* Find the zone to update based on the start sector */
-		for (zone = mfshnd->loaded_zones; zone; zone = zone->next_loaded)
+		int mid = (low + high) / 2;
+
+		if (mfshnd->zone_extents[mid].last < sector)
+			low = mid + 1;
+		else if (mfshnd->zone_extents[mid].first > sector)
+			high = mid;
+		else
 		{
-			if (sector >= intswap32 (zone->map->z32.first) && sector <= intswap32 (zone->map->z32.last))
-				break;
+			mfshnd->zone_extent_hit = mid;
+			extent = &mfshnd->zone_extents[mid];
 		}
 	}
 
-	if (!zone)
+	if (!extent)
 	{
 		mfshnd->err_msg = "Sector %u out of bounds for zone map";
 		mfshnd->err_arg1 = (void *)sector;
 		return NULL;
 	}
 
-	if (mfshnd->is_64 && sector + size - 1 > intswap64 (zone->map->z64.last) ||
-		!mfshnd->is_64 && sector + size - 1 > intswap32 (zone->map->z32.last))
+	if (sector + size - 1 > extent->last)
 	{
 		mfshnd->err_msg = "Sector %u size %d crosses zone map boundry";
 		mfshnd->err_arg1 = (void *)sector;
@@ -155,8 +163,7 @@ mfs_zone_for_block (struct mfs_handle *mfshnd, uint64_t sector, uint64_t size)
 		return NULL;
 	}
 	
-	if (mfshnd->is_64 && (sector - intswap64 (zone->map->z64.first)) % size ||
-		!mfshnd->is_64 && (sector - intswap32 (zone->map->z32.first)) % size)
+	if ((sector - extent->first) % size)
 	{
 		mfshnd->err_msg = "Sector %u size %d not aligned with zone map";
 		mfshnd->err_arg1 = (void *)sector;
@@ -164,7 +171,7 @@ mfs_zone_for_block (struct mfs_handle *mfshnd, uint64_t sector, uint64_t size)
 		return NULL;
 	}
 
-	return zone;
+	return extent->zone;
 }
 
 /************************************************************************/
@@ -1083,6 +1090,73 @@ mfs_cleanup_zone_maps (struct mfs_handle *mfshnd)
 	}
 
 	mfshnd->loaded_zones = NULL;
+
+	mfs_fsid_index_free (mfshnd);
+	mfs_extent_map_free (mfshnd);
+
+	if (mfshnd->zone_extents)
+		free (mfshnd->zone_extents);
+	mfshnd->zone_extents = NULL;
+	mfshnd->zone_extent_count = 0;
+	mfshnd->zone_extent_hit = 0;
+}
+
+/******************************************/
+/* Sort zone map extents by first sector. */
+static int
+mfs_zone_extent_compare (const void *a, const void *b)
+{
+	const struct zone_map_extent *ea = a;
+	const struct zone_map_extent *eb = b;
+
+	if (ea->first < eb->first)
+		return -1;
+	if (ea->first > eb->first)
+		return 1;
+	return 0;
+}
+
+/************************************************************************/
+/* Build the sorted array of zone map extents used to find the zone map */
+/* for a block. */
+static int
+mfs_zone_extents_build (struct mfs_handle *mfshnd)
+{
+	struct zone_map *zone;
+	int count = 0;
+
+	for (zone = mfshnd->loaded_zones; zone; zone = zone->next_loaded)
+		count++;
+
+	mfshnd->zone_extents = calloc (sizeof (*mfshnd->zone_extents), count + 1);
+	if (!mfshnd->zone_extents)
+	{
+		mfshnd->err_msg = "Out of memory";
+		return -1;
+	}
+
+	count = 0;
+	for (zone = mfshnd->loaded_zones; zone; zone = zone->next_loaded)
+	{
+		if (mfshnd->is_64)
+		{
+			mfshnd->zone_extents[count].first = intswap64 (zone->map->z64.first);
+			mfshnd->zone_extents[count].last = intswap64 (zone->map->z64.last);
+		}
+		else
+		{
+			mfshnd->zone_extents[count].first = intswap32 (zone->map->z32.first);
+			mfshnd->zone_extents[count].last = intswap32 (zone->map->z32.last);
+		}
+		mfshnd->zone_extents[count].zone = zone;
+		count++;
+	}
+
+	qsort (mfshnd->zone_extents, count, sizeof (*mfshnd->zone_extents), mfs_zone_extent_compare);
+	mfshnd->zone_extent_count = count;
+	mfshnd->zone_extent_hit = 0;
+
+	return 0;
 }
 
 /*************************************************************/
@@ -1091,25 +1165,27 @@ static zone_header *
 mfs_load_zone_map (struct mfs_handle *mfshnd, uint64_t sector, uint64_t sbackup, uint32_t length)
 {
 	zone_header *hdr = calloc (length, 512);
+	zone_header *map;
 
 	if (!hdr)
 	{
 		return NULL;
 	}
 
-/* Read the map. */
-	mfsvol_read_data (mfshnd->vols, (unsigned char *) hdr, sector, length);
+/* Read the map.  If the volume is mapped, the CRC is checked in place and */
+/* only a good copy is copied out. */
+	map = mfs_map_data (mfshnd, (unsigned char *) hdr, sector, length);
 
 /* Verify the CRC matches. */
-	if (mfshnd->is_64 && !MFS_check_crc ((unsigned char *) hdr, length * 512, hdr->z64.checksum) ||
-		!mfshnd->is_64 && !MFS_check_crc ((unsigned char *) hdr, length * 512, hdr->z32.checksum))
+	if (!map || mfshnd->is_64 && !MFS_check_crc ((unsigned char *) map, length * 512, map->z64.checksum) ||
+		!mfshnd->is_64 && !MFS_check_crc ((unsigned char *) map, length * 512, map->z32.checksum))
 	{
 
 /* If the CRC doesn't match, try the backup map. */
-		mfsvol_read_data (mfshnd->vols, (unsigned char *) hdr, sbackup, length);
+		map = mfs_map_data (mfshnd, (unsigned char *) hdr, sbackup, length);
 
-		if (mfshnd->is_64 && !MFS_check_crc ((unsigned char *) hdr, length * 512, hdr->z64.checksum) ||
-			!mfshnd->is_64 && !MFS_check_crc ((unsigned char *) hdr, length * 512, hdr->z32.checksum))
+		if (!map || mfshnd->is_64 && !MFS_check_crc ((unsigned char *) map, length * 512, map->z64.checksum) ||
+			!mfshnd->is_64 && !MFS_check_crc ((unsigned char *) map, length * 512, map->z32.checksum))
 		{
 			mfshnd->err_msg = "Zone map checksum error";
 			free (hdr);
@@ -1117,6 +1193,12 @@ mfs_load_zone_map (struct mfs_handle *mfshnd, uint64_t sector, uint64_t sbackup,
 		}
 	}
 
+/* The zone map is kept and updated in memory, so it needs its own copy. */
+	if (map != hdr)
+	{
+		memcpy (hdr, map, length * 512);
+	}
+
 	return hdr;
 }
 
@@ -1266,6 +1348,11 @@ mfs_load_zone_maps (struct mfs_handle *mfshnd)
 		loop++;
 	}
 
+	if (mfs_zone_extents_build (mfshnd) < 0)
+	{
+		return -1;
+	}
+
 	return loop;
 }
 
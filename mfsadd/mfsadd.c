@@ -3,6 +3,7 @@
 #endif
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <string.h>
 #include <sys/param.h>
@@ -22,6 +23,8 @@ mfsadd_usage (char *progname)
 	fprintf (stderr, " -r scale  Set scale factor of media block size\n");
 	fprintf (stderr, " -x        Create partitions to fill all drives\n");
 	fprintf (stderr, " -X drive  Create partitions to fill specific drive\n");
+	fprintf (stderr, " -n file   Leave the drive alone, saving the changes to overlay file\n");
+	fprintf (stderr, "           for mfsoverlay to commit (Can not be used with -x or -X)\n");
 	fprintf (stderr, "NewApp / NewMedia\n");
 #if TARGET_OS_MAC
 	fprintf (stderr, "  Existing partitions (Such as /dev/disk1s14 /dev/disk1s15) to add to\n");
@@ -122,7 +125,7 @@ mfsadd_add_extends (struct mfs_handle *mfs, char **drives, char **xdevs, char **
 		unsigned int maxfree = tivo_partition_largest_free (xdevs[loop]);
 		unsigned int totalfree = tivo_partition_total_free (xdevs[loop]);
 		unsigned int used = maxfree & ~(minalloc - 1);
-		unsigned int required = mfs_volume_pair_app_size (mfs, used, minalloc);
+		unsigned int required = tivo_partition_align_size (xdevs[loop], mfs_volume_pair_app_size (mfs, used, minalloc));
 		unsigned int part1, part2;
 		int devn = xdevs[loop] == drives[0]? 0: 1;
 
@@ -132,7 +135,7 @@ mfsadd_add_extends (struct mfs_handle *mfs, char **drives, char **xdevs, char **
 		if (totalfree - maxfree < required && maxfree - used < required)
 		{
 			used = (maxfree - required) & ~(minalloc - 1);
-			required = mfs_volume_pair_app_size (mfs, used, minalloc);
+			required = tivo_partition_align_size (xdevs[loop], mfs_volume_pair_app_size (mfs, used, minalloc));
 		}
 
 		if (totalfree - maxfree >= required && maxfree - used < required)
@@ -223,10 +226,12 @@ mfsadd_main (int argc, char **argv)
 	int changed[2] = {0, 0};
 	int usecdrive = 0;
 	char seconddrive = 0;
+	char *overlay = 0;
+	struct volume_overlay_header hdr;
 
 	tivo_partition_direct ();
 
-	while ((opt = getopt (argc, argv, "xX:r:he")) > 0)
+	while ((opt = getopt (argc, argv, "xX:r:hen:")) > 0)
 	{
 		switch (opt)
 		{
@@ -259,6 +264,9 @@ mfsadd_main (int argc, char **argv)
 		case 'e':
 			usecdrive = 1;
 			break;
+		case 'n':
+			overlay = optarg;
+			break;
 		default:
 			mfsadd_usage (argv[0]);
 			return 1;
@@ -340,6 +348,14 @@ mfsadd_main (int argc, char **argv)
 		init_b_part = 1;
 	}
 
+/* New partitions go straight into the partition table, which the overlay */
+/* can't hold. */
+	if (overlay && (extendmfs || extendall))
+	{
+		fprintf (stderr, "%s: Can not create partitions with -n.\n", argv[0]);
+		return 1;
+	}
+
 /* Make sure both extend drives are not the same device. */
 	if (extendall == 2 && xdevs[0] == xdevs[1])
 	{
@@ -418,6 +434,13 @@ mfsadd_main (int argc, char **argv)
 		}
 	}
 
+/* Spill to the overlay file every 32MiB of changes. */
+	if (overlay)
+	{
+		setenv ("MFS_OVERLAY_FILE", overlay, 1);
+		setenv ("MFS_MEMWRITE_LIMIT", "65536", 0);
+	}
+
 	mfs = mfs_init (drives[0], drives[1], O_RDWR);
 
 	if (!mfs)
@@ -432,6 +455,9 @@ mfsadd_main (int argc, char **argv)
 		return 1;
 	}
 
+	if (overlay)
+		mfs_enable_memwrite (mfs);
+
 	if (mfsadd_scan_partitions (mfs, used, &seconddrive) < 0)
 		return 1;
 
@@ -532,9 +558,15 @@ mfsadd_main (int argc, char **argv)
 	}
 
 	if (changed[0] && drives[0])
+	{
 		tivo_partition_table_write (drives[0]);
+		tivo_partition_print_alignment (drives[0]);
+	}
 	if (changed[1] && drives[1])
+	{
 		tivo_partition_table_write (drives[1]);
+		tivo_partition_print_alignment (drives[1]);
+	}
 
 	hours = mfs_sa_hours_estimate (mfs);
 	loop2 = hours;
@@ -567,5 +599,16 @@ mfsadd_main (int argc, char **argv)
 	else
 		fprintf (stderr, "Done!  Estimated standalone gain: %d hours\n", loop2 - hours);
 
+/* Closing the volume set writes out the overlay file. */
+	if (overlay)
+	{
+		mfs_cleanup (mfs);
+
+		if (mfsvol_overlay_info (overlay, &hdr) < 0)
+			return 1;
+
+		fprintf (stderr, "Changes saved to %s, use mfsoverlay to commit them\n", overlay);
+	}
+
 	return 0;
 }
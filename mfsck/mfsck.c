@@ -488,270 +488,293 @@ scan_inode_overlap (zone_bitmap *bitmap, unsigned int curinode, mfs_inode *inode
 	}
 }
 
-void
-scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps)
+/* What scan_inodes keeps track of while the inodes go by. */
+struct scan_inodes_state
 {
-	int curinode = 0;
-	int maxinode = mfs_inode_count (mfs);
-	int loop;
-
-	int nchained = 0;
-	int chainlength = 0;
-	int maxchainlength = 0;
-	int extrachained = 0;
-	int needchained = 0;
-	int allocinode = 0;
-
-	int maxblocks = 0;
+	zone_bitmap *bitmaps;
+	int maxinode;
+	int maxblocks;
+	int nchained;
+	int chainlength;
+	int maxchainlength;
+	int allocinode;
+	// Bit 1 = chain needed, bit 2 = chain set
+	unsigned char *chained_inodes;
+};
 
-	mfs_inode *inode;
+/****************************************************/
+/* Check one inode, called through mfs_scan_inodes. */
+static int
+scan_inode (struct mfs_handle *mfs, unsigned int curinode, mfs_inode *inode, void *arg)
+{
+	struct scan_inodes_state *scan = arg;
+	int loop;
 
-	// Bit 1 = chain needed, bit 2 = chain set
-	unsigned char *chained_inodes = calloc (1, maxinode);
+	if (!inode)
+	{
+		if (mfs_has_error (mfs))
+		{
+			char msg[1024];
+			mfs_strerror (mfs, msg);
+			printf ("Error reading inode %d: %s\n", curinode, msg);
+			mfs_clearerror (mfs);
+		}
+		else
+		{
+			printf ("Error reading inode %d: Unknown\n");
+		}
+		return 0;
+	}
 
-	if (mfs_is_64bit (mfs))
+	switch (intswap32 (inode->sig))
 	{
-		maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d64[0]);
+	case MFS32_INODE_SIG:
+		if (mfs_is_64bit (mfs))
+		{
+			printf ("Inode %d claims to be 32 bit in 64 bit volume\n", curinode);
+		}
+		break;
+	case MFS64_INODE_SIG:
+		if (!mfs_is_64bit (mfs))
+		{
+			printf ("Inode %d claims to be 64 bit in 32 bit volume\n", curinode);
+		}
+		break;
+	default:
+		printf ("Inode %d unknown signature %08x\n", curinode, intswap32 (inode->sig));
+		break;
 	}
-	else
+
+	/* Mark if this inode is chained */
+	if (inode->inode_flags & intswap32 (INODE_CHAINED))
 	{
-		maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d32[0]);
+		scan->chained_inodes[curinode] |= 2;
 	}
 
-	for (curinode = 0; curinode < maxinode; curinode++)
+	if (inode->fsid)
 	{
-		inode = mfs_read_inode (mfs, curinode);
+		int curchainlength = 0;
+		int expectedzonetype;
 
-		if (!inode)
+		scan->allocinode++;
+
+		/* Mark if this fsid needs any inodes before it chained */
+		loop = intswap32 (inode->fsid) * MFS_FSID_HASH % scan->maxinode;
+		while (loop != curinode)
 		{
-			if (mfs_has_error (mfs))
-			{
-				char msg[1024];
-				mfs_strerror (mfs, msg);
-				printf ("Error reading inode %d: %s\n", curinode, msg);
-				mfs_clearerror (mfs);
-			}
-			else
-			{
-				printf ("Error reading inode %d: Unknown\n");
-			}
-			continue;
+			scan->chained_inodes[loop] |= 1;
+			curchainlength++;
+			loop = (loop + 1) % scan->maxinode;
 		}
 
-		switch (intswap32 (inode->sig))
+		/* Track statistics on chained inodes */
+		if (curchainlength > 0)
 		{
-		case MFS32_INODE_SIG:
-			if (mfs_is_64bit (mfs))
+			scan->nchained++;
+			scan->chainlength += curchainlength;
+			if (curchainlength > scan->maxchainlength)
+				scan->maxchainlength = curchainlength;
+		}
+
+		if (intswap32 (inode->inode) != curinode)
+		{
+			printf ("Inode %d fsid %d inode number mismatch with data %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->inode));
+		}
+
+		if (!inode->refcount)
+		{
+			printf ("Inode %d fsid %d has zero reference count\n", curinode, intswap32 (inode->fsid));
+		}
+
+		switch (inode->type)
+		{
+		case tyStream:
+			if (inode->blocksize != inode->unk3)
 			{
-				printf ("Inode %d claims to be 32 bit in 64 bit volume\n", curinode);
+				printf ("Inode %d fsid %d stream total block blocksize %d mismatch used block blocksize %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->unk3), intswap32 (inode->blocksize));
 			}
-			break;
-		case MFS64_INODE_SIG:
-			if (!mfs_is_64bit (mfs))
+			if (intswap32 (inode->size) < intswap32 (inode->blockused))
 			{
-				printf ("Inode %d claims to be 64 bit in 32 bit volume\n", curinode);
+				printf ("Inode %d fsid %d stream total block count %d less than used block count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), intswap32 (inode->blockused));
+			}
+			expectedzonetype = ztMedia;
+			if (inode->zone != 1)
+			{
+				printf ("Inode %d fsid %d marked for data type %d (Expect 1)\n", curinode, intswap32 (inode->fsid), inode->zone);
 			}
 			break;
 		default:
-			printf ("Inode %d unknown signature %08x\n", curinode, intswap32 (inode->sig));
+			printf ("Inode %d fsid %d unknown type %d\n", curinode, intswap32 (inode->fsid), inode->type);
+			/* Intentionally fall through */
+		case tyFile:
+		case tyDir:
+		case tyDb:
+			if (inode->blocksize || inode->blockused || inode->unk3)
+			{
+				printf ("Inode %d fsid %d non-stream inode defines stream block sizes\n", curinode, intswap32 (inode->fsid));
+			}
+			expectedzonetype = ztApplication;
+			if (inode->zone != 2)
+			{
+				printf ("Inode %d fsid %d marked for data type %d (Expect 2)\n", curinode, intswap32 (inode->fsid), inode->zone);
+			}
 			break;
 		}
 
-		/* Mark if this inode is chained */
-		if (inode->inode_flags & intswap32 (INODE_CHAINED))
-		{
-			chained_inodes[curinode] |= 2;
-		}
-
-		if (inode->fsid)
+		if (inode->inode_flags & intswap32 (INODE_DATA))
 		{
-			int curchainlength = 0;
-			int expectedzonetype;
-
-			allocinode++;
-
-			/* Mark if this fsid needs any inodes before it chained */
-			loop = intswap32 (inode->fsid) * MFS_FSID_HASH % maxinode;
-			while (loop != curinode)
+			if (inode->numblocks)
 			{
-				chained_inodes[loop] |= 1;
-				curchainlength++;
-				loop = (loop + 1) % maxinode;
+				printf ("Inode %d fsid %d has data in inode block and non-zero extent count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks));
 			}
 
-			/* Track statistics on chained inodes */
-			if (curchainlength > 0)
+			if (intswap32 (inode->size) + sizeof (*inode) > 512)
 			{
-				nchained++;
-				chainlength += curchainlength;
-				if (curchainlength > maxchainlength)
-					maxchainlength = curchainlength;
+				printf ("Inode %d fsid %d has data in inode block but size %d greather than max allowed %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), 512 - sizeof (*inode));
 			}
 
-			if (intswap32 (inode->inode) != curinode)
+			if (inode->type == tyStream)
 			{
-				printf ("Inode %d fsid %d inode number mismatch with data %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->inode));
+				printf ("Inode %d fsid %d has data in inode block with tyStream data type\n", curinode, intswap32 (inode->fsid));
 			}
+		}
+		else if (intswap32 (inode->numblocks) > scan->maxblocks)
+		{
+			printf ("Inode %d fsid %d has more extents (%d) than max (%d)\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks), scan->maxblocks);
+		}
+		else
+		{
+			uint64_t totalsize;
 
-			if (!inode->refcount)
+			for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
 			{
-				printf ("Inode %d fsid %d has zero reference count\n", curinode, intswap32 (inode->fsid));
-			}
+				uint64_t sector;
+				uint32_t count;
+				int bitno;
+				int bitcount;
 
-			switch (inode->type)
-			{
-			case tyStream:
-				if (inode->blocksize != inode->unk3)
-				{
-					printf ("Inode %d fsid %d stream total block blocksize %d mismatch used block blocksize %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->unk3), intswap32 (inode->blocksize));
-				}
-				if (intswap32 (inode->size) < intswap32 (inode->blockused))
+				if (mfs_is_64bit (mfs))
 				{
-					printf ("Inode %d fsid %d stream total block count %d less than used block count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), intswap32 (inode->blockused));
+					sector = intswap64 (inode->datablocks.d64[loop].sector);
+					count = intswap32 (inode->datablocks.d64[loop].count);
 				}
-				expectedzonetype = ztMedia;
-				if (inode->zone != 1)
+				else
 				{
-					printf ("Inode %d fsid %d marked for data type %d (Expect 1)\n", curinode, intswap32 (inode->fsid), inode->zone);
+					sector = intswap32 (inode->datablocks.d32[loop].sector);
+					count = intswap32 (inode->datablocks.d32[loop].count);
 				}
-				break;
-			default:
-				printf ("Inode %d fsid %d unknown type %d\n", curinode, intswap32 (inode->fsid), inode->type);
-				/* Intentionally fall through */
-			case tyFile:
-			case tyDir:
-			case tyDb:
-				if (inode->blocksize || inode->blockused || inode->unk3)
+
+				totalsize += count;
+
+				zone_bitmap *bitmapforblock = scan->bitmaps;
+				while (bitmapforblock->first > sector || bitmapforblock->last < sector)
+					bitmapforblock = bitmapforblock->next;
+
+				if (!bitmapforblock)
 				{
-					printf ("Inode %d fsid %d non-stream inode defines stream block sizes\n", curinode, intswap32 (inode->fsid));
+					printf ("Inode %d fsid %d extent %d (Sector %lld size %d) not within any zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
-				expectedzonetype = ztApplication;
-				if (inode->zone != 2)
+
+				if (expectedzonetype != bitmapforblock->type)
 				{
-					printf ("Inode %d fsid %d marked for data type %d (Expect 2)\n", curinode, intswap32 (inode->fsid), inode->zone);
+					printf ("Inode %d fsid %d expected zone type %d but extent %d is in type %d\n", curinode, intswap32 (inode->fsid), expectedzonetype, loop, bitmapforblock->type);
 				}
-				break;
-			}
 
-			if (inode->inode_flags & intswap32 (INODE_DATA))
-			{
-				if (inode->numblocks)
+				if ((sector - bitmapforblock->first) % bitmapforblock->blocksize)
 				{
-					printf ("Inode %d fsid %d has data in inode block and non-zero extent count %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks));
+					printf ("Inode %d fsid %d extent %d (Sector %lld size %d) not aligned inside zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
 
-				if (intswap32 (inode->size) + sizeof (*inode) > 512)
+				if (count % bitmapforblock->blocksize)
 				{
-					printf ("Inode %d fsid %d has data in inode block but size %d greather than max allowed %d\n", curinode, intswap32 (inode->fsid), intswap32 (inode->size), 512 - sizeof (*inode));
+					printf ("Inode %d fsid %d extent %d (Sector %lld size %d) size not a multiple of zone block size\n", curinode, intswap32 (inode->fsid), loop, sector, count);
+					continue;
 				}
 
-				if (inode->type == tyStream)
+				/* Make sure the range isn't marked already */
+				bitno = (sector - bitmapforblock->first) / bitmapforblock->blocksize;
+				bitcount = count / bitmapforblock->blocksize;
+				if (!scan_bit_range (bitmapforblock, bitno, bitno + bitcount - 1, 0))
 				{
-					printf ("Inode %d fsid %d has data in inode block with tyStream data type\n", curinode, intswap32 (inode->fsid));
+					scan_inode_overlap (bitmapforblock, curinode, inode, bitno, bitcount);
 				}
+				set_bit_range (bitmapforblock, bitno, bitno + bitcount - 1);
+				set_fsid_range (bitmapforblock, bitno, bitno + bitcount - 1, intswap32 (inode->fsid));
 			}
-			else if (intswap32 (inode->numblocks) > maxblocks)
+
+			if (inode->type == tyStream)
 			{
-				printf ("Inode %d fsid %d has more extents (%d) than max (%d)\n", curinode, intswap32 (inode->fsid), intswap32 (inode->numblocks), maxblocks);
+				if (totalsize < intswap32 (inode->size) * intswap32 (inode->unk3))
+				{
+					printf ("Inode %d fsid %d allocated size (%lld) less than data size (%lld)\n", curinode, intswap32 (inode->fsid), totalsize, (uint64_t)intswap32 (inode->size) * (uint64_t)intswap32 (inode->unk3));
+				}
 			}
 			else
 			{
-				uint64_t totalsize;
-
-				for (loop = 0; loop < intswap32 (inode->numblocks); loop++)
+				if (totalsize < intswap32 (inode->size))
 				{
-					uint64_t sector;
-					uint32_t count;
-					int bitno;
-					int bitcount;
-
-					if (mfs_is_64bit (mfs))
-					{
-						sector = intswap64 (inode->datablocks.d64[loop].sector);
-						count = intswap32 (inode->datablocks.d64[loop].count);
-					}
-					else
-					{
-						sector = intswap32 (inode->datablocks.d32[loop].sector);
-						count = intswap32 (inode->datablocks.d32[loop].count);
-					}
-
-					totalsize += count;
+					printf ("Inode %d fsid %d allocated size (%lld) less than data size (%lld)\n", curinode, intswap32 (inode->fsid), totalsize, (uint64_t)intswap32 (inode->size));
+				}
+			}
+		}
+	}
+	else
+	{
+		if (inode->refcount)
+		{
+			printf ("Inode %d has %d references and no fsid\n", inode, intswap32 (inode->refcount));
+		}
 
-					zone_bitmap *bitmapforblock = bitmaps;
-					while (bitmapforblock->first > sector || bitmapforblock->last < sector)
-						bitmapforblock = bitmapforblock->next;
+		if (inode->numblocks)
+		{
+			printf ("Inode %d free but has datablocks allocated to it\n");
+		}
+	}
 
-					if (!bitmapforblock)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %lld size %d) not within any zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
 
-					if (expectedzonetype != bitmapforblock->type)
-					{
-						printf ("Inode %d fsid %d expected zone type %d but extent %d is in type %d\n", curinode, intswap32 (inode->fsid), expectedzonetype, loop, bitmapforblock->type);
-					}
+	return 0;
+}
 
-					if ((sector - bitmapforblock->first) % bitmapforblock->blocksize)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %lld size %d) not aligned inside zone\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
+void
+scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps)
+{
+	struct scan_inodes_state scan;
+	int curinode = 0;
+	int maxinode = mfs_inode_count (mfs);
 
-					if (count % bitmapforblock->blocksize)
-					{
-						printf ("Inode %d fsid %d extent %d (Sector %lld size %d) size not a multiple of zone block size\n", curinode, intswap32 (inode->fsid), loop, sector, count);
-						continue;
-					}
+	int extrachained = 0;
+	int needchained = 0;
 
-					/* Make sure the range isn't marked already */
-					bitno = (sector - bitmapforblock->first) / bitmapforblock->blocksize;
-					bitcount = count / bitmapforblock->blocksize;
-					if (!scan_bit_range (bitmapforblock, bitno, bitno + bitcount - 1, 0))
-					{
-						scan_inode_overlap (bitmapforblock, curinode, inode, bitno, bitcount);
-					}
-					set_bit_range (bitmapforblock, bitno, bitno + bitcount - 1);
-					set_fsid_range (bitmapforblock, bitno, bitno + bitcount - 1, intswap32 (inode->fsid));
-				}
+	mfs_inode *inode;
 
-				if (inode->type == tyStream)
-				{
-					if (totalsize < intswap32 (inode->size) * intswap32 (inode->unk3))
-					{
-						printf ("Inode %d fsid %d allocated size (%lld) less than data size (%lld)\n", curinode, intswap32 (inode->fsid), totalsize, (uint64_t)intswap32 (inode->size) * (uint64_t)intswap32 (inode->unk3));
-					}
-				}
-				else
-				{
-					if (totalsize < intswap32 (inode->size))
-					{
-						printf ("Inode %d fsid %d allocated size (%lld) less than data size (%lld)\n", curinode, intswap32 (inode->fsid), totalsize, (uint64_t)intswap32 (inode->size));
-					}
-				}
-			}
-		}
-		else
-		{
-			if (inode->refcount)
-			{
-				printf ("Inode %d has %d references and no fsid\n", inode, intswap32 (inode->refcount));
-			}
+	memset (&scan, 0, sizeof (scan));
+	scan.bitmaps = bitmaps;
+	scan.maxinode = maxinode;
+	scan.chained_inodes = calloc (1, maxinode);
 
-			if (inode->numblocks)
-			{
-				printf ("Inode %d free but has datablocks allocated to it\n");
-			}
-		}
+	if (mfs_is_64bit (mfs))
+	{
+		scan.maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d64[0]);
+	}
+	else
+	{
+		scan.maxblocks = (512 - sizeof (*inode)) / sizeof (inode->datablocks.d32[0]);
+	}
 
-		free (inode);
+	if (mfs_scan_inodes (mfs, scan_inode, &scan) < 0)
+	{
+		char msg[1024];
+		mfs_strerror (mfs, msg);
+		printf ("Error scanning inodes: %s\n", msg);
+		mfs_clearerror (mfs);
 	}
 
 	for (curinode = 0; curinode < maxinode; curinode++)
 	{
 		/* Bit 1 = chain needed, bit 2 = chain set */
-		switch (chained_inodes[curinode])
+		switch (scan.chained_inodes[curinode])
 		{
 			case 1:
 				printf ("Inode %d requires chained flag, but not set\n", curinode);
@@ -763,17 +786,17 @@ scan_inodes (struct mfs_handle *mfs, zone_bitmap *bitmaps)
 		}
 	}
 
-	printf ("%d/%d inodes used\n", allocinode, maxinode);
-	if (nchained)
+	printf ("%d/%d inodes used\n", scan.allocinode, maxinode);
+	if (scan.nchained)
 	{
-		printf ("%d fsids in chained inodes, %d max inode chain length, %d average length\n", nchained, maxchainlength, (chainlength + nchained / 2) / nchained);
+		printf ("%d fsids in chained inodes, %d max inode chain length, %d average length\n", scan.nchained, scan.maxchainlength, (scan.chainlength + scan.nchained / 2) / scan.nchained);
 	}
 	if (extrachained || needchained)
 	{
 		printf ("%d inodes unnecessarily chained, %d not chained need to be\n", extrachained, needchained);
 	}
 
-	free (chained_inodes);
+	free (scan.chained_inodes);
 }
 
 void
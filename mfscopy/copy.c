@@ -146,7 +146,7 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	unsigned int maxfree = tivo_partition_largest_free (realdev);
 	unsigned int totalfree = tivo_partition_total_free (realdev);
 	unsigned int used = maxfree & ~(blocksize - 1);
-	unsigned int required = mfs_volume_pair_app_size (mfshnd, used, blocksize);
+	unsigned int required = tivo_partition_align_size (realdev, mfs_volume_pair_app_size (mfshnd, used, blocksize));
 	unsigned int part1, part2;
 	char app[MAXPATHLEN];
 	char media[MAXPATHLEN];
@@ -158,7 +158,7 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	if (totalfree - maxfree < required && maxfree - used < required)
 	{
 		used = (maxfree - required) & ~(blocksize - 1);
-		required = mfs_volume_pair_app_size (mfshnd, used, blocksize);
+		required = tivo_partition_align_size (realdev, mfs_volume_pair_app_size (mfshnd, used, blocksize));
 	}
 
 	if (totalfree - maxfree >= required && maxfree - used < required)
@@ -192,6 +192,8 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	if (tivo_partition_table_write (realdev) < 0)
 		return -1;
 
+	tivo_partition_print_alignment (realdev);
+
 	if (mfs_add_volume_pair (mfshnd, app, media, blocksize) < 0)
 		return -1;
 
@@ -469,10 +471,16 @@ copy_main (int argc, char **argv)
 	else
 	{
 		unsigned starttime;
-		char buf[BUFSIZE];
+		char *buf = tivo_partition_buffer_alloc (BUFSIZE);
 		unsigned int curcount = 0;
 		int nread, nwrit;
 
+		if (!buf)
+		{
+			fprintf (stderr, "Out of memory!\n");
+			return 1;
+		}
+
 		if (threshopt)
 			backup_set_thresh (info_b, thresh);
 
@@ -494,6 +502,7 @@ copy_main (int argc, char **argv)
 				backup_perror (info_b, "Copy source");
 			else
 				fprintf (stderr, "Copy source failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -510,6 +519,7 @@ copy_main (int argc, char **argv)
 				backup_perror (info_b, "Copy source");
 			else
 				fprintf (stderr, "Copy source failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -522,6 +532,7 @@ copy_main (int argc, char **argv)
 				restore_perror (info_r, "Copy target");
 			else
 				fprintf (stderr, "Copy target failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -536,6 +547,7 @@ copy_main (int argc, char **argv)
 				restore_perror (info_r, "Copy target");
 			else
 				fprintf (stderr, "Copy target failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -545,15 +557,25 @@ copy_main (int argc, char **argv)
 				restore_perror (info_r, "Copy target");
 			else
 				fprintf (stderr, "Copy target failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
+		if (quiet < 1)
+		{
+			int loop;
+
+			for (loop = 0; loop < info_r->ndevs; loop++)
+				tivo_partition_print_alignment (info_r->devs[loop].devname);
+		}
+
 		if (restore_write (info_r, buf + nwrit, nread - nwrit) != nread - nwrit)
 		{
 			if (restore_has_error (info_r))
 				restore_perror (info_r, "Copy target");
 			else
 				fprintf (stderr, "Copy target failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -571,6 +593,7 @@ copy_main (int argc, char **argv)
 					restore_perror (info_r, "Copy source");
 				else
 					fprintf (stderr, "Copy source failed.\n");
+				tivo_partition_buffer_free (buf);
 				return 1;
 			}
 			prcnt = get_percent (info_r->cursector, info_r->nsectors);
@@ -594,14 +617,18 @@ copy_main (int argc, char **argv)
 		if (backup_has_error (info_b))
 		{
 			backup_perror (info_b, "Copy source");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
 		if (restore_has_error (info_r))
 		{
 			restore_perror (info_r, "Copy target");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
+
+		tivo_partition_buffer_free (buf);
 	}
 
 	if (backup_finish (info_b) < 0)
@@ -633,6 +660,15 @@ copy_main (int argc, char **argv)
 	if (quiet < 2)
 		fprintf (stderr, "Copy done!\n");
 
+	if (quiet < 1)
+	{
+		uint64_t hinted, hits, misses;
+
+		mfs_readahead_stats (info_b->mfs, &hinted, &hits, &misses);
+		if (hits + misses > 0)
+			fprintf (stderr, "Readahead: %llu mb hinted, %llu%% of planned reads hinted in time\n", (unsigned long long) hinted / 2048, (unsigned long long) (hits * 100 / (hits + misses)));
+	}
+
 	if (expand > 0)
 	{
 		int blocksize = 0x800;
@@ -1069,15 +1069,30 @@ mfsd_main (int argc, char **argv)
 		}
 		else
 		{
-			int nread = mfs_read_data (mfs, buf, sector, count);
+/* Only dump up to the end of the volume, so a dump near the end shows */
+/* what is there instead of failing. */
+			struct volume_info *vol = mfsvol_get_volume (mfs->vols, sector);
+			unsigned char *data;
 
-			if (nread <= 0)
+			if (vol && sector + count > vol->start + vol->sectors)
+				count = vol->start + vol->sectors - sector;
+
+/* Dump straight out of the volume if it is mapped. */
+			data = mfs_map_data (mfs, buf, sector, count);
+
+			if (!data)
 			{
 				mfs_perror (mfs, "Read data");
 				return 1;
 			}
 
-			bufsize = nread;
+/* The buffer isn't needed if the data is mapped. */
+			if (data != buf)
+			{
+				free (buf);
+				buf = data;
+			}
+			bufsize = count * 512;
 		}
 	}
 	else if (logstamp != 0xdeadbeef)
@@ -0,0 +1,249 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+/* For ftruncate64 */
+#define _LARGEFILE64_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "mfs.h"
+
+/* Sectors copied at a time by pack and unpack. */
+#define MFSIMAGE_CHUNK 2048
+
+void
+mfsimage_usage (char *progname)
+{
+	fprintf (stderr, "Usage:\n");
+	fprintf (stderr, "%s create image size\n", progname);
+	fprintf (stderr, "%s pack source image [cluster]\n", progname);
+	fprintf (stderr, "%s unpack image destination\n", progname);
+	fprintf (stderr, "%s info image\n", progname);
+	fprintf (stderr, "\n");
+	fprintf (stderr, "Compressed images can be used anywhere a drive or image file can.  Runs\n");
+	fprintf (stderr, "of zeros take no space and the rest is compressed in clusters, so a\n");
+	fprintf (stderr, "read only decompresses the clusters it needs.  Size is in bytes, and\n");
+	fprintf (stderr, "may be followed by K, M, G or T.  Pack makes a compressed image from a\n");
+	fprintf (stderr, "drive or image file, and cluster is in sectors, %d by default.  Unpack\n", TIVO_CIMAGE_CLUSTER);
+	fprintf (stderr, "writes it back out to a drive or plain image file.\n");
+}
+
+/***************************************************************************/
+/* Parse a size in bytes with an optional suffix, returning it in sectors. */
+static uint64_t
+mfsimage_parse_size (const char *str)
+{
+	char *end;
+	uint64_t size = strtoull (str, &end, 10);
+
+	switch (*end)
+	{
+	case 't':
+	case 'T':
+		size *= 1024;
+	case 'g':
+	case 'G':
+		size *= 1024;
+	case 'm':
+	case 'M':
+		size *= 1024;
+	case 'k':
+	case 'K':
+		size *= 1024;
+		end++;
+	}
+
+	if (*end)
+		return 0;
+
+	return size / 512;
+}
+
+/****************************************************************/
+/* Copy the whole of one drive or image to another of its size. */
+static int
+mfsimage_copy (char *srcname, char *dstname)
+{
+	tpFILE *src, *dst;
+	unsigned char *buf;
+	uint64_t size;
+	uint64_t done;
+	int retval = 0;
+
+	src = tivo_partition_open (srcname, O_RDONLY);
+	if (!src)
+	{
+		perror (srcname);
+		return -1;
+	}
+
+	dst = tivo_partition_open (dstname, O_RDWR);
+	if (!dst)
+	{
+		perror (dstname);
+		tivo_partition_close (src);
+		return -1;
+	}
+
+	size = tivo_partition_size (src);
+	buf = tivo_partition_buffer_alloc (MFSIMAGE_CHUNK * 512);
+	if (!buf)
+	{
+		fprintf (stderr, "Out of memory!\n");
+		retval = -1;
+	}
+
+	for (done = 0; buf && done < size; done += MFSIMAGE_CHUNK)
+	{
+		int count = size - done > MFSIMAGE_CHUNK? MFSIMAGE_CHUNK: size - done;
+
+		if (tivo_partition_read (src, buf, done, count) != count * 512)
+		{
+			fprintf (stderr, "%s: Error reading sector %llu\n", srcname, (unsigned long long) done);
+			retval = -1;
+			break;
+		}
+
+		if (tivo_partition_write (dst, buf, done, count) != count * 512)
+		{
+			fprintf (stderr, "%s: Error writing sector %llu: %s\n", dstname, (unsigned long long) done, strerror (errno));
+			retval = -1;
+			break;
+		}
+	}
+
+	tivo_partition_buffer_free (buf);
+	tivo_partition_close (dst);
+	tivo_partition_close (src);
+
+	if (tivo_partition_cimage_sync () < 0)
+		retval = -1;
+
+	return retval;
+}
+
+/**************************************************/
+/* Print how much space an image is really using. */
+static int
+mfsimage_info (char *name)
+{
+	struct tivo_partition_cimage_header hdr;
+	uint64_t clusters, bytes;
+	struct stat st;
+
+	if (tivo_partition_cimage_probe (name, &hdr) < 0 || tivo_partition_cimage_usage (name, &clusters, &bytes) < 0 || stat (name, &st) < 0)
+	{
+		fprintf (stderr, "%s: %s\n", name, errno == EINVAL? "Not a compressed image": strerror (errno));
+		return 1;
+	}
+
+	fprintf (stderr, "%s: %lluMiB drive in clusters of %u sectors\n", name, (unsigned long long) hdr.sectors / (1024 * 2), hdr.cluster);
+	fprintf (stderr, "%llu of %llu clusters stored in %lluMiB, image file is %lluMiB\n", (unsigned long long) clusters, (unsigned long long) (hdr.sectors + hdr.cluster - 1) / hdr.cluster, (unsigned long long) bytes / (1024 * 1024), (unsigned long long) st.st_size / (1024 * 1024));
+
+	return 0;
+}
+
+int
+mfsimage_main (int argc, char **argv)
+{
+	tpFILE *file;
+
+	if (argc < 3)
+	{
+		mfsimage_usage (argv[0]);
+		return 1;
+	}
+
+	if (!strcmp (argv[1], "info") && argc == 3)
+	{
+		return mfsimage_info (argv[2]);
+	}
+
+	if (!strcmp (argv[1], "create") && argc == 4)
+	{
+		uint64_t size = mfsimage_parse_size (argv[3]);
+
+		if (size == 0)
+		{
+			mfsimage_usage (argv[0]);
+			return 1;
+		}
+
+		if (tivo_partition_cimage_create (argv[2], size, 0) < 0)
+		{
+			perror (argv[2]);
+			return 1;
+		}
+
+		return mfsimage_info (argv[2]);
+	}
+
+	if (!strcmp (argv[1], "pack") && (argc == 4 || argc == 5))
+	{
+		unsigned int cluster = argc == 5? strtoul (argv[4], NULL, 0): 0;
+
+		file = tivo_partition_open (argv[2], O_RDONLY);
+		if (!file)
+		{
+			perror (argv[2]);
+			return 1;
+		}
+
+		if (tivo_partition_cimage_create (argv[3], tivo_partition_size (file), cluster) < 0)
+		{
+			perror (argv[3]);
+			return 1;
+		}
+		tivo_partition_close (file);
+
+		if (mfsimage_copy (argv[2], argv[3]) < 0)
+			return 1;
+
+		return mfsimage_info (argv[3]);
+	}
+
+	if (!strcmp (argv[1], "unpack") && argc == 4)
+	{
+		struct stat st;
+
+		file = tivo_partition_open (argv[2], O_RDONLY);
+		if (!file)
+		{
+			perror (argv[2]);
+			return 1;
+		}
+
+/* Drives are written as they are, anything else is made into a sparse */
+/* image file of the right size. */
+		if (stat (argv[3], &st) < 0 || !S_ISBLK (st.st_mode))
+		{
+#ifdef O_LARGEFILE
+			int fd = open (argv[3], O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+#else
+			int fd = open (argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+
+			if (fd < 0 || ftruncate64 (fd, (off64_t) tivo_partition_size (file) * 512) < 0)
+			{
+				perror (argv[3]);
+				return 1;
+			}
+			close (fd);
+		}
+		tivo_partition_close (file);
+
+		if (mfsimage_copy (argv[2], argv[3]) < 0)
+			return 1;
+
+		return 0;
+	}
+
+	mfsimage_usage (argv[0]);
+	return 1;
+}
@@ -0,0 +1,98 @@
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include "mfs.h"
+
+void
+mfsoverlay_usage (char *progname)
+{
+	fprintf (stderr, "Usage:\n");
+#if TARGET_OS_MAC
+	fprintf (stderr, "%s commit overlayfile /dev/diskX [/dev/diskY]\n", progname);
+#else
+	fprintf (stderr, "%s commit overlayfile /dev/hdX [/dev/hdY]\n", progname);
+#endif
+	fprintf (stderr, "%s discard overlayfile\n", progname);
+	fprintf (stderr, "\n");
+	fprintf (stderr, "Overlay files hold changes made without touching the drive.  They are\n");
+	fprintf (stderr, "written by mfsadd and restore with -n, or whenever MFS_OVERLAY_FILE is set.\n");
+	fprintf (stderr, "MFS_MEMWRITE_LIMIT sets how many sectors of changes are held in memory\n");
+	fprintf (stderr, "before spilling to them.\n");
+}
+
+int
+mfsoverlay_main (int argc, char **argv)
+{
+	struct volume_overlay_header hdr;
+	struct volume_handle *vols;
+	char *names;
+
+	if (argc < 3)
+	{
+		mfsoverlay_usage (argv[0]);
+		return 1;
+	}
+
+	if (mfsvol_overlay_info (argv[2], &hdr) < 0)
+	{
+		fprintf (stderr, "%s: %s\n", argv[2], errno == EINVAL? "Not an overlay file": strerror (errno));
+		return 1;
+	}
+
+	fprintf (stderr, "Overlay %s has %u extents for a %lluMiB volume set, logstamp %u\n", argv[2], hdr.extents, (unsigned long long) hdr.sectors / (1024 * 2), hdr.logstamp);
+
+	if (!strcmp (argv[1], "discard") && argc == 3)
+	{
+		if (unlink (argv[2]) < 0)
+		{
+			perror (argv[2]);
+			return 1;
+		}
+
+		fprintf (stderr, "Overlay discarded\n");
+		return 0;
+	}
+
+	if (strcmp (argv[1], "commit") || argc < 4 || argc > 5)
+	{
+		mfsoverlay_usage (argv[0]);
+		return 1;
+	}
+
+/* Open the volume set the overlay was made on, which may be bigger than */
+/* the one the volume header on disk knows about yet. */
+	vols = mfsvol_init (argv[3], argc == 5? argv[4]: NULL);
+	if (!vols)
+	{
+		fprintf (stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	for (names = hdr.volumes; *names; names += strspn (names, " "))
+	{
+		if (mfsvol_add_volume (vols, names, O_RDWR) < 0)
+		{
+			mfsvol_perror (vols, argv[0]);
+			return 1;
+		}
+
+		names += strcspn (names, " ");
+	}
+
+	if (mfsvol_overlay_commit (vols, argv[2]) < 0)
+	{
+		mfsvol_perror (vols, argv[0]);
+		return 1;
+	}
+
+	mfsvol_cleanup (vols);
+
+	fprintf (stderr, "Overlay committed\n");
+	return 0;
+}
@@ -2,6 +2,7 @@
 #include <config.h>
 #endif
 #include <unistd.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
@@ -35,6 +36,12 @@ extern int mfsinfo_main (int, char **);
 #if BUILD_MFSCK
 extern int mfsck_main (int, char **);
 #endif
+#if BUILD_MFSOVERLAY
+extern int mfsoverlay_main (int, char **);
+#endif
+#if BUILD_MFSIMAGE
+extern int mfsimage_main (int, char **);
+#endif
 
 struct {
 	char *name;
@@ -64,6 +71,12 @@ struct {
 #endif
 #if BUILD_MFSINFO
 	{"info", mfsinfo_main, "Display information about MFS volume."},
+#endif
+#if BUILD_MFSOVERLAY
+	{"overlay", mfsoverlay_main, "Commit or discard an MFS overlay file."},
+#endif
+#if BUILD_MFSIMAGE
+	{"image", mfsimage_main, "Create, pack and unpack compressed drive images."},
 #endif
 	{0, 0, 0}
 };
@@ -83,28 +96,79 @@ find_function (char *name)
 	return 0;
 }
 
+/***************************************************************************/
+/* Run a function, and any more after it separated by --then.  They all */
+/* run in this process, so a drive held in memory can be set up by one and */
+/* worked on by the next.  This stops at the first one that fails. */
+static int
+run_functions (mainfunc toolmain, int argc, char **argv)
+{
+	int retval;
+	int loop;
+
+	for (;;)
+	{
+		for (loop = 0; loop < argc && strcmp (argv[loop], "--then"); loop++)
+			;
+
+		if (loop == argc)
+			return toolmain (argc, argv);
+
+		argv[loop] = NULL;
+		retval = toolmain (loop, argv);
+		if (retval)
+			return retval;
+
+		argc -= loop + 1;
+		argv += loop + 1;
+
+		if (argc < 1 || !(toolmain = find_function (argv[0])))
+		{
+			fprintf (stderr, "Unknown function after --then: %s\n", argc < 1? "(none)": argv[0]);
+			return 1;
+		}
+
+/* Each function parses its own options from the start. */
+		optind = 1;
+	}
+}
+
 int
 main (int argc, char **argv)
 {
 	mainfunc toolmain;
 	char *tmp;
-	int loop;
+	int loop, loop2;
+
+/* --stats works with any function, by turning on the volume I/O */
+/* statistics before the function sees its arguments. */
+	for (loop = 1, loop2 = 1; loop < argc; loop++)
+	{
+		if (!strcmp (argv[loop], "--stats"))
+			putenv ("MFS_STATS=1");
+		else
+			argv[loop2++] = argv[loop];
+	}
+	argv[loop2] = NULL;
+	argc = loop2;
 
 	tmp = strrchr(argv[0], '/');
 	tmp = tmp? tmp + 1: argv[0];
 
 	if ((toolmain = find_function (tmp)))
 	{
-		return toolmain (argc, argv);
+		return run_functions (toolmain, argc, argv);
 	}
 
 	if (argc > 1 && (toolmain = find_function (argv[1])))
 	{
-		return toolmain (argc - 1, argv + 1);
+		return run_functions (toolmain, argc - 1, argv + 1);
 	}
 
 	fprintf (stderr, "%s %s\n", PACKAGE, VERSION);
 	fprintf (stderr, "Usage: %s <function> <args> or <function> <args>\n", argv[0]);
+	fprintf (stderr, "Add --stats to any function to print volume I/O statistics.\n");
+	fprintf (stderr, "Run more functions in the same process with --then <function> <args>.\n");
 	fprintf (stderr, "Available functions:\n");
 	for (loop = 0; funcs[loop].name; loop++)
 		fprintf (stderr, "  %-10s%s\n", funcs[loop].name, funcs[loop].desc);
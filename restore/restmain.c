@@ -37,6 +37,8 @@ restore_usage (char *progname)
 	fprintf (stderr, " -B        Force byte swapping on restore\n");
 	fprintf (stderr, " -z        Zero out partitions not backed up\n");
 	fprintf (stderr, " -M 32/64  Write MFS structures as 32 or 64 bit\n");
+	fprintf (stderr, " -n file   Save MFS to overlay file for mfsoverlay to commit, instead\n");
+	fprintf (stderr, "           of to the drive (The rest of the drive is still written)\n");
 }
 
 static unsigned int
@@ -65,7 +67,7 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	unsigned int maxfree = tivo_partition_largest_free (realdev);
 	unsigned int totalfree = tivo_partition_total_free (realdev);
 	unsigned int used = maxfree & ~(blocksize - 1);
-	unsigned int required = mfs_volume_pair_app_size (mfshnd, used, blocksize);
+	unsigned int required = tivo_partition_align_size (realdev, mfs_volume_pair_app_size (mfshnd, used, blocksize));
 	unsigned int part1, part2;
 	char app[MAXPATHLEN];
 	char media[MAXPATHLEN];
@@ -77,7 +79,7 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	if (totalfree - maxfree < required && maxfree - used < required)
 	{
 		used = (maxfree - required) & ~(blocksize - 1);
-		required = mfs_volume_pair_app_size (mfshnd, used, blocksize);
+		required = tivo_partition_align_size (realdev, mfs_volume_pair_app_size (mfshnd, used, blocksize));
 	}
 
 	if (totalfree - maxfree >= required && maxfree - used < required)
@@ -111,6 +113,8 @@ expand_drive (struct mfs_handle *mfshnd, char *tivodev, char *realdev, unsigned
 	if (tivo_partition_table_write (realdev) < 0)
 		return -1;
 
+	tivo_partition_print_alignment (realdev);
+
 	if (mfs_add_volume_pair (mfshnd, app, media, blocksize) < 0)
 		return -1;
 
@@ -133,10 +137,12 @@ restore_main (int argc, char **argv)
 	int expand = 0;
 	int expandscale = 2;
 	int restorebits = 0;
+	char *overlay = 0;
+	struct volume_overlay_header hdr;
 
 	tivo_partition_direct ();
 
-	while ((opt = getopt (argc, argv, "hi:v:s:zqbBpxlr:M:")) > 0)
+	while ((opt = getopt (argc, argv, "hi:v:s:zqbBpxlr:M:n:")) > 0)
 	{
 		switch (opt)
 		{
@@ -217,6 +223,9 @@ restore_main (int argc, char **argv)
 				return 1;
 			}
 			break;
+		case 'n':
+			overlay = optarg;
+			break;
 		default:
 			restore_usage (argv[0]);
 			return 1;
@@ -251,6 +260,21 @@ restore_main (int argc, char **argv)
 	if (expand > 0)
 		flags |= RF_NOFILL;
 
+/* Expanding adds partitions to the MFS volume set, which the overlay file */
+/* can't hold. */
+	if (overlay)
+	{
+		if (expand > 0)
+		{
+			fprintf (stderr, "%s: Can not expand the backup with -n.\n", argv[0]);
+			return 1;
+		}
+
+		flags |= RF_MEMWRITE;
+		setenv ("MFS_OVERLAY_FILE", overlay, 1);
+		setenv ("MFS_MEMWRITE_LIMIT", "65536", 0);
+	}
+
 	info = init_restore (flags);
 	if (restore_has_error (info))
 	{
@@ -262,9 +286,15 @@ restore_main (int argc, char **argv)
 	{
 		unsigned starttime;
 		int fd, nread, nwrit;
-		char buf[BUFSIZE];
+		char *buf = tivo_partition_buffer_alloc (BUFSIZE);
 		unsigned int cursec = 0, curcount;
 
+		if (!buf)
+		{
+			fprintf (stderr, "Out of memory!\n");
+			return 1;
+		}
+
 		if (varsize)
 			restore_set_varsize (info, varsize);
 		if (swapsize)
@@ -288,6 +318,7 @@ restore_main (int argc, char **argv)
 		if (fd < 0)
 		{
 			perror (filename);
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -295,6 +326,7 @@ restore_main (int argc, char **argv)
 		if (nread <= 0)
 		{
 			fprintf (stderr, "Restore failed: %s: %s\n", filename, strerror(errno));
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -305,6 +337,7 @@ restore_main (int argc, char **argv)
 				restore_perror (info, "Restore");
 			else
 				fprintf (stderr, "Restore failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -324,6 +357,7 @@ restore_main (int argc, char **argv)
 				restore_perror (info, "Restore");
 			else
 				fprintf (stderr, "Restore failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -333,15 +367,25 @@ restore_main (int argc, char **argv)
 				restore_perror (info, "Restore");
 			else
 				fprintf (stderr, "Restore failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
+		if (quiet < 1)
+		{
+			int loop;
+
+			for (loop = 0; loop < info->ndevs; loop++)
+				tivo_partition_print_alignment (info->devs[loop].devname);
+		}
+
 		if (restore_write (info, buf + nwrit, nread - nwrit) != nread - nwrit)
 		{
 			if (restore_has_error (info))
 				restore_perror (info, "Restore");
 			else
 				fprintf (stderr, "Restore failed.\n");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
 
@@ -359,6 +403,7 @@ restore_main (int argc, char **argv)
 					restore_perror (info, "Restore");
 				else
 					fprintf (stderr, "Restore failed.\n");
+				tivo_partition_buffer_free (buf);
 				return 1;
 			}
 			cursec += curcount / 512;
@@ -387,8 +432,11 @@ restore_main (int argc, char **argv)
 		if (restore_has_error (info))
 		{
 			restore_perror (info, "Restore");
+			tivo_partition_buffer_free (buf);
 			return 1;
 		}
+
+		tivo_partition_buffer_free (buf);
 	}
 	else
 	{
@@ -411,6 +459,19 @@ restore_main (int argc, char **argv)
 	if (quiet < 2)
 		fprintf (stderr, "Restore done!\n");
 
+/* Closing the volume set writes out the overlay file. */
+	if (overlay)
+	{
+		mfs_cleanup (info->mfs);
+		info->mfs = 0;
+
+		if (mfsvol_overlay_info (overlay, &hdr) < 0)
+			return 1;
+
+		if (quiet < 2)
+			fprintf (stderr, "MFS saved to %s, use mfsoverlay to commit it\n", overlay);
+	}
+
 	if (expand > 0)
 	{
 		int blocksize = 0x800;
@@ -33,6 +33,10 @@
 #define RESTORE
 #include "backup.h"
 
+/* Partitions build_partition_table puts on the first drive ahead of MFS, */
+/* from the partition map through /var.  See partition_strings. */
+#define RESTORE_FIXED_PARTS 9
+
 /*************************************************/
 /* Initializes the backup structure for restore. */
 struct backup_info *
@@ -237,6 +241,7 @@ restore_state_partitions (struct backup_info *info, void *data, unsigned size, u
 {
 	tpFILE *file;
 	int tocopy = info->parts[info->state_val1].sectors - info->state_val2;
+	int retval;
 
 	if (size == 0)
 	{
@@ -269,7 +274,18 @@ restore_state_partitions (struct backup_info *info, void *data, unsigned size, u
 		}
 	}
 
-	if (tivo_partition_write (file, data, info->state_val2, tocopy) < 0)
+/* For a byte-swapped partition, swap the data while computing the CRC and */
+/* write it as is.  The data is consumed, so it doesn't need swapping back. */
+	if (_tivo_partition_swab (file))
+	{
+		info->crc = compute_crc_combine (info->crc, compute_crc_swab (data, tocopy * 512, 0), tocopy * 512);
+		info->crc_done = 1;
+		retval = tivo_partition_write_raw (file, data, info->state_val2, tocopy);
+	}
+	else
+		retval = tivo_partition_write (file, data, info->state_val2, tocopy);
+
+	if (retval < 0)
 	{
 		info->err_msg = "%s backing up partitions";
 		if (errno)
@@ -346,6 +362,7 @@ restore_next_sectors (struct backup_info *info, char *buf, int sectors)
 		}
 
 		consumed = 0;
+		info->crc_done = 0;
 
 		ret = ((*info->state_machine)[info->state]) (info, buf, sectors, &consumed);
 
@@ -389,7 +406,8 @@ restore_next_sectors (struct backup_info *info, char *buf, int sectors)
 		{
 /* Probably should be before for restore, but some day this may be merged */
 /* with backup, so keep the code identical */
-			info->crc = compute_crc (buf, consumed * 512, info->crc);
+			if (!info->crc_done)
+				info->crc = compute_crc_combine (info->crc, compute_crc (buf, consumed * 512, 0), consumed * 512);
 			info->cursector += consumed;
 			restore_blocks += consumed;
 			sectors -= consumed;
@@ -511,7 +529,7 @@ restore_write (struct backup_info *info, char *buf, unsigned int size)
 
 			if (info->back_flags & BF_COMPRESSED)
 			{
-				info->comp_buf = calloc (2048, 512);
+				info->comp_buf = tivo_partition_buffer_alloc (2048 * 512);
 				if (!info->comp_buf)
 				{
 					info->err_msg = "Memory exhausted";
@@ -520,7 +538,7 @@ restore_write (struct backup_info *info, char *buf, unsigned int size)
 				info->comp = calloc (sizeof (*info->comp), 1);
 				if (!info->comp)
 				{
-					free (info->comp_buf);
+					tivo_partition_buffer_free (info->comp_buf);
 					info->err_msg = "Memory exhausted";
 					return -1;
 				}
@@ -535,7 +553,7 @@ restore_write (struct backup_info *info, char *buf, unsigned int size)
 
 				if (inflateInit (info->comp) != Z_OK)
 				{
-					free (info->comp_buf);
+					tivo_partition_buffer_free (info->comp_buf);
 					free (info->comp);
 					info->err_msg = "Deompression error";
 					return -1;
@@ -779,6 +797,9 @@ restore_trydev (struct backup_info *info, char *dev1, char *dev2)
 		return -1;
 	}
 
+	if (info->back_flags & RF_MEMWRITE)
+		mfsvol_enable_memwrite (info->vols);
+
 	if (tivo_partition_devswabbed (dev1))
 		swab1 ^= 1;
 	if (dev2 && *dev2 && tivo_partition_devswabbed (dev2))
@@ -873,6 +894,11 @@ restore_trydev (struct backup_info *info, char *dev1, char *dev2)
 /* (Boot sector, partition table uncounted) swap, var, mfs set 1 */
 	min1 += info->swapsize + info->varsize + info->mfsparts[0].sectors + info->mfsparts[1].sectors;
 
+/* Leave room for aligning each partition to the physical sectors. */
+	min1 += (tivo_partition_alignment (dev1) - 1) * (RESTORE_FIXED_PARTS + info->nmfs);
+	if (dev2 && *dev2 && secs2 > (tivo_partition_alignment (dev2) - 1) * info->nmfs)
+		secs2 -= (tivo_partition_alignment (dev2) - 1) * info->nmfs;
+
 #if DEBUG
 	fprintf (stderr, "Minimum drive 1 size: %d\n", min1);
 #endif
@@ -1142,6 +1168,7 @@ build_partition_table (struct backup_info *info, int devno)
 /* big endian. */
 			unsigned char partno = info->newparts[loop].partno;
 			unsigned char tmppartno = partno;
+			uint64_t sectors = info->newparts[loop].sectors;
 
 			while (partitions[tmppartno - 1] > partno)
 				tmppartno--;
@@ -1150,7 +1177,13 @@ build_partition_table (struct backup_info *info, int devno)
 				memmove (&partitions[tmppartno + 1], &partitions[tmppartno], 15 - tmppartno);
 			partitions[tmppartno] = partno;
 
-			tivo_partition_add (info->devs[devno].devname, info->newparts[loop].sectors, tmppartno, partition_strings[devno][partno][0], partition_strings[devno][partno][1]);
+/* Round the size up so the next partition starts aligned, too.  MFS */
+/* partitions only get rounded if it doesn't change the size of the volume. */
+			sectors = tivo_partition_align_size (info->devs[devno].devname, sectors);
+			if (!strcmp (partition_strings[devno][partno][1], "MFS") && (sectors & ~(MFS_PARTITION_ROUND - 1)) != (info->newparts[loop].sectors & ~(MFS_PARTITION_ROUND - 1)))
+				sectors = info->newparts[loop].sectors;
+
+			tivo_partition_add (info->devs[devno].devname, sectors, tmppartno, partition_strings[devno][partno][0], partition_strings[devno][partno][1]);
 		}
 	}
 
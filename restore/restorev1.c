@@ -228,6 +228,7 @@ enum backup_state_ret
 restore_state_blocks_v1 (struct backup_info *info, void *data, unsigned size, unsigned *consumed)
 {
 	int tocopy = info->blocks[info->state_val1].sectors - info->state_val2;
+	int retval;
 
 	if (size == 0)
 	{
@@ -241,7 +242,18 @@ restore_state_blocks_v1 (struct backup_info *info, void *data, unsigned size, un
 		tocopy = size;
 	}
 
-	if (mfsvol_write_data (info->vols, data, info->blocks[info->state_val1].firstsector + info->state_val2, tocopy) < 0)
+/* On a byte-swapped drive, swap the data while computing the CRC and write */
+/* it as is.  The data is consumed, so it doesn't need swapping back. */
+	if (mfsvol_is_swabbed (info->vols))
+	{
+		info->crc = compute_crc_combine (info->crc, compute_crc_swab (data, tocopy * 512, 0), tocopy * 512);
+		info->crc_done = 1;
+		retval = mfsvol_write_data_raw (info->vols, data, info->blocks[info->state_val1].firstsector + info->state_val2, tocopy);
+	}
+	else
+		retval = mfsvol_write_data (info->vols, data, info->blocks[info->state_val1].firstsector + info->state_val2, tocopy);
+
+	if (retval < 0)
 	{
 		info->err_msg = "%s restoring MFS data";
 		if (errno)
@@ -296,15 +308,23 @@ restore_state_complete_v1 (struct backup_info *info, void *data, unsigned size,
 	if (restore_fixup_zone_maps (info) < 0)
 		return bsError;
 
-	mfsvol_cleanup (info->vols);
+	if (info->back_flags & RF_MEMWRITE)
+		info->mfs = mfs_init_volumes (info->vols, O_RDWR);
+	else
+	{
+		mfsvol_cleanup (info->vols);
+		info->mfs = mfs_init (info->devs[0].devname, info->ndevs > 1? info->devs[1].devname: NULL, O_RDWR);
+	}
 	info->vols = 0;
-	info->mfs = mfs_init (info->devs[0].devname, info->ndevs > 1? info->devs[1].devname: NULL, O_RDWR);
 	if (!info->mfs || mfs_has_error (info->mfs))
 		return bsError;
+	mfs_set_writeback (info->mfs, MFSVOL_WRITEBACK_DEFAULT);
 	if (restore_fudge_inodes (info) < 0)
 		return bsError;
 	if (restore_fudge_transactions (info) < 0)
 		return bsError;
+	if (mfs_flush (info->mfs) < 0)
+		return bsError;
 
 #if HAVE_SYNC
 /* Make sure changes are committed to disk */
@@ -335,70 +355,78 @@ backup_state_handler restore_v1 = {
 	restore_state_complete_v1				// bsComplete
 };
 
-int
-restore_fudge_inodes (struct backup_info *info)
+/**************************************************************************/
+/* Drop any extents of a stream inode that are past the end of the shrunk */
+/* volume set, called through mfs_scan_inodes. */
+static int
+restore_fudge_inode (struct mfs_handle *mfs, unsigned int inodeno, mfs_inode *in, void *arg)
 {
-	unsigned int loop, count;
+	struct backup_info *info = arg;
 	uint64_t total;
+	unsigned char buf[512];
+	mfs_inode *inode = (mfs_inode *)buf;
+	int loop2;
+	int changed = 0;
 
-	if (!(info->back_flags & BF_SHRINK))
+	if (!in || in->type != tyStream)
 		return 0;
 
-	count = mfs_inode_count (info->mfs);
+/* The inode may be in a mapping of the volume, so change a copy. */
+	memcpy (buf, in, 512);
 	total = mfs_volume_set_size (info->mfs);
 
-	for (loop = 0; loop < count; loop++)
+	if (mfs_is_64bit (info->mfs))
 	{
-		mfs_inode *inode = mfs_read_inode (info->mfs, loop);
-
-		if (inode)
+		for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
+		{
+			if (intswap64 (inode->datablocks.d64[loop2].sector) >= total)
+			{
+				inode->blockused = 0;
+				changed = 1;
+				inode->numblocks = intswap32 (intswap32 (inode->numblocks) - 1);
+				if (loop2 < intswap32 (inode->numblocks))
+					memmove (&inode->datablocks.d64[loop2], &inode->datablocks.d64[loop2 + 1], sizeof (*inode->datablocks.d64) * (intswap32 (inode->numblocks) - loop2));
+				loop2--;
+			}
+		}
+	}
+	else
+	{
+		for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
 		{
-			if (inode->type == tyStream)
+			if (intswap32 (inode->datablocks.d32[loop2].sector) >= total)
 			{
-				int loop2;
-				int changed = 0;
+				inode->blockused = 0;
+				changed = 1;
+				inode->numblocks = intswap32 (intswap32 (inode->numblocks) - 1);
+				if (loop2 < intswap32 (inode->numblocks))
+					memmove (&inode->datablocks.d32[loop2], &inode->datablocks.d32[loop2 + 1], sizeof (*inode->datablocks.d32) * (intswap32 (inode->numblocks) - loop2));
+				loop2--;
+			}
+		}
+	}
 
-				if (mfs_is_64bit (info->mfs))
-				{
-					for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
-					{
-						if (intswap64 (inode->datablocks.d64[loop2].sector) >= total)
-						{
-							inode->blockused = 0;
-							changed = 1;
-							inode->numblocks = intswap32 (intswap32 (inode->numblocks) - 1);
-							if (loop2 < intswap32 (inode->numblocks))
-								memmove (&inode->datablocks.d64[loop2], &inode->datablocks.d64[loop2 + 1], sizeof (*inode->datablocks.d64) * (intswap32 (inode->numblocks) - loop2));
-							loop2--;
-						}
-					}
-				}
-				else
-				{
-					for (loop2 = 0; loop2 < intswap32 (inode->numblocks); loop2++)
-					{
-						if (intswap32 (inode->datablocks.d32[loop2].sector) >= total)
-						{
-							inode->blockused = 0;
-							changed = 1;
-							inode->numblocks = intswap32 (intswap32 (inode->numblocks) - 1);
-							if (loop2 < intswap32 (inode->numblocks))
-								memmove (&inode->datablocks.d32[loop2], &inode->datablocks.d32[loop2 + 1], sizeof (*inode->datablocks.d32) * (intswap32 (inode->numblocks) - loop2));
-							loop2--;
-						}
-					}
-				}
+	if (changed)
+		if (mfs_write_inode (info->mfs, inode) < 0)
+		{
+			info->err_msg = "Error fixing up inodes";
+			return -1;
+		}
 
-				if (changed)
-					if (mfs_write_inode (info->mfs, inode) < 0)
-					{
-						info->err_msg = "Error fixing up inodes";
-						return -1;
-					}
+	return 0;
+}
 
-			}
-			free (inode);
-		}
+int
+restore_fudge_inodes (struct backup_info *info)
+{
+	if (!(info->back_flags & BF_SHRINK))
+		return 0;
+
+	if (mfs_scan_inodes (info->mfs, restore_fudge_inode, info) != 0)
+	{
+		if (!info->err_msg)
+			info->err_msg = "Error fixing up inodes";
+		return -1;
 	}
 
 	return 0;
@@ -705,14 +705,18 @@ restore_state_volume_header_v3 (struct backup_info *info, void *data, unsigned s
 
 	*consumed = 1;
 
-/* Enough of MFS is initialized to go through mfs calls now */
-	mfsvol_cleanup (info->vols);
+/* Enough of MFS is initialized to go through mfs calls now.  Writes held */
+/* in memory aren't on disk to be opened again, so keep the same volumes. */
+	if (info->back_flags & RF_MEMWRITE)
+		info->mfs = mfs_init_volumes (info->vols, O_RDWR);
+	else
+	{
+		mfsvol_cleanup (info->vols);
+		info->mfs = mfs_init (info->devs[0].devname, info->ndevs > 1? info->devs[1].devname: NULL, O_RDWR);
+	}
 
 	info->vols = 0;
 
-/* Initialize MFS at this point */
-	info->mfs = mfs_init (info->devs[0].devname, info->ndevs > 1? info->devs[1].devname: NULL, O_RDWR);
-
 	if (!info->mfs ||
 		do64bit && !mfs_is_64bit (info->mfs) ||
 		!do64bit && mfs_is_64bit (info->mfs) ||
@@ -731,6 +735,10 @@ restore_state_volume_header_v3 (struct backup_info *info, void *data, unsigned s
 /* loading the zone maps */
 	mfs_clearerror (info->mfs);
 
+/* The empty inodes and inode updates are many small writes, let them */
+/* gather up between the log commits */
+	mfs_set_writeback (info->mfs, MFSVOL_WRITEBACK_DEFAULT);
+
 	return bsNextState;
 }
 
@@ -961,7 +969,7 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 
 			if (mfs_write_inode_data_part (info->mfs, inode, (unsigned char *)data + *consumed * 512, info->state_val2, towrite) <= 0)
 			{
-				free (info->state_ptr1);
+				mfs_release_inode (info->mfs, inode);
 				info->state_ptr1 = NULL;
 				return bsError;
 			}
@@ -971,7 +979,7 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 
 			if (info->state_val2 >= info->shared_val1)
 			{
-				free (info->state_ptr1);
+				mfs_release_inode (info->mfs, inode);
 				info->state_ptr1 = NULL;
 				info->state_val1++;
 				numsincecommit++;
@@ -1031,7 +1039,12 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 			continue;
 		}
 
-		inode = malloc (512);
+		inode = mfs_inode_alloc (info->mfs);
+		if (!inode)
+		{
+			info->err_msg = "Out of memory";
+			return bsError;
+		}
 		memcpy (inode, (unsigned char *)data + *consumed * 512, 512);
 		info->state_ptr1 = inode;
 		++*consumed;
@@ -1117,7 +1130,8 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 				if (!mfs_alloc_greedy (info->mfs, inode, 0))
 				{
 					info->err_msg = "Out of space for video content";
-					free (inode);
+					mfs_release_inode (info->mfs, inode);
+					info->state_ptr1 = NULL;
 					return bsError;
 				}
 			}
@@ -1127,7 +1141,8 @@ restore_state_inodes_v3 (struct backup_info *info, void *data, unsigned size, un
 			if (!mfs_alloc_greedy (info->mfs, inode, 0))
 			{
 				info->err_msg = "Out of space for application content";
-				free (inode);
+				mfs_release_inode (info->mfs, inode);
+				info->state_ptr1 = NULL;
 				return bsError;
 			}
 		}
@@ -1189,6 +1204,8 @@ restore_state_complete_v3 (struct backup_info *info, void *data, unsigned size,
 		return bsError;
 	if (restore_fudge_transactions (info) < 0)
 		return bsError;
+	if (mfs_flush (info->mfs) < 0)
+		return bsError;
 
 #if HAVE_SYNC
 /* Make sure changes are committed to disk */